@@ -0,0 +1,69 @@
+// Helpers shared by the benchmark harnesses, which include minishell.c with MINISHELL_NO_MAIN
+// Every harness prints one JSON object per measurement on stdout, the format `make bench` records
+
+#include <time.h> // For clock_gettime()
+
+// Monotonic clock in nanoseconds
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Orders samples for percentile()
+static int compare_samples(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Sorts the samples and returns the one at fraction p of the way (nearest rank)
+static double percentile(double *samples, int count, double p)
+{
+    qsort(samples, count, sizeof(double), compare_samples);
+    int rank = (int)(p * count + 0.999999) - 1;
+    return samples[rank < 0 ? 0 : rank >= count ? count - 1 : rank];
+}
+
+// Name of the spawn backend selected on the command line, for the results
+static const char *spawn_name(void)
+{
+    static const char *names[] = {[SPAWN_POSIX] = "posix", [SPAWN_VFORK] = "vfork", [SPAWN_FORK] = "fork", [SPAWN_ZYGOTE] = "zygote"};
+    return names[spawnBackend];
+}
+
+// Brings the shell up like main does for a script, with the runtime options in argv[1...]
+// Leading numbers are the harness's own arguments and are skipped; returns how many there were
+static int bench_shell_init(int argc, char *argv[])
+{
+    int numbers = 0;
+    while (numbers + 1 < argc && isdigit((unsigned char)argv[numbers + 1][0]))
+        numbers++;
+    char *first = argv[numbers];
+    argv[numbers] = argv[0]; // parse_options skips its argv[0]
+    if (!parse_options(argc - numbers, argv + numbers))
+        exit(EXIT_FAILURE);
+    argv[numbers] = first;
+    env_init();
+    job_control_init(false);
+    if (spawnBackend == SPAWN_ZYGOTE)
+        zygote_start();
+    return numbers;
+}
+
+// Parses a private copy of line (parsing unquotes in place) and runs it, returning the time run_node took
+static double bench_run_line(const char *line, Arena *arena)
+{
+    Node *root = parse_line(arena_strndup(arena, line, strlen(line)), arena);
+    if (root == NULL)
+    {
+        fprintf(stderr, "bench: cannot parse %s\n", line);
+        exit(EXIT_FAILURE);
+    }
+    double start = now_ns();
+    run_node(root, arena);
+    double elapsed = now_ns() - start;
+    arena_reset(arena);
+    return elapsed;
+}
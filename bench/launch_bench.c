@@ -0,0 +1,63 @@
+// Latency of launching and waiting for 1-, 4- and 8-stage pipelines of /bin/true, as the shell runs them
+// Usage: launch_bench [launches per pipeline] [shell options, e.g. --spawn=zygote] (default 1000)
+
+#define MINISHELL_NO_MAIN
+#include "../minishell.c"
+#include "bench.h"
+
+#define LAUNCH_WARMUP 20 // Launches not measured, they fault the spawn path in
+
+int main(int argc, char *argv[])
+{
+    int numbers = bench_shell_init(argc, argv);
+    int launches = numbers > 0 ? atoi(argv[1]) : 1000;
+    if (launches < 1)
+        launches = 1;
+    static const int stageCounts[] = {1, 4, 8};
+
+    double *samples = malloc(launches * sizeof(double));
+    if (!samples)
+    {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    Arena arena = {NULL, NULL, NULL};
+    Arena lineArena = {NULL, NULL, NULL};
+
+    for (size_t c = 0; c < sizeof(stageCounts) / sizeof(stageCounts[0]); c++)
+    {
+        StrBuf line = {&lineArena, NULL, 0, 0};
+        for (int s = 0; s < stageCounts[c]; s++)
+            strbuf_printf(&line, "%s/bin/true", s ? " | " : "");
+
+        double total = 0;
+        for (int run = -LAUNCH_WARMUP; run < launches; run++)
+        {
+            double elapsed = bench_run_line(line.data, &arena);
+            if (lastStatus != 0)
+            {
+                fprintf(stderr, "launch_bench: %s exited with %d\n", line.data, lastStatus);
+                return EXIT_FAILURE;
+            }
+            if (run >= 0)
+            {
+                samples[run] = elapsed;
+                total += elapsed;
+            }
+        }
+
+        double p50 = percentile(samples, launches, 0.50);
+        double p99 = percentile(samples, launches, 0.99);
+        printf("{\"bench\":\"launch\",\"spawn\":\"%s\",\"stages\":%d,\"launches\":%d,"
+               "\"p50_us\":%.1f,\"p99_us\":%.1f,\"mean_us\":%.1f}\n",
+               spawn_name(), stageCounts[c], launches, p50 / 1e3, p99 / 1e3, total / launches / 1e3);
+        arena_reset(&lineArena);
+    }
+
+    if (spawnBackend == SPAWN_ZYGOTE)
+        zygote_stop();
+    arena_free(&arena);
+    arena_free(&lineArena);
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,185 @@
+// The original strtok/strstr/strspn parser of minishell, kept verbatim (only renamed) as the
+// baseline the single-pass tokenizer is measured and checked against
+// Callers must give each LegacyCommand an args array of LEGACY_MAX_ARGS pointers
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+
+#define LEGACY_MAX_LINE 1024  // Define a constant for maximum input line length
+#define LEGACY_MAX_ARGS 32    // Maximum number of arguments per command
+#define LEGACY_MAX_COMMANDS 8 // Max number of commands inside a pipeline
+
+// Single command struct
+typedef struct
+{
+    char *command;    // The command to execute
+    char **args;      // Arguments list, null-terminated
+    char *inputFile;  // Input redirection file, or NULL
+    char *outputFile; // Output redirection file, or NULL
+} LegacyCommand;
+
+// Function to trim leading and trailing whitespace in place
+void legacy_trim(char *str)
+{
+    char *end;
+
+    // Trim leading space
+    while (isspace((unsigned char)*str))
+        str++;
+
+    // If all spaces, str will point to '\0'
+    if (*str == 0)
+    {
+        return;
+    }
+
+    // Find the end of the string
+    end = str + strlen(str) - 1;
+
+    // Trim trailing space
+    while (end > str && isspace((unsigned char)*end))
+        end--;
+
+    // Write new null terminator
+    *(end + 1) = '\0';
+}
+
+// Function to parse a single command segment (without '|') into a Command structure
+void legacy_parse_single_command(char *segment, LegacyCommand *command)
+{
+    // Initialize pointers and counters at the start
+    command->command = NULL;
+    command->inputFile = NULL;
+    command->outputFile = NULL;
+    int argCount = 0; // Keep track of the number of arguments
+
+    // Tokenize the segment string using space as a delimiter
+    char *token = strtok(segment, " ");
+    command->command = token;          // The first token is the shell command itself
+    command->args[argCount++] = token; // The first token is also the first argument
+
+    // Iterate oiver the rest of the tokens to parse arguments and redirections
+    while (token != NULL)
+    {
+        token = strtok(NULL, " "); // Move to the next token
+        if (token == NULL)
+            break; // Skip NULL tokens
+
+        if (strcmp(token, "<") == 0)
+        { // If token is input redirection symbol
+            token = strtok(NULL, " ");
+            command->inputFile = token; // Next token is the input file name
+        }
+        else if (strcmp(token, ">") == 0)
+        { // If token is output redirection symbol
+            token = strtok(NULL, " ");
+            command->outputFile = token; // Next token is the output file name
+        }
+        else
+        {
+            // If it's not a redirection, consider it as part of the arguments
+            if (argCount < LEGACY_MAX_ARGS - 1)
+            { // Leave space for NULL terminator
+                command->args[argCount++] = token;
+            }
+        }
+    }
+
+    command->args[argCount] = NULL; // NULL-terminate the arguments array
+}
+
+// Returns true if input is valid, false if there is an error
+bool legacy_verify_input(char *input)
+{
+    size_t input_length = strlen(input);
+
+    // Remove newline character at the end, if present
+    if (input[input_length - 1] == '\n')
+    {
+        input[--input_length] = '\0'; // Adjust length accordingly
+    }
+
+    // Check if the input is empty or only whitespace
+    if (input_length == 0 || strspn(input, " ") == input_length)
+    {
+        printf("Error: Input is empty or contains only spaces.\n");
+        return false;
+    }
+
+    // Check for input length constraints
+    if (input_length >= LEGACY_MAX_LINE)
+    {
+        printf("Error: Input too long.\n");
+        return false;
+    }
+
+    // Check if the input starts or ends with a pipe
+    if (input[0] == '|' || input[input_length - 1] == '|')
+    {
+        printf("Error: Input cannot start or end with a pipe.\n");
+        return false;
+    }
+
+    // Check for two consecutive pipes or improperly placed spaces around pipes
+    if (strstr(input, "||") != NULL)
+    {
+        printf("Error: Improper use of pipes.\n");
+        return false;
+    }
+
+    // Verify if the input contains only pipes and/or spaces
+    if (strspn(input, " |") == input_length)
+    {
+        printf("Error: Input contains only pipes and spaces.\n");
+        return false;
+    }
+
+    // Count pipes to estimate number of commands
+    int pipe_count = 0;
+    for (int i = 0; i < input_length; i++)
+    {
+        if (input[i] == '|')
+            pipe_count++;
+    }
+    if (pipe_count >= LEGACY_MAX_COMMANDS)
+    {
+        printf("Error: Too many commands.\n");
+        return false;
+    }
+
+    return true; // Input is valid
+}
+
+// Function to parse user input into an array of Command structures
+void legacy_parse_input(char *input, LegacyCommand *commands, int *numCommands)
+{
+    *numCommands = 0;
+
+    // Trim leading and trailing whitespace
+    legacy_trim(input);
+
+    // Only proceed if the input is valid
+    if (!legacy_verify_input(input))
+    {
+        return;
+    }
+
+    char *segments[LEGACY_MAX_COMMANDS]; // Array to hold pointers to each command segment
+    char *segment;                // Pointer to the current segment
+
+    // First split by '|'
+    segment = strtok(input, "|");
+    while (segment != NULL && *numCommands < LEGACY_MAX_COMMANDS)
+    {
+        segments[(*numCommands)++] = segment; // Store the segment pointer
+        segment = strtok(NULL, "|");          // Move to the next segment
+    }
+
+    // Now parse each segment into a Command structure
+    for (int i = 0; i < *numCommands; i++)
+    {
+        legacy_parse_single_command(segments[i], &commands[i]);
+    }
+}
@@ -0,0 +1,180 @@
+// Microbenchmark of the single-pass tokenizer/parser against the original strtok-based parse_input,
+// then its lines per second over pipelines of several shapes
+// Usage: parse_bench [megabytes of synthetic input] (default 64)
+
+#define MINISHELL_NO_MAIN
+#include "../minishell.c"
+#include "legacy_parse.c"
+#include "bench.h"
+
+#define BENCH_RUNS 5          // Best of this many passes is reported
+#define SWEEP_BYTES (16 << 20) // Synthetic input per shape of the sweep
+
+// Fills buffer with newline-terminated pipelines both parsers accept (within the legacy limits)
+// Returns the number of bytes written
+static size_t generate_input(char *buffer, size_t size, int *numLines)
+{
+    static const char *words[] = {"grep", "-v", "sort", "uniq", "-c", "awk", "{print}", "file.txt",
+                                  "--color=never", "/usr/bin/sed", "s/a/b/g", "cut", "-d:", "-f2", "head", "-n10"};
+    size_t used = 0;
+    unsigned seed = 12345;
+    *numLines = 0;
+
+    while (used + LEGACY_MAX_LINE + 1 < size)
+    {
+        int stages = 1 + (seed = seed * 1103515245 + 12345) / 65536 % 6;
+        for (int s = 0; s < stages; s++)
+        {
+            if (s > 0)
+                used += sprintf(buffer + used, " | ");
+            int args = 1 + (seed = seed * 1103515245 + 12345) / 65536 % 8;
+            for (int a = 0; a < args; a++)
+            {
+                // No quotes: legacy strtok would split inside them and the argv would differ
+                const char *word = words[(seed = seed * 1103515245 + 12345) / 65536 % 16];
+                used += sprintf(buffer + used, "%s%s", a ? " " : "", word);
+            }
+            if ((seed = seed * 1103515245 + 12345) / 65536 % 5 == 0)
+                used += sprintf(buffer + used, " > out.txt");
+        }
+        buffer[used++] = '\n';
+        (*numLines)++;
+    }
+
+    return used;
+}
+
+// Fills buffer with lines of the given shape: stages commands joined by |, each of words words
+// Returns the number of bytes written
+static size_t generate_shape(char *buffer, size_t size, int stages, int words, int *numLines)
+{
+    static const char *pool[] = {"grep", "-v", "'quoted arg'", "file.txt", "--color=never", "\"a b\"", "x=1", "-n10"};
+    size_t used = 0;
+    *numLines = 0;
+    while (used + (size_t)stages * words * 16 + 1 < size)
+    {
+        for (int s = 0; s < stages; s++)
+        {
+            used += sprintf(buffer + used, "%scmd%d", s ? " | " : "", s);
+            for (int w = 1; w < words; w++)
+                used += sprintf(buffer + used, " %s", pool[(*numLines + s + w) % 8]);
+        }
+        buffer[used++] = '\n';
+        (*numLines)++;
+    }
+    return used;
+}
+
+// Best lines per second of parse_line over the used bytes of original, parsed from a fresh copy each pass
+static double parse_lines_per_s(const char *original, char *work, size_t used, int numLines, Arena *arena)
+{
+    double best = 1e30;
+    for (int run = 0; run < BENCH_RUNS; run++)
+    {
+        memcpy(work, original, used);
+        double start = now_ns();
+        for (char *line = work; line < work + used;)
+        {
+            char *end = memchr(line, '\n', work + used - line);
+            *end = '\0';
+            parse_line(line, arena);
+            arena_reset(arena);
+            line = end + 1;
+        }
+        double elapsed = now_ns() - start;
+        if (elapsed < best)
+            best = elapsed;
+    }
+    return numLines / best * 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = (argc > 1 ? strtoul(argv[1], NULL, 10) : 64) << 20;
+    char *original = malloc(size);
+    char *work = malloc(size);
+    if (!original || !work)
+    {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    int numLines;
+    size_t used = generate_input(original, size, &numLines);
+
+    // Legacy parser: fixed Command array with MAX_ARGS argv slots each
+    LegacyCommand legacy[LEGACY_MAX_COMMANDS];
+    for (int i = 0; i < LEGACY_MAX_COMMANDS; i++)
+        legacy[i].args = malloc(LEGACY_MAX_ARGS * sizeof(char *));
+
+    double bestLegacy = 1e30, bestNew = 1e30;
+    long legacyCommands = 0, newCommands = 0;
+    Arena arena = {NULL, NULL, NULL};
+
+    for (int run = 0; run < BENCH_RUNS; run++)
+    {
+        // Both parsers write into the line, so each pass gets a fresh copy (not timed)
+        memcpy(work, original, used);
+        legacyCommands = 0;
+        double start = now_ns();
+        for (char *line = work; line < work + used;)
+        {
+            char *end = memchr(line, '\n', work + used - line);
+            *end = '\0';
+            int numCommands;
+            legacy_parse_input(line, legacy, &numCommands);
+            legacyCommands += numCommands;
+            line = end + 1;
+        }
+        double elapsed = now_ns() - start;
+        if (elapsed < bestLegacy)
+            bestLegacy = elapsed;
+
+        memcpy(work, original, used);
+        newCommands = 0;
+        start = now_ns();
+        for (char *line = work; line < work + used;)
+        {
+            char *end = memchr(line, '\n', work + used - line);
+            *end = '\0';
+            Node *root = parse_line(line, &arena);
+            newCommands += root != NULL ? root->numCommands : 0; // Only pipelines are generated
+            arena_reset(&arena);
+            line = end + 1;
+        }
+        elapsed = now_ns() - start;
+        if (elapsed < bestNew)
+            bestNew = elapsed;
+    }
+
+    if (legacyCommands != newCommands)
+    {
+        fprintf(stderr, "parse_bench: parsers disagree (%ld vs %ld commands)\n", legacyCommands, newCommands);
+        return EXIT_FAILURE;
+    }
+
+    printf("{\"bench\":\"parse\",\"bytes\":%zu,\"lines\":%d,\"commands\":%ld,"
+           "\"legacy_bytes_per_ns\":%.3f,\"new_bytes_per_ns\":%.3f,\"speedup\":%.2f}\n",
+           used, numLines, newCommands, used / bestLegacy, used / bestNew, bestLegacy / bestNew);
+
+    // How throughput scales with the number of stages and of words per stage
+    static const int sweepStages[] = {1, 4, 8};
+    static const int sweepWords[] = {2, 8, 32};
+    size_t sweepSize = size < SWEEP_BYTES ? size : SWEEP_BYTES;
+    for (int s = 0; s < 3; s++)
+    {
+        for (int w = 0; w < 3; w++)
+        {
+            used = generate_shape(original, sweepSize, sweepStages[s], sweepWords[w], &numLines);
+            printf("{\"bench\":\"parse_shape\",\"stages\":%d,\"words\":%d,\"lines\":%d,\"lines_per_s\":%.0f}\n",
+                   sweepStages[s], sweepWords[w], numLines, parse_lines_per_s(original, work, used, numLines, &arena));
+        }
+    }
+
+    arena_free(&arena);
+    for (int i = 0; i < LEGACY_MAX_COMMANDS; i++)
+        free(legacy[i].args);
+    free(original);
+    free(work);
+    return 0;
+}
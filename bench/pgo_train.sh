@@ -0,0 +1,35 @@
+#!/bin/sh
+# Training workload of `make pgo`: the parser, launch and pipe paths the benchmark harnesses measure
+# Usage: bench/pgo_train.sh <instrumented minishell>
+set -e
+shell=$1
+
+# Parser: lines shaped like parse_bench's that run in-process, so tokenizing and parsing dominate
+awk 'BEGIN {
+    split("grep -v '\''quoted arg'\'' file.txt --color=never \"a b\" x=1 -n10 s/a/b/g", pool, " ")
+    for (line = 0; line < 20000; line++)
+    {
+        words = 2 + line % 31
+        text = ":"
+        for (w = 1; w < words; w++)
+            text = text " " pool[1 + (line + w) % 10] w
+        if (line % 5 == 0)
+            text = text " > /dev/null"
+        print text
+    }
+}' | "$shell" > /dev/null
+
+# Launch: pipelines of 1, 4 and 8 /bin/true stages
+awk 'BEGIN {
+    for (line = 0; line < 600; line++)
+    {
+        stages = line % 3 == 0 ? 1 : line % 3 == 1 ? 4 : 8
+        text = "/bin/true"
+        for (s = 1; s < stages; s++)
+            text = text " | /bin/true"
+        print text
+    }
+}' | "$shell"
+
+# Pipes: a cat chain moving 64 MiB
+echo 'head -c 67108864 /dev/zero | cat | cat | cat > /dev/null' | "$shell"
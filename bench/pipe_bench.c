@@ -0,0 +1,49 @@
+// Bandwidth through chains of 1, 2, 4 and 8 cats fed by head -c from /dev/zero, as the shell runs them
+// Usage: pipe_bench [megabytes per run] [shell options, e.g. --spawn=vfork] (default 256)
+
+#define MINISHELL_NO_MAIN
+#include "../minishell.c"
+#include "bench.h"
+
+#define PIPE_RUNS 3 // Best of this many runs is reported
+
+int main(int argc, char *argv[])
+{
+    int numbers = bench_shell_init(argc, argv);
+    long long bytes = (long long)(numbers > 0 ? atoi(argv[1]) : 256) << 20;
+    static const int catCounts[] = {1, 2, 4, 8};
+
+    Arena arena = {NULL, NULL, NULL};
+    Arena lineArena = {NULL, NULL, NULL};
+    for (size_t c = 0; c < sizeof(catCounts) / sizeof(catCounts[0]); c++)
+    {
+        StrBuf line = {&lineArena, NULL, 0, 0};
+        strbuf_printf(&line, "head -c %lld /dev/zero", bytes);
+        for (int s = 0; s < catCounts[c]; s++)
+            strbuf_printf(&line, " | cat");
+        strbuf_printf(&line, " > /dev/null");
+
+        double best = 1e30;
+        for (int run = 0; run < PIPE_RUNS; run++)
+        {
+            double elapsed = bench_run_line(line.data, &arena);
+            if (lastStatus != 0)
+            {
+                fprintf(stderr, "pipe_bench: %s exited with %d\n", line.data, lastStatus);
+                return EXIT_FAILURE;
+            }
+            if (elapsed < best)
+                best = elapsed;
+        }
+
+        printf("{\"bench\":\"pipe\",\"spawn\":\"%s\",\"cats\":%d,\"bytes\":%lld,\"gb_per_s\":%.3f}\n",
+               spawn_name(), catCounts[c], bytes, bytes / best);
+        arena_reset(&lineArena);
+    }
+
+    if (spawnBackend == SPAWN_ZYGOTE)
+        zygote_stop();
+    arena_free(&arena);
+    arena_free(&lineArena);
+    return 0;
+}
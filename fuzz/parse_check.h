@@ -0,0 +1,205 @@
+// Checks shared by the parser fuzz target and the differential harness, which include minishell.c with
+// MINISHELL_NO_MAIN and the original parser from bench/legacy_parse.c
+// A failed check leaves its reason in checkFailure
+
+static const char *checkFailure = NULL; // Why the last check failed
+
+#define CHECK(condition, reason)   \
+    do                             \
+    {                              \
+        if (!(condition))          \
+        {                          \
+            checkFailure = reason; \
+            return false;          \
+        }                          \
+    } while (0)
+
+static bool check_tree(const Node *node);
+
+// Invariants of one parsed stage: NULL-terminated argv, a program, a group or assignments, sane redirections
+static bool check_command(const Command *command)
+{
+    CHECK(command->args != NULL, "stage without argv");
+    CHECK(command->group != NULL || command->args[0] != NULL || command->numAssigns > 0, "stage with nothing to run");
+    CHECK(command->command == command->args[0], "command is not argv[0]");
+    CHECK(command->numAssigns == 0 || command->assigns != NULL, "assignment count without assignments");
+    CHECK(command->numRedirs == 0 || command->redirs != NULL, "redirection count without redirections");
+    for (int r = 0; r < command->numRedirs; r++)
+    {
+        const Redirect *redir = &command->redirs[r];
+        CHECK(redir->kind <= REDIR_HEREDOC, "unknown redirection kind");
+        CHECK(redir->fd >= 0 && redir->fd <= 9, "redirected descriptor out of 0-9");
+        CHECK(redir->kind == REDIR_DUP || redir->kind == REDIR_CLOSE || redir->target != NULL || redir->word != NULL, "redirection without target");
+        CHECK(redir->prealloc >= 0, "negative prealloc");
+    }
+    CHECK(command->remote == NULL || command->remote[0] != '\0', "empty @host");
+    return command->group == NULL || check_tree(command->group);
+}
+
+// Invariants of a parsed tree: operators have both operands, pipelines have stages
+// Lists nest to the left, which is followed in a loop so a line of a million `;` does not recurse as deep
+static bool check_tree(const Node *node)
+{
+    for (; node != NULL; node = node->left)
+    {
+        CHECK(node->kind <= NODE_OR, "unknown node kind");
+        if (node->kind == NODE_PIPELINE)
+        {
+            CHECK(node->numCommands > 0 && node->commands != NULL, "empty pipeline");
+            for (int c = 0; c < node->numCommands; c++)
+            {
+                if (!check_command(&node->commands[c]))
+                    return false;
+            }
+            return true;
+        }
+        CHECK(node->left != NULL && node->right != NULL, "operator without both operands");
+        if (!check_tree(node->right))
+            return false;
+    }
+    checkFailure = "NULL node";
+    return false;
+}
+
+// Both strings NULL, or both equal
+static bool same_string(const char *a, const char *b)
+{
+    return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+static bool same_tree(const Node *a, const Node *b);
+
+// Two stages parsed from the same text are the same: argv, assignments, redirections and flags
+static bool same_command(const Command *a, const Command *b)
+{
+    CHECK(a->background == b->background && a->timed == b->timed, "flags differ");
+    CHECK(same_string(a->remote, b->remote), "@host differs");
+    for (int i = 0; a->args[i] != NULL || b->args[i] != NULL; i++)
+        CHECK(same_string(a->args[i], b->args[i]), "argv differs");
+    CHECK(a->numAssigns == b->numAssigns, "assignment count differs");
+    for (int i = 0; i < a->numAssigns; i++)
+        CHECK(same_string(a->assigns[i], b->assigns[i]), "assignment differs");
+    CHECK(a->numRedirs == b->numRedirs, "redirection count differs");
+    for (int r = 0; r < a->numRedirs; r++)
+    {
+        const Redirect *x = &a->redirs[r], *y = &b->redirs[r];
+        CHECK(x->kind == y->kind && x->fd == y->fd && x->srcFd == y->srcFd && x->hints == y->hints && x->prealloc == y->prealloc,
+              "redirection differs");
+        CHECK(same_string(x->target, y->target) && same_string(x->word, y->word), "redirection target differs");
+    }
+    CHECK((a->group == NULL) == (b->group == NULL), "group differs");
+    return a->group == NULL || same_tree(a->group, b->group);
+}
+
+// Two trees parsed from the same text are the same, which catches reads of uninitialized memory
+static bool same_tree(const Node *a, const Node *b)
+{
+    for (; a != NULL && b != NULL; a = a->left, b = b->left)
+    {
+        CHECK(a->kind == b->kind, "node kind differs");
+        if (a->kind == NODE_PIPELINE)
+        {
+            CHECK(a->numCommands == b->numCommands, "stage count differs");
+            for (int c = 0; c < a->numCommands; c++)
+            {
+                if (!same_command(&a->commands[c], &b->commands[c]))
+                    return false;
+            }
+            return true;
+        }
+        if (!same_tree(a->right, b->right))
+            return false;
+    }
+    CHECK(a == NULL && b == NULL, "tree shape differs");
+    return true;
+}
+
+// Whether both parsers are meant to read line the same way: space-separated plain words, standalone
+// |, < and > between non-empty stages that start with a word, within the legacy limits
+// Quotes, tabs, $, globs, operators like && or 2>&1 and the rest of the newer syntax are left out, and so are
+// `time` and NAME=value as first words, which the new parser reads as a keyword and as assignments
+static bool legacy_comparable(const char *line)
+{
+    static const char plain[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._/,:+=-";
+    if (strlen(line) >= LEGACY_MAX_LINE - 1)
+        return false;
+
+    int stages = 1, words = 0;
+    bool stageStart = true, afterRedir = false;
+    for (const char *c = line + strspn(line, " "); *c != '\0'; c += strspn(c, " "))
+    {
+        size_t wordLength = strspn(c, plain);
+        size_t tokenLength = wordLength > 0 ? wordLength : 1;
+        if (c[tokenLength] != ' ' && c[tokenLength] != '\0')
+            return false; // Operators glued to words, or a character outside the plain set
+        if (wordLength > 0)
+        {
+            if (stageStart && ((wordLength == 4 && memcmp(c, "time", 4) == 0) || memchr(c, '=', wordLength) != NULL))
+                return false;
+            words += !afterRedir;
+            stageStart = afterRedir = false;
+        }
+        else if (*c == '|')
+        {
+            // A leading or trailing | is an error for both, an empty stage in between only for the new parser
+            if (afterRedir || (stageStart && stages > 1) || words >= LEGACY_MAX_ARGS)
+                return false;
+            stages++;
+            words = 0;
+            stageStart = true;
+        }
+        else if (*c == '<' || *c == '>')
+        {
+            if (stageStart || afterRedir)
+                return false; // The legacy parser would take the operator as the command
+            afterRedir = true;
+        }
+        else
+            return false;
+        c += tokenLength;
+    }
+    return !afterRedir && stages <= LEGACY_MAX_COMMANDS && words < LEGACY_MAX_ARGS; // Blank lines are rejected by both
+}
+
+// Target of the last redirection of kind in command, NULL without one
+static const char *last_redirect(const Command *command, RedirKind kind)
+{
+    const char *target = NULL;
+    for (int r = 0; r < command->numRedirs; r++)
+    {
+        if (command->redirs[r].kind == kind)
+            target = command->redirs[r].target;
+    }
+    return target;
+}
+
+// Compares what both parsers make of a line legacy_comparable() accepts: both reject it, or both give the
+// same stages with the same argv and the same last input and output files
+// root is the new parser's tree of line, the legacy parser works on a copy
+static bool legacy_agrees(const char *line, const Node *root)
+{
+    static LegacyCommand legacy[LEGACY_MAX_COMMANDS];
+    static char *legacyArgs[LEGACY_MAX_COMMANDS][LEGACY_MAX_ARGS];
+    static char copy[LEGACY_MAX_LINE + 1];
+    for (int i = 0; i < LEGACY_MAX_COMMANDS; i++)
+        legacy[i].args = legacyArgs[i];
+    strcpy(copy, line);
+    int numLegacy;
+    legacy_parse_input(copy, legacy, &numLegacy);
+
+    CHECK((numLegacy > 0) == (root != NULL), numLegacy > 0 ? "only the legacy parser accepts it" : "only the new parser accepts it");
+    if (root == NULL)
+        return true;
+    CHECK(root->kind == NODE_PIPELINE && root->numCommands == numLegacy, "stage count differs from legacy");
+    for (int c = 0; c < numLegacy; c++)
+    {
+        const Command *command = &root->commands[c];
+        for (int i = 0; legacy[c].args[i] != NULL || command->args[i] != NULL; i++)
+            CHECK(same_string(legacy[c].args[i], command->args[i]), "argv differs from legacy");
+        CHECK(same_string(legacy[c].inputFile, last_redirect(command, REDIR_IN)), "input file differs from legacy");
+        CHECK(same_string(legacy[c].outputFile, last_redirect(command, REDIR_OUT)), "output file differs from legacy");
+        for (int r = 0; r < command->numRedirs; r++)
+            CHECK(command->redirs[r].kind == REDIR_IN || command->redirs[r].kind == REDIR_OUT, "redirection the legacy parser does not have");
+    }
+    return true;
+}
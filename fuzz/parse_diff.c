@@ -0,0 +1,390 @@
+// Differential test and per-input timing of the single-pass tokenizer/parser against the original strtok-based one
+// Without files: a few lines of the newer syntax must parse as pinned down, random lines within the original syntax must parse the same with both, then adversarial families
+// (long tokens, deep pipelines, pathological whitespace, ...) are timed at growing sizes and must stay linear
+// With files: every line of them is one input, checked and timed on its own
+// Usage: parse_diff [-n RANDOM_LINES] [file...]
+// Prints one JSON object per measurement; exits with 1 if the parsers disagree, a tree fails check_tree(),
+// or a family's time per byte grows more than PARSE_DIFF_MAX_GROWTH times
+
+#define MINISHELL_NO_MAIN
+#include "../minishell.c"
+#include "../bench/legacy_parse.c"
+#include "../bench/bench.h"
+#include "parse_check.h"
+
+#define PARSE_DIFF_RUNS 5          // Best of this many parses is the time of an input
+#define PARSE_DIFF_LINES 100000    // Random lines of the differential test
+#define PARSE_DIFF_MAX_BYTES (1 << 20) // Largest adversarial input
+#define PARSE_DIFF_MAX_GROWTH 4.0  // Allowed growth of ns per byte from the 16K input of a family to its largest
+
+static FILE *results = NULL; // The real stdout, the parsers print their syntax errors on stdout itself
+static Arena arena = {NULL, NULL, NULL, 0}; // Parse memory, reset after every input
+static int failures = 0; // Failed checks and families that grew too fast
+
+// Best time of parse_line on line, over fresh copies (not timed); accepted tells whether it parsed
+static double time_new(const char *line, size_t length, char *work, bool *accepted)
+{
+    double best = 1e30;
+    for (int run = 0; run < PARSE_DIFF_RUNS; run++)
+    {
+        memcpy(work, line, length + 1);
+        double start = now_ns();
+        Node *root = parse_line(work, &arena);
+        double elapsed = now_ns() - start;
+        *accepted = root != NULL;
+        arena_reset(&arena);
+        if (elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+// Best time of the legacy parser on line, which must be shorter than LEGACY_MAX_LINE
+static double time_legacy(const char *line, size_t length, char *work)
+{
+    static LegacyCommand legacy[LEGACY_MAX_COMMANDS];
+    static char *legacyArgs[LEGACY_MAX_COMMANDS][LEGACY_MAX_ARGS];
+    double best = 1e30;
+    for (int i = 0; i < LEGACY_MAX_COMMANDS; i++)
+        legacy[i].args = legacyArgs[i];
+    for (int run = 0; run < PARSE_DIFF_RUNS; run++)
+    {
+        memcpy(work, line, length + 1);
+        int numCommands;
+        double start = now_ns();
+        legacy_parse_input(work, legacy, &numCommands);
+        double elapsed = now_ns() - start;
+        if (elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+// Checks one input: a tree that passes check_tree(), the same tree from a second parse, and the legacy parser's
+// reading where it applies; a failure is reported on stderr and counted
+// Returns whether the legacy parser was compared
+static bool check_input(const char *line, size_t length, char *work, const char *where)
+{
+    memcpy(work, line, length + 1);
+    Node *root = parse_line(work, &arena);
+    Node *again = parse_line(arena_strndup(&arena, line, length), &arena);
+    bool compared = legacy_comparable(line);
+    bool ok = (root == NULL) == (again == NULL);
+    if (!ok)
+        checkFailure = "accepted only once";
+    else
+        ok = (root == NULL || (check_tree(root) && same_tree(root, again))) && (!compared || legacy_agrees(line, root));
+    if (!ok)
+    {
+        fprintf(stderr, "parse_diff: %s: %s: %.*s%s\n", where, checkFailure, length > 200 ? 200 : (int)length, line, length > 200 ? "..." : "");
+        failures++;
+    }
+    arena_reset(&arena);
+    return compared;
+}
+
+// Writes a random line within legacy_comparable() into buffer, now and then one both parsers reject
+static size_t random_line(char *buffer, unsigned *seed)
+{
+    static const char *words[] = {"grep", "-v", "sort", "uniq", "-c", "awk", "file.txt", "--color=never",
+                                  "/usr/bin/sed", "s/a/b/g", "cut", "-d:", "-f2", "head", "-n10", "x,y+z"};
+    size_t used = 0;
+    int stages = 1 + (*seed = *seed * 1103515245 + 12345) / 65536 % LEGACY_MAX_COMMANDS;
+    int kind = (*seed = *seed * 1103515245 + 12345) / 65536 % 32;
+    int spaces = 1 + (*seed = *seed * 1103515245 + 12345) / 65536 % 3;
+    used += sprintf(buffer, "%*s", kind == 0 ? spaces : 0, "");
+    if (kind == 1) // Leading pipe
+        used += sprintf(buffer + used, "|%*s", spaces, "");
+    for (int s = 0; s < stages && kind != 2; s++)
+    {
+        if (s > 0)
+            used += sprintf(buffer + used, "%*s|%*s", spaces, "", spaces, "");
+        int args = 1 + (*seed = *seed * 1103515245 + 12345) / 65536 % 6;
+        for (int a = 0; a < args; a++)
+        {
+            int w = (*seed = *seed * 1103515245 + 12345) / 65536 % 16;
+            used += sprintf(buffer + used, "%*s%s", a ? spaces : 0, "", a == 0 && w == 7 ? "env" : words[w]);
+        }
+        int redirect = (*seed = *seed * 1103515245 + 12345) / 65536 % 8;
+        if (redirect < 2)
+            used += sprintf(buffer + used, " %c%*sf%d.txt", redirect ? '>' : '<', spaces, "", s);
+    }
+    if (kind == 3) // Trailing pipe
+        used += sprintf(buffer + used, " |");
+    if (kind == 0 || kind == 2) // Trailing spaces, or nothing but spaces
+        used += sprintf(buffer + used, "%*s", spaces, "");
+    buffer[used] = '\0';
+    return used;
+}
+
+// Differential test over random lines, with the time both parsers take per line
+static void random_lines(int numLines, char *work)
+{
+    char line[LEGACY_MAX_LINE];
+    unsigned seed = 4242;
+    int compared = 0;
+    double legacyNs = 0, newNs = 0;
+    for (int i = 0; i < numLines; i++)
+    {
+        size_t length = random_line(line, &seed);
+        char where[32];
+        snprintf(where, sizeof(where), "random line %d", i);
+        if (!check_input(line, length, work, where))
+            continue;
+        compared++;
+        bool accepted;
+        newNs += time_new(line, length, work, &accepted);
+        legacyNs += time_legacy(line, length, work);
+    }
+    fprintf(results, "{\"bench\":\"parse_diff_random\",\"lines\":%d,\"compared\":%d,\"failures\":%d,"
+                     "\"legacy_ns_per_line\":%.1f,\"new_ns_per_line\":%.1f}\n",
+            numLines, compared, failures, legacyNs / (compared ? compared : 1), newNs / (compared ? compared : 1));
+}
+
+// Adversarial input families, each written at a given size into buffer
+// Returns the number of bytes written (at most size)
+static size_t long_token(char *buffer, size_t size)
+{
+    memcpy(buffer, "echo ", 5);
+    memset(buffer + 5, 'a', size - 5);
+    return size;
+}
+
+static size_t long_quoted(char *buffer, size_t size)
+{
+    buffer[0] = '\'';
+    for (size_t i = 1; i < size - 1; i++)
+        buffer[i] = i % 3 ? 'q' : ' ';
+    buffer[size - 1] = '\'';
+    return size;
+}
+
+static size_t deep_pipeline(char *buffer, size_t size)
+{
+    size_t used = 0;
+    while (used + 8 <= size)
+        used += sprintf(buffer + used, "%scat", used ? " | " : "");
+    return used;
+}
+
+static size_t long_list(char *buffer, size_t size)
+{
+    static const char *parts[] = {"a; ", "b && ", "c || "};
+    size_t used = 0;
+    for (int k = 0; used + 6 <= size; k++)
+        used += sprintf(buffer + used, "%s", parts[k % 3]);
+    buffer[used++] = 'z';
+    return used;
+}
+
+static size_t whitespace(char *buffer, size_t size)
+{
+    buffer[0] = 'x';
+    for (size_t i = 1; i < size - 1; i++)
+        buffer[i] = i % 7 ? ' ' : '\t';
+    buffer[size - 1] = 'y';
+    return size;
+}
+
+static size_t many_args(char *buffer, size_t size)
+{
+    size_t used = sprintf(buffer, "echo");
+    while (used + 2 <= size)
+        used += sprintf(buffer + used, " a");
+    return used;
+}
+
+static size_t many_redirections(char *buffer, size_t size)
+{
+    size_t used = sprintf(buffer, "cat");
+    while (used + 6 <= size)
+        used += sprintf(buffer + used, " > f%d", (int)(used % 10));
+    return used;
+}
+
+static size_t backslashes(char *buffer, size_t size)
+{
+    size_t used = sprintf(buffer, "echo \"");
+    while (used + 3 <= size)
+        used += sprintf(buffer + used, "\\\"");
+    buffer[used++] = '"';
+    return used;
+}
+
+static size_t unterminated_quote(char *buffer, size_t size)
+{
+    buffer[0] = '"';
+    memset(buffer + 1, 'u', size - 1);
+    return size;
+}
+
+static size_t nested_groups(char *buffer, size_t size)
+{
+    size_t depth = (size - 1) / 2;
+    memset(buffer, '(', depth);
+    buffer[depth] = 'a';
+    memset(buffer + depth + 1, ')', depth);
+    return 2 * depth + 1; // Rejected past MAX_GROUP_DEPTH, which must stay as cheap
+}
+
+static size_t expansions(char *buffer, size_t size)
+{
+    size_t used = sprintf(buffer, "echo ");
+    while (used + 5 <= size)
+        used += sprintf(buffer + used, "$a${b}");
+    return used;
+}
+
+// Lines of the newer syntax whose meaning is pinned down: the agent each stage goes to, and its last argument
+static void known_lines(char *work)
+{
+    static const struct
+    {
+        const char *line, *remote, *lastArg;
+    } cases[] = {
+        {"echo install @types/node", NULL, "@types/node"},
+        {"git log @{u}", NULL, "@{u}"},
+        {"echo a @", NULL, "@"},
+        {"echo a @ b", NULL, "b"}, // An @ among the arguments never makes the stage remote
+        {"echo a @host", NULL, "@host"},
+        {"@ host", NULL, "host"},
+        {"'@host' sort", NULL, "sort"},
+        {"@buildhost:7070 sort big.txt", "buildhost:7070", "big.txt"},
+        {"@/tmp/agent.sock uniq -c", "/tmp/agent.sock", "-c"},
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        size_t length = strlen(cases[i].line);
+        memcpy(work, cases[i].line, length + 1);
+        Node *root = parse_line(work, &arena);
+        const Command *command = root != NULL && root->kind == NODE_PIPELINE ? &root->commands[0] : NULL;
+        int numArgs = 0;
+        while (command != NULL && command->args[numArgs] != NULL)
+            numArgs++;
+        if (command == NULL || numArgs == 0 || !same_string(command->remote, cases[i].remote) ||
+            !same_string(command->args[numArgs - 1], cases[i].lastArg))
+        {
+            fprintf(stderr, "parse_diff: known line: expected @ %s and last argument %s: %s\n",
+                    cases[i].remote ? cases[i].remote : "(none)", cases[i].lastArg, cases[i].line);
+            failures++;
+        }
+        arena_reset(&arena);
+    }
+}
+
+// Times every family at sizes from 1K to PARSE_DIFF_MAX_BYTES, checking the trees they give
+static void adversarial(char *input, char *work)
+{
+    static const struct
+    {
+        const char *name;
+        size_t (*generate)(char *buffer, size_t size);
+    } families[] = {
+        {"long_token", long_token}, {"long_quoted", long_quoted}, {"deep_pipeline", deep_pipeline}, {"long_list", long_list},
+        {"whitespace", whitespace}, {"many_args", many_args}, {"many_redirections", many_redirections},
+        {"backslashes", backslashes}, {"unterminated_quote", unterminated_quote}, {"nested_groups", nested_groups},
+        {"expansions", expansions},
+    };
+
+    for (size_t f = 0; f < sizeof(families) / sizeof(families[0]); f++)
+    {
+        double baseline = 0, largest = 0;
+        for (size_t size = 1024; size <= PARSE_DIFF_MAX_BYTES; size *= 4)
+        {
+            size_t length = families[f].generate(input, size);
+            input[length] = '\0';
+            check_input(input, length, work, families[f].name);
+            bool accepted;
+            double ns = time_new(input, length, work, &accepted);
+            fprintf(results, "{\"bench\":\"parse_diff_case\",\"case\":\"%s\",\"bytes\":%zu,\"accepted\":%s,\"new_ns\":%.0f,\"ns_per_byte\":%.3f}\n",
+                    families[f].name, length, accepted ? "true" : "false", ns, ns / length);
+            if (size == 16384)
+                baseline = ns / length;
+            largest = ns / length;
+        }
+        if (largest > PARSE_DIFF_MAX_GROWTH * baseline)
+        {
+            fprintf(stderr, "parse_diff: %s: %.3f ns per byte at the largest size, %.3f at 16K\n", families[f].name, largest, baseline);
+            failures++;
+        }
+    }
+}
+
+// Checks and times every line of a file as its own input
+static void file_lines(const char *path, char *input, char *work)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    int number = 0;
+    while (fgets(input, PARSE_DIFF_MAX_BYTES + 1, file) != NULL)
+    {
+        number++;
+        size_t length = strcspn(input, "\n");
+        input[length] = '\0';
+        char where[PATH_MAX + 16];
+        snprintf(where, sizeof(where), "%s:%d", path, number);
+        bool compared = check_input(input, length, work, where);
+        bool accepted;
+        double ns = time_new(input, length, work, &accepted);
+        fprintf(results, "{\"bench\":\"parse_diff_input\",\"input\":");
+        StrBuf name = {&arena, NULL, 0, 0};
+        strbuf_json_string(&name, where);
+        fwrite(name.data, 1, name.len, results);
+        fprintf(results, ",\"bytes\":%zu,\"accepted\":%s,\"new_ns\":%.0f", length, accepted ? "true" : "false", ns);
+        if (compared)
+            fprintf(results, ",\"legacy_ns\":%.0f", time_legacy(input, length, work));
+        fprintf(results, "}\n");
+        arena_reset(&arena);
+    }
+    fclose(file);
+}
+
+int main(int argc, char *argv[])
+{
+    int numLines = PARSE_DIFF_LINES;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0)
+    {
+        numLines = atoi(argv[2]);
+        first = 3;
+    }
+
+    // The results keep the real stdout, the parsers' error messages go nowhere
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    if (results == NULL || freopen("/dev/null", "w", stdout) == NULL)
+    {
+        perror("parse_diff: stdout");
+        return EXIT_FAILURE;
+    }
+    char *input = malloc(PARSE_DIFF_MAX_BYTES + 1);
+    char *work = malloc(PARSE_DIFF_MAX_BYTES + 1);
+    if (!input || !work)
+    {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    if (first < argc)
+    {
+        for (int i = first; i < argc; i++)
+            file_lines(argv[i], input, work);
+    }
+    else
+    {
+        known_lines(work);
+        random_lines(numLines, work);
+        adversarial(input, work);
+    }
+
+    fprintf(stderr, "parse_diff: %d failure%s\n", failures, failures == 1 ? "" : "s");
+    fclose(results);
+    arena_free(&arena);
+    free(input);
+    free(work);
+    return failures > 0;
+}
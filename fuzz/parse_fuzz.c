@@ -0,0 +1,120 @@
+// Fuzz target of the tokenizer/parser: every input is parsed twice, the tree must pass check_tree() and come out
+// the same both times, and inputs within the original parser's syntax must parse as it parses them
+// A failed check aborts with the reason, which the fuzzer reports along with the input
+// Built three ways (see the Makefile):
+//   make fuzz/parse_fuzz        libFuzzer with ASan/UBSan, e.g. fuzz/parse_fuzz -dict=fuzz/parse.dict fuzz/corpus
+//   make fuzz/parse_fuzz_afl    AFL++ persistent mode, e.g. afl-fuzz -i fuzz/corpus -o out -- fuzz/parse_fuzz_afl
+//   make fuzz/parse_replay      plain driver with ASan/UBSan that runs the files given (or stdin) once each
+
+#define MINISHELL_NO_MAIN
+#include "../minishell.c"
+#include "../bench/legacy_parse.c"
+#include "parse_check.h"
+
+#define FUZZ_MAX_INPUT (1 << 20) // Longer inputs are cut, the interesting ones are far shorter
+
+// Parses one input, the bytes up to its first NUL like a line the shell reads
+static void fuzz_one(const uint8_t *data, size_t size)
+{
+    static Arena arena = {NULL, NULL, NULL, 0};
+    static char line[FUZZ_MAX_INPUT + 1], work[FUZZ_MAX_INPUT + 1];
+    if (size > FUZZ_MAX_INPUT)
+        size = FUZZ_MAX_INPUT;
+    memcpy(line, data, size);
+    line[size] = '\0';
+    size = strlen(line);
+
+    // Parsing unquotes words in place, so each parse gets its own copy
+    memcpy(work, line, size + 1);
+    Node *first = parse_line(work, &arena);
+    Node *second = parse_line(arena_strndup(&arena, line, size), &arena);
+    bool ok = (first == NULL) == (second == NULL);
+    if (!ok)
+        checkFailure = "accepted only once";
+    else
+        ok = (first == NULL || (check_tree(first) && same_tree(first, second))) && (!legacy_comparable(line) || legacy_agrees(line, first));
+    if (!ok)
+    {
+        fprintf(stderr, "parse_fuzz: %s: %.*s%s\n", checkFailure, size > 200 ? 200 : (int)size, line, size > 200 ? "..." : "");
+        abort();
+    }
+    arena_reset(&arena);
+}
+
+#ifdef PARSE_FUZZ_LIBFUZZER
+
+// The parser reports syntax errors on stdout, which would drown the fuzzer's own output
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    (void)argc;
+    (void)argv;
+    freopen("/dev/null", "w", stdout);
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    fuzz_one(data, size);
+    return 0;
+}
+
+#else
+
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+__AFL_FUZZ_INIT();
+#endif
+
+// Reads all of fd, at most FUZZ_MAX_INPUT bytes
+static size_t read_input(int fd, uint8_t *buffer)
+{
+    size_t used = 0;
+    ssize_t bytes;
+    while (used < FUZZ_MAX_INPUT && (bytes = read(fd, buffer + used, FUZZ_MAX_INPUT - used)) != 0)
+    {
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes < 0)
+        {
+            perror("parse_fuzz: read");
+            exit(EXIT_FAILURE);
+        }
+        used += bytes;
+    }
+    return used;
+}
+
+int main(int argc, char *argv[])
+{
+    freopen("/dev/null", "w", stdout);
+
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+    // AFL++ persistent mode: many inputs per process, handed over in shared memory
+    __AFL_INIT();
+    const uint8_t *buffer = __AFL_FUZZ_TESTCASE_BUF;
+    while (__AFL_LOOP(10000))
+        fuzz_one(buffer, __AFL_FUZZ_TESTCASE_LEN);
+    (void)argc;
+    (void)argv;
+#else
+    // One input per file operand, or stdin, e.g. to replay a corpus or a crash
+    static uint8_t input[FUZZ_MAX_INPUT];
+    if (argc < 2)
+        fuzz_one(input, read_input(STDIN_FILENO, input));
+    for (int i = 1; i < argc; i++)
+    {
+        int fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        fuzz_one(input, read_input(fd, input));
+        close(fd);
+    }
+    int numInputs = argc < 2 ? 1 : argc - 1;
+    fprintf(stderr, "parse_fuzz: %d input%s passed\n", numInputs, numInputs == 1 ? "" : "s");
+#endif
+    return 0;
+}
+
+#endif
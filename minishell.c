@@ -1,3 +1,4 @@
+#define _GNU_SOURCE    // For pipe2(), F_SETPIPE_SZ and other Linux extensions
 #include <stdio.h>     // For input/output functions
 #include <stdlib.h>    // For general utilities like exit()
 #include <string.h>    // For string manipulation functions
@@ -5,369 +6,9269 @@
 #include <unistd.h>    // For POSIX operating system API, e.g., fork(), pipe(), ...
 #include <sys/types.h> // For system data type definitions
 #include <sys/wait.h>  // For waiting for process termination
+#include <sys/stat.h>  // For stat() checks in the PATH lookup
+#include <sys/mman.h>  // For mapping script files in batch mode
 #include <fcntl.h>     // For file control options
 #include <stdbool.h>   // For boolean data type
+#include <errno.h>     // For errno values reported by failed children
+#include <spawn.h>     // For posix_spawn() and its file actions
+#include <stdint.h>    // For fixed-width token fields
+#include <limits.h>    // For PIPE_BUF
+#include <stdarg.h>    // For printf-style string building
+#include <time.h>      // For the monotonic clock used to time stages
+#include <sys/time.h>  // For timersub() on rusage times
+#include <sys/resource.h> // For the per-child resource usage returned by wait4()
+#include <sys/sendfile.h> // For sendfile() in the data mover
+#include <signal.h>       // For job control signals and masks
+#include <sys/signalfd.h> // For the SIGCHLD descriptor the reaper polls
+#include <poll.h>         // For sleeping on that descriptor
+#include <sys/socket.h>   // For the zygote's Unix socket and SCM_RIGHTS
+#include <sys/prctl.h>    // For tying the zygote's children to its lifetime
+#include <sys/epoll.h>    // For the event loop when io_uring is not available
+#include <sys/syscall.h>  // For the io_uring and pidfd system calls, which glibc doesn't wrap
+#include <linux/io_uring.h> // For the io_uring ring layout and opcodes
+#include <dirent.h>   // For reading the directories a pattern is matched against
+#include <fnmatch.h>  // For matching names against a pattern component
+#include <pwd.h>      // For the home directories ~user expands to
+#include <sys/uio.h>  // For writev(), one history record per write
+#include <termios.h>  // For the raw terminal mode of the line editor
+#include <sys/ioctl.h> // For the terminal width completion lists are laid out in
+#include <sched.h>    // For pinning pipeline stages to CPUs
+#include <linux/mempolicy.h> // For the NUMA node a stage takes its memory from
+#include <linux/ioprio.h>    // For the I/O priority classes of ionice
+#include <sys/un.h>      // For agents listening on a Unix socket
+#include <netdb.h>       // For resolving the host of a remote stage
+#include <netinet/in.h>  // For TCP connections to agents
+#include <netinet/tcp.h> // For TCP_NODELAY on them
+#ifdef MINISHELL_ZLIB
+#include <zlib.h> // For compressed remote stage data (make ZLIB=1)
+#endif
 
-#define MAX_LINE 1024  // Define a constant for maximum input line length
-#define MAX_ARGS 32    // Maximum number of arguments per command
-#define MAX_COMMANDS 8 // Max number of commands inside a pipeline
+#define ARENA_BLOCK_SIZE (64 * 1024) // Default size of each arena block
+#define ARENA_ALIGN 16               // Alignment of every arena allocation
+#define INITIAL_ARGS 8               // Initial capacity of an argv vector, grown on demand
+#define MAX_GROUP_DEPTH 1000         // Deepest ( ... ) nesting the recursive-descent parser accepts
+
+// Kinds of redirection a command can carry
+typedef enum
+{
+    REDIR_IN,     // < file
+    REDIR_OUT,    // > file
+    REDIR_APPEND, // >> file, every write lands at the end even with concurrent writers
+    REDIR_RDWR,   // <> file, opened for reading and writing without truncation
+    REDIR_DUP,    // Duplicate srcFd onto fd (2>&1), no file involved
+    REDIR_CLOSE,  // Close fd (2>&-)
+    REDIR_STRING, // <<< word, target is the text fed to fd
+    REDIR_HEREDOC // << word, target is the delimiter and body the lines read after the command line
+} RedirKind;
+
+// I/O hints of a file redirection, written in braces right after the operator: <{seq,willneed} file, >{prealloc=1G} file
+// Braces holding anything but hint names are part of the file name, as in >{out}
+enum
+{
+    IOHINT_SEQUENTIAL = 1 << 0, // seq: posix_fadvise(SEQUENTIAL), the kernel reads further ahead
+    IOHINT_WILLNEED = 1 << 1,   // willneed: posix_fadvise(WILLNEED), the whole file starts loading right away
+    IOHINT_DIRECT = 1 << 2,     // direct: O_DIRECT, bypasses the page cache (the program must do aligned I/O)
+    IOHINT_DONTNEED = 1 << 3    // dontneed: written back and dropped from the page cache once the job is done
+};
+
+// A single redirection, applied in the order they appear on the line
+typedef struct
+{
+    RedirKind kind; // What to open and how
+    int fd;         // Descriptor replaced in the child (0-9)
+    char *target;   // File name, or the text of a REDIR_STRING
+    int srcFd;      // Descriptor duplicated by REDIR_DUP, or holding a REDIR_STRING/HEREDOC's text while launching
+    char *body;     // Here-document text, read again each time the line runs
+    bool stripTabs; // <<-: leading tabs are removed from the body and delimiter lines
+    char *word;     // Unexpanded target of a command with expansions, target is rebuilt from it at each launch
+    uint8_t hints;  // IOHINT_* flags
+    off_t prealloc; // prealloc=SIZE: bytes reserved with fallocate() when the file is opened, 0 for none
+} Redirect;
 
 // Single command struct
 typedef struct
 {
-    char *command;    // The command to execute
-    char **args;      // Arguments list, null-terminated
-    char *inputFile;  // Input redirection file, or NULL
-    char *outputFile; // Output redirection file, or NULL
-} Command;
+    char *command;     // The command to execute
+    const char *path;  // Resolved executable path, filled right before launching
+    uint64_t pathGeneration; // commandHash generation path was resolved in
+    char **args;       // Arguments list, null-terminated
+    Redirect *redirs;  // Redirections, in line order
+    int numRedirs;     // Number of redirections
+    bool timed;        // Pipeline was prefixed with `time` (only set on its first command)
+    bool background;   // Pipeline ends with & (only set on its first command)
+    struct Node *group; // ( list ) run by a child of the shell instead of a program, NULL for a simple command
+    char **assigns;    // NAME=value prefixes, exported to this command only (or set in the shell when it has no words)
+    int numAssigns;    // Number of prefixes
+    char **envp;       // Environment of the child, filled right before launching
+    char **words;      // With expansions: the unexpanded words (quotes and $(...) still in), args is rebuilt from them
+    char **assignWords; // With expansions: the unexpanded prefixes, assigns is rebuilt from them
+    bool captured;     // Output of a $(...): a lone builtin still gets a child, so the shell is free to read it
+    char *remote;      // @host cmd: address of the agent the stage runs on, NULL to run it here
+} Command;
+
+// Structure to hold file descriptors for a pipe
+typedef struct
+{
+    int read_fd;  // Read end of the pipe
+    int write_fd; // Write end of the pipe
+} PipeFD;
+
+/* PER-LINE ARENA ALLOCATOR */
+
+// One chunk of arena memory
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next; // Next block in the chain, kept across resets for reuse
+    size_t size;             // Usable bytes in data
+    size_t used;             // Bytes handed out from data
+    char data[];             // The memory itself
+} ArenaBlock;
+
+// Bump allocator for everything that lives as long as one line: commands, argv vectors, pipes, ...
+// Blocks are never freed on reset, so a warmed-up arena serves each line without touching the heap
+typedef struct
+{
+    ArenaBlock *first;   // First block of the chain
+    ArenaBlock *current; // Block allocations are currently bumped from
+    char *last;          // Most recent allocation, which arena_grow can extend in place
+    size_t blockSize;    // Size of new blocks, 0 for ARENA_BLOCK_SIZE
+} Arena;
+
+// Allocates size bytes (ARENA_ALIGN-aligned) from the arena
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    ArenaBlock *block = arena->current;
+    while (block == NULL || block->size - block->used < size)
+    {
+        // Reuse the next block left over from an earlier line, if it is big enough
+        if (block != NULL && block->next != NULL && block->next->size >= size)
+        {
+            block = block->next;
+            block->used = 0;
+            continue;
+        }
+
+        // Otherwise link a new block right after the current one
+        size_t blockSize = arena->blockSize ? arena->blockSize : ARENA_BLOCK_SIZE;
+        if (size > blockSize)
+            blockSize = size;
+        ArenaBlock *fresh = malloc(sizeof(ArenaBlock) + blockSize);
+        if (!fresh)
+        {
+            perror("Failed to allocate memory for the arena");
+            exit(EXIT_FAILURE);
+        }
+        fresh->size = blockSize;
+        fresh->used = 0;
+        if (block == NULL)
+        {
+            fresh->next = arena->first;
+            arena->first = fresh;
+        }
+        else
+        {
+            fresh->next = block->next;
+            block->next = fresh;
+        }
+        block = fresh;
+    }
+
+    arena->current = block;
+    arena->last = block->data + block->used;
+    block->used += size;
+    return arena->last;
+}
+
+// Resizes ptr (oldSize bytes, allocated from arena) to newSize, in place when it is the last allocation
+void *arena_grow(Arena *arena, void *ptr, size_t oldSize, size_t newSize)
+{
+    ArenaBlock *block = arena->current;
+    newSize = (newSize + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (ptr != NULL && ptr == arena->last && (size_t)(block->data + block->size - (char *)ptr) >= newSize)
+    {
+        block->used = ((char *)ptr - block->data) + newSize;
+        return ptr;
+    }
+
+    void *fresh = arena_alloc(arena, newSize);
+    if (ptr != NULL)
+        memcpy(fresh, ptr, oldSize);
+    return fresh;
+}
+
+// Copies len bytes of str into the arena as a NUL-terminated string
+char *arena_strndup(Arena *arena, const char *str, size_t len)
+{
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Releases everything allocated since the last reset, in O(1)
+void arena_reset(Arena *arena)
+{
+    arena->current = arena->first;
+    arena->last = NULL;
+    if (arena->first != NULL)
+        arena->first->used = 0;
+}
+
+// Total bytes the arena holds on to, used blocks and spare ones
+size_t arena_footprint(const Arena *arena)
+{
+    size_t bytes = 0;
+    for (ArenaBlock *block = arena->first; block != NULL; block = block->next)
+        bytes += sizeof(ArenaBlock) + block->size;
+    return bytes;
+}
+
+// Gives all the arena's blocks back to the heap
+void arena_free(Arena *arena)
+{
+    ArenaBlock *block = arena->first;
+    while (block != NULL)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first = arena->current = NULL;
+    arena->last = NULL;
+}
+
+// Growable string built inside an arena
+typedef struct
+{
+    Arena *arena; // Where the bytes live
+    char *data;   // NUL-terminated contents
+    size_t len;   // Length without the NUL
+    size_t cap;   // Allocated size of data
+} StrBuf;
+
+// Makes room for len more bytes (and the NUL), growing the string in place when possible
+// Returns where they go; whoever writes them there adds them to buf->len
+char *strbuf_reserve(StrBuf *buf, size_t len)
+{
+    if (buf->len + len + 1 > buf->cap)
+    {
+        size_t newCap = buf->cap ? buf->cap : 256;
+        while (buf->len + len + 1 > newCap)
+            newCap *= 2;
+        buf->data = arena_grow(buf->arena, buf->data, buf->cap, newCap);
+        buf->cap = newCap;
+    }
+    return buf->data + buf->len;
+}
+
+// Appends len bytes to the string, growing it in place when possible
+void strbuf_append(StrBuf *buf, const char *text, size_t len)
+{
+    memcpy(strbuf_reserve(buf, len), text, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+// printf-style append
+void strbuf_printf(StrBuf *buf, const char *format, ...)
+{
+    char small[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(small, sizeof(small), format, args);
+    va_end(args);
+    if (len < (int)sizeof(small))
+    {
+        strbuf_append(buf, small, len);
+        return;
+    }
+
+    char *large = arena_alloc(buf->arena, len + 1);
+    va_start(args, format);
+    vsnprintf(large, len + 1, format, args);
+    va_end(args);
+    strbuf_append(buf, large, len);
+}
+
+// Appends text as a quoted JSON string
+void strbuf_json_string(StrBuf *buf, const char *text)
+{
+    strbuf_append(buf, "\"", 1);
+    for (const char *c = text; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            strbuf_append(buf, "\\", 1);
+            strbuf_append(buf, c, 1);
+        }
+        else if ((unsigned char)*c < 0x20)
+            strbuf_printf(buf, "\\u%04x", (unsigned char)*c);
+        else
+            strbuf_append(buf, c, 1);
+    }
+    strbuf_append(buf, "\"", 1);
+}
+
+/* TRACING */
+
+#define TRACE_EVENTS 65536 // Slots of the trace ring (a power of two), the oldest events are overwritten
+#define TRACE_MARKER "/sys/kernel/tracing/trace_marker" // Where `trace on marker` mirrors events for perf and ftrace
+
+// One hit of a trace point
+typedef struct
+{
+    uint64_t ns;      // CLOCK_MONOTONIC timestamp
+    const char *name; // Name of the trace point, always a string literal
+    int64_t arg;      // Value the point reports: stage index, pid, token count, ...
+    int32_t pid;      // Process that hit it, vfork children write into the shell's own ring
+    char phase;       // 'B' begins a span, 'E' ends it, 'I' is an instant
+} TraceEvent;
+
+// Fixed-size event ring, a slot is claimed with one atomic increment and no lock
+typedef struct
+{
+    TraceEvent *events; // TRACE_EVENTS slots, allocated the first time tracing is switched on
+    uint64_t next;      // Events recorded so far, the next one goes to slot next % TRACE_EVENTS
+    int markerFd;       // trace_marker descriptor every event is also written to, -1 when not mirrored
+    const char *exitPath; // --trace=FILE: Chrome trace written there when the shell exits
+    pid_t owner;        // Process that writes it, forked children exit through the same atexit() handler
+} TraceRing;
+
+TraceRing traceRing = {NULL, 0, -1, NULL, 0};
+bool traceOn = false; // Tested by every trace point, which is all they cost while tracing is off
+
+void trace_record(char phase, const char *name, int64_t arg);
+
+// Trace points, a load and a branch predicted not taken while tracing is off
+#define TRACE(phase, name, arg) do { if (__builtin_expect(traceOn, 0)) trace_record(phase, name, arg); } while (0)
+#define TRACE_BEGIN(name, arg) TRACE('B', name, arg)
+#define TRACE_END(name, arg) TRACE('E', name, arg)
+#define TRACE_MARK(name, arg) TRACE('I', name, arg)
+
+// Writes value in decimal at out without snprintf(), which isn't async-signal-safe; returns the end
+char *trace_format_int(char *out, int64_t value)
+{
+    char digits[20];
+    int n = 0;
+    uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+    do
+        digits[n++] = '0' + magnitude % 10;
+    while ((magnitude /= 10) != 0);
+    if (value < 0)
+        *out++ = '-';
+    while (n > 0)
+        *out++ = digits[--n];
+    return out;
+}
+
+// Atrace line of an event as trace_marker expects it (B|pid|name arg, E|pid), returns its length
+size_t trace_marker_line(char *out, char phase, int32_t pid, const char *name, int64_t arg)
+{
+    char *end = out;
+    *end++ = phase == 'E' ? 'E' : 'B';
+    *end++ = '|';
+    end = trace_format_int(end, pid);
+    if (phase != 'E')
+    {
+        *end++ = '|';
+        for (const char *c = name; *c != '\0' && end < out + 96; c++)
+            *end++ = *c;
+        *end++ = ' ';
+        end = trace_format_int(end, arg);
+    }
+    return end - out;
+}
+
+// Records one event, async-signal-safe so that a vfork child may hit trace points before execve()
+void trace_record(char phase, const char *name, int64_t arg)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t slot = __atomic_fetch_add(&traceRing.next, 1, __ATOMIC_RELAXED);
+    TraceEvent *event = &traceRing.events[slot & (TRACE_EVENTS - 1)];
+    event->ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    event->name = name;
+    event->arg = arg;
+    event->pid = getpid();
+    event->phase = phase;
+
+    if (traceRing.markerFd >= 0)
+    {
+        // ftrace stamps the marker itself, an instant shows as an empty span
+        char line[128];
+        size_t len = trace_marker_line(line, phase, event->pid, name, arg);
+        write(traceRing.markerFd, line, len);
+        if (phase == 'I')
+            write(traceRing.markerFd, line, trace_marker_line(line, 'E', event->pid, name, arg));
+    }
+}
+
+// The range of events still in the ring, oldest first
+void trace_window(uint64_t *first, uint64_t *last)
+{
+    *last = __atomic_load_n(&traceRing.next, __ATOMIC_RELAXED);
+    *first = *last > TRACE_EVENTS ? *last - TRACE_EVENTS : 0;
+}
+
+// Writes the ring as Chrome trace JSON (chrome://tracing, Perfetto), returns false if the file can't be written
+bool trace_dump_chrome(const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (out == NULL)
+        return false;
+
+    uint64_t first, last;
+    trace_window(&first, &last);
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (uint64_t n = first; n < last; n++)
+    {
+        const TraceEvent *event = &traceRing.events[n & (TRACE_EVENTS - 1)];
+        fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"minishell\",\"ph\":\"%s\",\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%lld}}",
+                n > first ? "," : "", event->name, event->phase == 'B' ? "B" : event->phase == 'E' ? "E" : "i\",\"s\":\"t",
+                (unsigned long long)(event->ns / 1000), (unsigned long long)(event->ns % 1000),
+                event->pid, event->pid, (long long)event->arg);
+    }
+    fprintf(out, "\n]}\n");
+    return fclose(out) == 0;
+}
+
+// Writes the ring in the text format of the ftrace buffer, with the trace_marker lines perf and Perfetto import
+bool trace_dump_ftrace(const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (out == NULL)
+        return false;
+
+    uint64_t first, last;
+    trace_window(&first, &last);
+    fprintf(out, "# tracer: nop\n#\n");
+    for (uint64_t n = first; n < last; n++)
+    {
+        const TraceEvent *event = &traceRing.events[n & (TRACE_EVENTS - 1)];
+        char line[128];
+        size_t len = trace_marker_line(line, event->phase, event->pid, event->name, event->arg);
+        for (int k = 0; k < (event->phase == 'I' ? 2 : 1); k++)
+        {
+            fprintf(out, "       minishell-%d   [000] .... %llu.%06llu: tracing_mark_write: %.*s\n", event->pid,
+                    (unsigned long long)(event->ns / 1000000000), (unsigned long long)(event->ns / 1000 % 1000000), (int)len, line);
+            len = trace_marker_line(line, 'E', event->pid, event->name, event->arg);
+        }
+    }
+    return fclose(out) == 0;
+}
+
+// Switches tracing on, optionally mirrored to trace_marker; returns false if the ring can't be allocated
+bool trace_enable(bool marker)
+{
+    if (traceRing.events == NULL)
+    {
+        traceRing.events = calloc(TRACE_EVENTS, sizeof(TraceEvent));
+        if (traceRing.events == NULL)
+        {
+            perror("trace");
+            return false;
+        }
+    }
+    if (marker && traceRing.markerFd < 0)
+    {
+        traceRing.markerFd = open(TRACE_MARKER, O_WRONLY | O_CLOEXEC);
+        if (traceRing.markerFd < 0)
+            fprintf(stderr, "trace: %s: %s\n", TRACE_MARKER, strerror(errno));
+    }
+    traceOn = true;
+    return true;
+}
+
+// Switches tracing off and stops the trace_marker copy, the ring keeps its events
+void trace_disable(void)
+{
+    traceOn = false;
+    if (traceRing.markerFd >= 0)
+    {
+        close(traceRing.markerFd);
+        traceRing.markerFd = -1;
+    }
+}
+
+// atexit() handler of --trace=FILE
+void trace_exit_dump(void)
+{
+    if (getpid() != traceRing.owner)
+        return;
+    if (!trace_dump_chrome(traceRing.exitPath))
+        perror(traceRing.exitPath);
+    trace_disable();
+    free(traceRing.events);
+    traceRing.events = NULL;
+}
+
+// trace [on [marker]|off|clear|dump chrome|ftrace FILE], without arguments reports the state of the ring
+int builtin_trace(char **args)
+{
+    if (args[1] == NULL)
+    {
+        uint64_t first, last;
+        trace_window(&first, &last);
+        printf("trace: %s%s, %llu events (%llu kept of %d)\n", traceOn ? "on" : "off", traceRing.markerFd >= 0 ? " (marker)" : "",
+               (unsigned long long)last, (unsigned long long)(last - first), TRACE_EVENTS);
+        return 0;
+    }
+    if (strcmp(args[1], "on") == 0)
+    {
+        bool marker = args[2] != NULL && strcmp(args[2], "marker") == 0;
+        return trace_enable(marker) && (!marker || traceRing.markerFd >= 0) ? 0 : 1;
+    }
+    if (strcmp(args[1], "off") == 0)
+    {
+        trace_disable();
+        return 0;
+    }
+    if (strcmp(args[1], "clear") == 0)
+    {
+        traceRing.next = 0;
+        return 0;
+    }
+    if (strcmp(args[1], "dump") == 0 && args[2] != NULL && args[3] != NULL)
+    {
+        bool chrome = strcmp(args[2], "chrome") == 0;
+        if (!chrome && strcmp(args[2], "ftrace") != 0)
+        {
+            fprintf(stderr, "trace: unknown format %s\n", args[2]);
+            return 2;
+        }
+        if (traceRing.events == NULL)
+        {
+            fprintf(stderr, "trace: nothing recorded\n");
+            return 1;
+        }
+        if (!(chrome ? trace_dump_chrome(args[3]) : trace_dump_ftrace(args[3])))
+        {
+            perror(args[3]);
+            return 1;
+        }
+        return 0;
+    }
+    fprintf(stderr, "Usage: trace [on [marker]|off|clear|dump chrome|ftrace FILE]\n");
+    return 2;
+}
+
+/* SINGLE-PASS TOKENIZER AND PARSER */
+
+// Kinds of token produced by the tokenizer
+typedef enum
+{
+    TOK_WORD,   // Command name, argument or redirection target
+    TOK_PIPE,   // |
+    TOK_IN,     // <, the redirections take an optional fd digit before them (2>)
+    TOK_OUT,    // >
+    TOK_APPEND, // >>
+    TOK_RDWR,   // <>
+    TOK_DUPIN,  // <&
+    TOK_DUPOUT, // >&
+    TOK_ALLOUT, // &>, stdout and stderr
+    TOK_ALLAPPEND, // &>>
+    TOK_HEREDOC, // << and <<-
+    TOK_HERESTRING, // <<<
+    TOK_AMP,    // &, runs the list item before it in the background
+    TOK_SEMI,   // ;
+    TOK_AND,    // &&
+    TOK_OR,     // ||
+    TOK_LPAREN, // (
+    TOK_RPAREN, // )
+    TOK_END     // End of the line, always the last token
+} TokenKind;
+
+// A token is a span of the original line, nothing is copied while lexing
+typedef struct
+{
+    uint32_t offset; // Start of the token in the line
+    uint32_t length; // Length of the token in bytes
+    uint8_t kind;    // TokenKind
+    bool quoted;     // Word contains quotes or backslashes and must be unquoted
+    int8_t fd;       // Explicit fd of a redirection, -1 for its default
+    bool expand;     // Word contains $, ~ or glob characters, expanded before each launch
+} Token;
+
+// Character classes driving the tokenizer state machine
+enum
+{
+    CH_WORD,      // Part of a word
+    CH_SPACE,     // Separates tokens
+    CH_PIPE,      // |
+    CH_LESS,      // <
+    CH_GREAT,     // >
+    CH_SQUOTE,    // '
+    CH_DQUOTE,    // "
+    CH_BACKSLASH, // Escapes the next character
+    CH_AMP,       // &
+    CH_SEMI,      // ;
+    CH_LPAREN,    // (
+    CH_RPAREN,    // )
+    CH_DOLLAR,    // $, part of a word but may start an expansion
+    CH_GLOB,      // *, ? and [, part of a word but make it a pattern
+    CH_NUL        // End of the line
+};
+
+static const uint8_t charClass[256] = {
+    ['\0'] = CH_NUL,
+    [' '] = CH_SPACE,
+    ['\t'] = CH_SPACE,
+    ['\r'] = CH_SPACE,
+    ['\n'] = CH_SPACE,
+    ['|'] = CH_PIPE,
+    ['<'] = CH_LESS,
+    ['>'] = CH_GREAT,
+    ['\''] = CH_SQUOTE,
+    ['"'] = CH_DQUOTE,
+    ['\\'] = CH_BACKSLASH,
+    ['&'] = CH_AMP,
+    [';'] = CH_SEMI,
+    ['('] = CH_LPAREN,
+    [')'] = CH_RPAREN,
+    ['$'] = CH_DOLLAR,
+    ['*'] = CH_GLOB,
+    ['?'] = CH_GLOB,
+    ['['] = CH_GLOB,
+};
+
+// Returns true for the redirection operators
+bool is_redirection(TokenKind kind)
+{
+    return kind >= TOK_IN && kind <= TOK_HERESTRING;
+}
+
+// Returns true if the len bytes of text are a comma-separated list of I/O hint names, prealloc=SIZE included
+// Anything else in braces, like >{out}, is the start of a file name
+bool is_io_hint_list(const char *text, size_t len)
+{
+    static const char *names[] = {"seq", "willneed", "direct", "dontneed"};
+    const char *end = text + len;
+    while (text < end)
+    {
+        const char *comma = memchr(text, ',', end - text);
+        size_t n = (comma != NULL ? comma : end) - text;
+        bool known = n > 9 && strncmp(text, "prealloc=", 9) == 0;
+        for (size_t k = 0; k < sizeof(names) / sizeof(names[0]) && !known; k++)
+            known = strlen(names[k]) == n && strncmp(names[k], text, n) == 0;
+        if (!known)
+            return false;
+        text += n + 1;
+    }
+    return len > 0;
+}
+
+// Lexes the redirection operator at s, which starts with < or >, extending the token over it
+void lex_redirection(const char *s, Token *token)
+{
+    if (s[0] == '<')
+    {
+        if (s[1] == '<' && s[2] == '<')
+            token->kind = TOK_HERESTRING;
+        else if (s[1] == '<')
+        {
+            token->kind = TOK_HEREDOC;
+            token->length += s[2] == '-'; // <<-
+        }
+        else if (s[1] == '>')
+            token->kind = TOK_RDWR;
+        else if (s[1] == '&')
+            token->kind = TOK_DUPIN;
+        else
+            token->kind = TOK_IN;
+    }
+    else
+    {
+        if (s[1] == '>')
+            token->kind = TOK_APPEND;
+        else if (s[1] == '&')
+            token->kind = TOK_DUPOUT;
+        else
+            token->kind = TOK_OUT;
+    }
+    size_t op = token->kind == TOK_HERESTRING ? 3 : token->kind == TOK_IN || token->kind == TOK_OUT ? 1 : 2;
+    token->length += op;
+
+    // <, >, >> and <> may carry I/O hints in braces, the operator then spans them
+    if (token->kind <= TOK_RDWR && s[op] == '{')
+    {
+        size_t end = op + 1 + strspn(s + op + 1, "abcdefghijklmnopqrstuvwxyzKMG0123456789=,");
+        if (s[end] == '}' && is_io_hint_list(s + op + 1, end - op - 1))
+            token->length += end + 1 - op;
+    }
+}
+
+bool parse_size(const char *text, size_t *size); // With the pipe configuration
+
+// Sets the I/O hints of a redirection from the comma-separated list between the braces of its operator
+// Returns false (after printing why) on an unknown hint
+bool parse_io_hints(const char *text, size_t len, Redirect *redir)
+{
+    while (len > 0)
+    {
+        size_t n = 0;
+        while (n < len && text[n] != ',')
+            n++;
+        char hint[32];
+        snprintf(hint, sizeof(hint), "%.*s", (int)(n < sizeof(hint) ? n : sizeof(hint) - 1), text);
+        size_t size;
+        if (strcmp(hint, "seq") == 0)
+            redir->hints |= IOHINT_SEQUENTIAL;
+        else if (strcmp(hint, "willneed") == 0)
+            redir->hints |= IOHINT_WILLNEED;
+        else if (strcmp(hint, "direct") == 0)
+            redir->hints |= IOHINT_DIRECT;
+        else if (strcmp(hint, "dontneed") == 0)
+            redir->hints |= IOHINT_DONTNEED;
+        else if (strncmp(hint, "prealloc=", 9) == 0 && redir->kind != REDIR_IN && parse_size(hint + 9, &size))
+            redir->prealloc = size;
+        else
+        {
+            printf("Error: Unknown I/O hint %.*s.\n", (int)n, text);
+            return false;
+        }
+        text += n + (n < len);
+        len -= n + (n < len);
+    }
+    return true;
+}
+
+// Returns true if the len bytes of text are a valid variable name
+bool is_name(const char *text, size_t len)
+{
+    if (len == 0 || !(isalpha((unsigned char)text[0]) || text[0] == '_'))
+        return false;
+    for (size_t i = 1; i < len; i++)
+    {
+        if (!(isalnum((unsigned char)text[i]) || text[i] == '_'))
+            return false;
+    }
+    return true;
+}
+
+// Returns true if the len bytes of text start with NAME= and NAME is a valid variable name
+bool is_assignment(const char *text, size_t len)
+{
+    const char *equals = memchr(text, '=', len);
+    return equals != NULL && is_name(text, equals - text);
+}
+
+// Finds the end of the $(...) starting at line[j], skipping the nested ones and whatever is quoted inside
+// Returns the index right after its ), or 0 if the line ends first
+size_t skip_substitution(const char *line, size_t j)
+{
+    int depth = 0;
+    while (1)
+    {
+        if (line[j] == '\0')
+            return 0;
+        if (line[j] == '$' && line[j + 1] == '(')
+        {
+            j += 2;
+            depth++;
+        }
+        else if (line[j] == '(')
+        {
+            j++;
+            depth++;
+        }
+        else if (line[j] == ')')
+        {
+            j++;
+            if (--depth == 0)
+                return j;
+        }
+        else if (line[j] == '\'')
+        {
+            const char *close = strchr(line + j + 1, '\'');
+            if (close == NULL)
+                return 0;
+            j = close - line + 1;
+        }
+        else if (line[j] == '"')
+        {
+            for (j++; line[j] != '"'; j++)
+            {
+                if (line[j] == '\0')
+                    return 0;
+                if (line[j] == '\\' && line[j + 1] != '\0')
+                    j++;
+                else if (line[j] == '$' && line[j + 1] == '(')
+                {
+                    size_t end = skip_substitution(line, j);
+                    if (end == 0)
+                        return 0;
+                    j = end - 1;
+                }
+            }
+            j++;
+        }
+        else
+        {
+            j += line[j] == '\\' && line[j + 1] != '\0' ? 2 : 1;
+        }
+    }
+}
+
+// Returns true if the $ at s[0] starts a parameter expansion: $NAME, ${NAME}, $? or $$
+bool is_parameter(const char *s)
+{
+    return s[1] == '{' || s[1] == '?' || s[1] == '$' || isalpha((unsigned char)s[1]) || s[1] == '_';
+}
+
+// Finds the end of the expansion starting with the $ at line[j], if it has one
+// Returns the index right after it, j + 1 for a lone $, or 0 after printing an error if it is unterminated
+size_t skip_dollar(const char *line, size_t j)
+{
+    if (line[j + 1] == '(')
+    {
+        size_t end = skip_substitution(line, j);
+        if (end == 0)
+            printf("Error: Unterminated $(.\n");
+        return end;
+    }
+    if (line[j + 1] == '{')
+    {
+        const char *close = strchr(line + j + 2, '}');
+        if (close == NULL)
+        {
+            printf("Error: Unterminated ${.\n");
+            return 0;
+        }
+        return close - line + 1;
+    }
+    return j + 1 + (line[j + 1] == '?' || line[j + 1] == '$');
+}
+
+// Splits line into tokens in a single pass; the parser checks how they are arranged
+// Returns the number of tokens (the last one is TOK_END), or -1 after printing an error
+int tokenize(const char *line, Arena *arena, Token **tokensOut)
+{
+    int capacity = 16;
+    int count = 0;
+    Token *tokens = arena_alloc(arena, capacity * sizeof(Token));
+    size_t i = 0;
+
+    while (1)
+    {
+        // Skip the separators
+        while (charClass[(unsigned char)line[i]] == CH_SPACE)
+            i++;
+
+        Token token = {(uint32_t)i, 1, TOK_WORD, false, -1};
+        switch (charClass[(unsigned char)line[i]])
+        {
+        case CH_NUL:
+            token.kind = TOK_END;
+            token.length = 0;
+            break;
+        case CH_PIPE:
+            token.kind = line[i + 1] == '|' ? TOK_OR : TOK_PIPE;
+            token.length = token.kind == TOK_OR ? 2 : 1;
+            break;
+        case CH_AMP:
+            if (line[i + 1] == '>')
+            {
+                token.kind = line[i + 2] == '>' ? TOK_ALLAPPEND : TOK_ALLOUT;
+                token.length = token.kind == TOK_ALLAPPEND ? 3 : 2;
+                break;
+            }
+            token.kind = line[i + 1] == '&' ? TOK_AND : TOK_AMP;
+            token.length = token.kind == TOK_AND ? 2 : 1;
+            break;
+        case CH_SEMI:
+            token.kind = TOK_SEMI;
+            break;
+        case CH_LPAREN:
+            token.kind = TOK_LPAREN;
+            break;
+        case CH_RPAREN:
+            token.kind = TOK_RPAREN;
+            break;
+        case CH_LESS:
+        case CH_GREAT:
+            token.length = 0;
+            lex_redirection(line + i, &token);
+            break;
+        default:
+            // A single digit right before < or > is the fd the redirection applies to
+            if (isdigit((unsigned char)line[i]) && (line[i + 1] == '<' || line[i + 1] == '>'))
+            {
+                token.fd = line[i] - '0';
+                lex_redirection(line + i + 1, &token);
+                break;
+            }
+
+            // A word runs until an unquoted separator or operator; a leading ~ names a home directory
+            size_t j = i;
+            token.expand = line[i] == '~';
+            while (1)
+            {
+                uint8_t cls = charClass[(unsigned char)line[j]];
+                if (cls == CH_WORD)
+                {
+                    j++;
+                }
+                else if (cls == CH_DOLLAR)
+                {
+                    if (line[j + 1] != '(' && !is_parameter(line + j))
+                    {
+                        j++;
+                        continue;
+                    }
+                    // $(...) and ${...} belong to the word whatever they contain
+                    size_t end = skip_dollar(line, j);
+                    if (end == 0)
+                        return -1;
+                    j = end;
+                    token.expand = true;
+                }
+                else if (cls == CH_GLOB)
+                {
+                    j++;
+                    token.expand = true;
+                }
+                else if (cls == CH_SQUOTE)
+                {
+                    const char *close = strchr(line + j + 1, '\'');
+                    if (close == NULL)
+                    {
+                        printf("Error: Unterminated quote.\n");
+                        return -1;
+                    }
+                    j = close - line + 1;
+                    token.quoted = true;
+                }
+                else if (cls == CH_DQUOTE)
+                {
+                    j++;
+                    while (line[j] != '"')
+                    {
+                        if (line[j] == '\0')
+                        {
+                            printf("Error: Unterminated quote.\n");
+                            return -1;
+                        }
+                        if (line[j] == '$' && (line[j + 1] == '(' || is_parameter(line + j)))
+                        {
+                            size_t end = skip_dollar(line, j);
+                            if (end == 0)
+                                return -1;
+                            j = end;
+                            token.expand = true;
+                            continue;
+                        }
+                        j += (line[j] == '\\' && line[j + 1] != '\0') ? 2 : 1;
+                    }
+                    j++;
+                    token.quoted = true;
+                }
+                else if (cls == CH_BACKSLASH)
+                {
+                    j += line[j + 1] != '\0' ? 2 : 1;
+                    token.quoted = true;
+                }
+                else
+                {
+                    break;
+                }
+            }
+            token.length = j - i;
+            break;
+        }
+
+        if (count == capacity)
+        {
+            tokens = arena_grow(arena, tokens, capacity * sizeof(Token), 2 * capacity * sizeof(Token));
+            capacity *= 2;
+        }
+        tokens[count++] = token;
+
+        if (token.kind == TOK_END)
+            break;
+        i += token.length;
+    }
+
+    *tokensOut = tokens;
+    return count;
+}
+
+// Terminates a word token in place, leaving its quotes for the expansion to remove
+char *token_raw(char *line, const Token *token)
+{
+    line[token->offset + token->length] = '\0';
+    return line + token->offset;
+}
+
+// Turns a word token into a NUL-terminated string in place, removing quotes and backslashes
+// The byte after the token is always a separator, an operator already tokenized or the line's NUL
+char *token_text(char *line, const Token *token)
+{
+    char *start = line + token->offset;
+    char *end = start + token->length;
+
+    if (!token->quoted)
+    {
+        *end = '\0';
+        return start;
+    }
+
+    char *src = start;
+    char *dst = start;
+    while (src < end)
+    {
+        if (*src == '$' && (src[1] == '(' || is_parameter(src)))
+        {
+            // $(...), ${...}, $$ and $? are kept whole, as the tokenizer took them, quotes inside included
+            size_t length = skip_dollar(line, src - line) - (src - line);
+            memmove(dst, src, length);
+            dst += length;
+            src += length;
+        }
+        else if (*src == '\'')
+        {
+            // Single quotes keep everything literally
+            src++;
+            while (*src != '\'')
+                *dst++ = *src++;
+            src++;
+        }
+        else if (*src == '"')
+        {
+            // Double quotes only honour backslashes before the characters they protect
+            src++;
+            while (*src != '"')
+            {
+                if (*src == '$' && (src[1] == '(' || is_parameter(src)))
+                {
+                    size_t length = skip_dollar(line, src - line) - (src - line);
+                    memmove(dst, src, length);
+                    dst += length;
+                    src += length;
+                    continue;
+                }
+                if (*src == '\\' && (src[1] == '"' || src[1] == '\\' || src[1] == '$' || src[1] == '`'))
+                    src++;
+                *dst++ = *src++;
+            }
+            src++;
+        }
+        else if (*src == '\\')
+        {
+            src++;
+            if (src < end)
+                *dst++ = *src++;
+        }
+        else
+        {
+            *dst++ = *src++;
+        }
+    }
+    *dst = '\0';
+    return start;
+}
+
+// Kinds of node in a parsed command list
+typedef enum
+{
+    NODE_PIPELINE, // A pipeline of commands, the leaves of the tree
+    NODE_SEQUENCE, // left ; right
+    NODE_AND,      // left && right, right only runs if left succeeded
+    NODE_OR        // left || right, right only runs if left failed
+} NodeKind;
+
+// Command-list AST, allocated from the same arena as the commands it holds
+// ( list ) and list items sent to the background are pipelines of one Command whose group is the list
+typedef struct Node
+{
+    NodeKind kind;
+    Command *commands;  // Commands of a NODE_PIPELINE
+    int numCommands;    // Number of commands in it
+    struct Node *left;  // Operands of the list operators
+    struct Node *right;
+} Node;
+
+// State of the recursive-descent parser over one tokenized line
+typedef struct
+{
+    char *line;         // The line, words are unquoted in place as they are taken
+    const char *source; // Untouched copy of the line, kept when it has groups whose text is shown
+    Token *tokens;      // Tokens of the line
+    int pos;            // Index of the current token
+    Arena *arena;       // Where the tree goes
+    bool expansions;    // Some word of the line needs expansion
+    int depth;          // Number of ( groups the current token is inside
+} Parser;
+
+// Allocates a list operator node
+Node *node_new(Arena *arena, NodeKind kind, Node *left, Node *right)
+{
+    Node *node = arena_alloc(arena, sizeof(Node));
+    node->kind = kind;
+    node->commands = NULL;
+    node->numCommands = 0;
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+// Clears a command before the parser fills it in
+void command_init(Command *command, Arena *arena)
+{
+    memset(command, 0, sizeof(*command));
+    command->args = arena_alloc(arena, INITIAL_ARGS * sizeof(char *));
+    command->args[0] = NULL;
+}
+
+// Wraps a list into a one-stage pipeline whose stage is the list as a group, run by a child of the shell
+// text names it in job listings
+Node *node_group(Node *list, const char *text, Arena *arena)
+{
+    Node *pipeline = node_new(arena, NODE_PIPELINE, NULL, NULL);
+    pipeline->commands = arena_alloc(arena, sizeof(Command));
+    pipeline->numCommands = 1;
+    command_init(pipeline->commands, arena);
+    pipeline->commands[0].group = list;
+    pipeline->commands[0].command = pipeline->commands[0].args[0] = (char *)text;
+    pipeline->commands[0].args[1] = NULL;
+    return pipeline;
+}
+
+// Turns a list into something that runs on its own in the background
+// A pipeline just gets the flag, anything else becomes a group
+Node *node_background(Node *list, const char *text, Arena *arena)
+{
+    if (list->kind != NODE_PIPELINE)
+        list = node_group(list, text, arena);
+    list->commands[0].background = true;
+    return list;
+}
+
+// Text of the tokens [first, last) for jobs and the stats log, or a placeholder without a source copy
+char *parser_text(Parser *p, int first, int last)
+{
+    if (p->source == NULL)
+        return "(...)";
+    const Token *end = &p->tokens[last - 1];
+    uint32_t from = p->tokens[first].offset;
+    return arena_strndup(p->arena, p->source + from, end->offset + end->length - from);
+}
+
+// Explains why there is no command where one was expected
+void missing_command_error(Parser *p, bool afterPipe)
+{
+    TokenKind kind = p->tokens[p->pos].kind;
+    if ((kind == TOK_PIPE && p->pos == 0) || (afterPipe && kind == TOK_END))
+        printf("Error: Input cannot start or end with a pipe.\n");
+    else if (kind == TOK_PIPE || afterPipe)
+        printf("Error: Improper use of pipes.\n");
+    else if (kind == TOK_RPAREN && p->pos > 0 && p->tokens[p->pos - 1].kind == TOK_LPAREN)
+        printf("Error: Empty ( ).\n");
+    else
+        printf("Error: Missing command.\n");
+}
+
+Node *parse_list(Parser *p, TokenKind closer);
+
+// Parses one stage: a simple command with its words and redirections, or ( list ) with redirections
+bool parse_stage(Parser *p, Command *command)
+{
+    command_init(command, p->arena);
+    int argCount = 0;            // Number of arguments of the command
+    int argCapacity = INITIAL_ARGS; // Room in the args vector, including the NULL terminator
+    int redirCapacity = 0;       // Room in the redirs vector
+    int assignCapacity = 0;      // Room in the assigns vector
+
+    // An unquoted @host as the first word sends the stage to the agent there; anywhere else, and quoted,
+    // a word starting with @ is an ordinary one (npm's @scope/pkg, git's @{u}, echo a @ b)
+    Token *first = &p->tokens[p->pos];
+    if (first->kind == TOK_WORD && !first->quoted && !first->expand && first->length > 1 && p->line[first->offset] == '@')
+    {
+        command->remote = token_text(p->line, first) + 1;
+        p->pos++;
+        if (p->tokens[p->pos].kind == TOK_LPAREN)
+        {
+            printf("Error: A group can't run on an agent.\n");
+            return false;
+        }
+    }
+
+    if (p->tokens[p->pos].kind == TOK_LPAREN)
+    {
+        // Each level recurses, so a line of ((((... must not run the stack out
+        if (p->depth == MAX_GROUP_DEPTH)
+        {
+            printf("Error: Groups nested too deeply.\n");
+            return false;
+        }
+        int first = p->pos++;
+        p->depth++;
+        command->group = parse_list(p, TOK_RPAREN);
+        p->depth--;
+        if (command->group == NULL)
+            return false;
+        p->pos++; // The )
+        command->command = command->args[0] = parser_text(p, first, p->pos);
+        command->args[1] = NULL;
+        argCount = 1;
+    }
+
+    // When one word of the command needs expansion, all of them keep their quotes: each launch expands
+    // the words again and removes the quotes then
+    bool expand = false;
+    for (Token *token = &p->tokens[p->pos]; p->expansions && command->group == NULL && (token->kind == TOK_WORD || is_redirection(token->kind)); token++)
+        expand = expand || token->expand;
+
+    while (1)
+    {
+        Token *token = &p->tokens[p->pos];
+        if (token->kind == TOK_WORD)
+        {
+            if (command->group != NULL)
+            {
+                printf("Error: Unexpected word after ).\n");
+                return false;
+            }
+
+            // NAME=value words before the command name are assignments
+            if (argCount == 0 && is_assignment(p->line + token->offset, token->length))
+            {
+                if (command->numAssigns == assignCapacity)
+                {
+                    int newCapacity = assignCapacity ? 2 * assignCapacity : 2;
+                    command->assigns = arena_grow(p->arena, command->assigns, assignCapacity * sizeof(char *), newCapacity * sizeof(char *));
+                    assignCapacity = newCapacity;
+                }
+                command->assigns[command->numAssigns++] = expand ? token_raw(p->line, token) : token_text(p->line, token);
+                p->pos++;
+                continue;
+            }
+
+            // Add it to the arguments, leaving space for the NULL terminator
+            if (argCount == argCapacity - 1)
+            {
+                command->args = arena_grow(p->arena, command->args, argCapacity * sizeof(char *), 2 * argCapacity * sizeof(char *));
+                argCapacity *= 2;
+            }
+            command->args[argCount++] = expand ? token_raw(p->line, token) : token_text(p->line, token);
+            command->args[argCount] = NULL;
+            p->pos++;
+        }
+        else if (is_redirection(token->kind))
+        {
+            // The next token must be its target word
+            if (token[1].kind != TOK_WORD)
+            {
+                printf("Error: Missing file name after redirection.\n");
+                return false;
+            }
+            // &> takes two entries, so make room for both
+            if (command->numRedirs + 2 > redirCapacity)
+            {
+                int newCapacity = redirCapacity ? 2 * redirCapacity : 2;
+                command->redirs = arena_grow(p->arena, command->redirs, redirCapacity * sizeof(Redirect), newCapacity * sizeof(Redirect));
+                redirCapacity = newCapacity;
+            }
+            Redirect *redir = &command->redirs[command->numRedirs++];
+            // File names and here-strings are expanded, here-document delimiters and >&N are taken as they are
+            bool literal = token->kind == TOK_HEREDOC || token->kind == TOK_DUPIN || token->kind == TOK_DUPOUT;
+            redir->word = expand && !literal ? token_raw(p->line, &token[1]) : NULL;
+            char *target = redir->word != NULL ? NULL : token_text(p->line, &token[1]);
+            bool input = token->kind == TOK_IN || token->kind == TOK_RDWR || token->kind == TOK_DUPIN || token->kind == TOK_HERESTRING ||
+                         token->kind == TOK_HEREDOC;
+            redir->fd = token->fd >= 0 ? token->fd : input ? STDIN_FILENO : STDOUT_FILENO;
+            redir->target = target;
+            redir->srcFd = -1;
+            redir->body = NULL;
+            redir->stripTabs = false;
+            redir->hints = 0;
+            redir->prealloc = 0;
+            switch (token->kind)
+            {
+            case TOK_IN:
+                redir->kind = REDIR_IN;
+                break;
+            case TOK_OUT:
+                redir->kind = REDIR_OUT;
+                break;
+            case TOK_APPEND:
+                redir->kind = REDIR_APPEND;
+                break;
+            case TOK_RDWR:
+                redir->kind = REDIR_RDWR;
+                break;
+            case TOK_HERESTRING:
+                redir->kind = REDIR_STRING;
+                break;
+            case TOK_HEREDOC:
+                // The body is read by the caller once the whole line is parsed
+                redir->kind = REDIR_HEREDOC;
+                redir->stripTabs = token->length == 3;
+                break;
+            case TOK_DUPIN:
+            case TOK_DUPOUT:
+                // N>&M duplicates, N>&- closes, and >&file (no fd, not a number) means &>file
+                if (strcmp(target, "-") == 0)
+                {
+                    redir->kind = REDIR_CLOSE;
+                    break;
+                }
+                if (target[0] != '\0' && target[strspn(target, "0123456789")] == '\0')
+                {
+                    redir->kind = REDIR_DUP;
+                    redir->srcFd = atoi(target);
+                    break;
+                }
+                if (token->kind == TOK_DUPIN || token->fd >= 0)
+                {
+                    printf("Error: Bad file descriptor in redirection.\n");
+                    return false;
+                }
+                // Fall through
+            default:
+                // &> and &>>: stdout to the file, then stderr onto stdout
+                redir->kind = token->kind == TOK_ALLAPPEND ? REDIR_APPEND : REDIR_OUT;
+                redir->fd = STDOUT_FILENO;
+                command->redirs[command->numRedirs++] = (Redirect){REDIR_DUP, STDERR_FILENO, NULL, STDOUT_FILENO};
+                break;
+            }
+            // The operator's {hints}, once the kind is known
+            const char *brace = memchr(p->line + token->offset, '{', token->length);
+            if (brace != NULL && !parse_io_hints(brace + 1, p->line + token->offset + token->length - 1 - (brace + 1), redir))
+                return false;
+            p->pos += 2;
+        }
+        else if (token->kind == TOK_LPAREN)
+        {
+            printf("Error: Unexpected (.\n");
+            return false;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (argCount == 0 && (command->numAssigns == 0 || command->remote != NULL))
+    {
+        missing_command_error(p, false);
+        return false;
+    }
+    command->command = command->args[0]; // NULL for assignments alone
+    if (expand)
+    {
+        command->words = command->args;
+        command->assignWords = command->assigns;
+    }
+    return true;
+}
+
+// Parses [time] stage | stage | ...
+Node *parse_pipeline(Parser *p)
+{
+    // A leading unquoted `time` followed by a command is the keyword, not a command
+    Token *token = &p->tokens[p->pos];
+    bool timed = false;
+    if (token->kind == TOK_WORD && !token->quoted && token->length == 4 && memcmp(p->line + token->offset, "time", 4) == 0 &&
+        (token[1].kind == TOK_WORD || token[1].kind == TOK_LPAREN))
+    {
+        timed = true;
+        p->pos++;
+    }
+
+    Node *node = node_new(p->arena, NODE_PIPELINE, NULL, NULL);
+    int capacity = 2;
+    node->commands = arena_alloc(p->arena, capacity * sizeof(Command));
+    bool afterPipe = false;
+    while (1)
+    {
+        TokenKind kind = p->tokens[p->pos].kind;
+        if (kind != TOK_WORD && kind != TOK_LPAREN && !is_redirection(kind))
+        {
+            missing_command_error(p, afterPipe);
+            return NULL;
+        }
+        if (node->numCommands == capacity)
+        {
+            node->commands = arena_grow(p->arena, node->commands, capacity * sizeof(Command), 2 * capacity * sizeof(Command));
+            capacity *= 2;
+        }
+        if (!parse_stage(p, &node->commands[node->numCommands++]))
+            return NULL;
+
+        if (p->tokens[p->pos].kind != TOK_PIPE)
+            break;
+        p->pos++;
+        afterPipe = true;
+    }
+    node->commands[0].timed = timed;
+    return node;
+}
+
+// Parses pipeline && pipeline || ..., both operators with the same precedence, left to right
+Node *parse_and_or(Parser *p)
+{
+    Node *left = parse_pipeline(p);
+    while (left != NULL && (p->tokens[p->pos].kind == TOK_AND || p->tokens[p->pos].kind == TOK_OR))
+    {
+        NodeKind kind = p->tokens[p->pos++].kind == TOK_AND ? NODE_AND : NODE_OR;
+        Node *right = parse_pipeline(p);
+        left = right != NULL ? node_new(p->arena, kind, left, right) : NULL;
+    }
+    return left;
+}
+
+// Parses items separated (or ended) by ; and &, until the closer token: the end of the line or a )
+Node *parse_list(Parser *p, TokenKind closer)
+{
+    Node *list = NULL;
+    while (1)
+    {
+        TokenKind kind = p->tokens[p->pos].kind;
+        if (kind == TOK_END || kind == TOK_RPAREN)
+        {
+            if (kind != closer)
+            {
+                printf(kind == TOK_END ? "Error: Missing ).\n" : "Error: Unexpected ).\n");
+                return NULL;
+            }
+            if (list == NULL)
+                missing_command_error(p, false);
+            return list;
+        }
+
+        int first = p->pos;
+        Node *item = parse_and_or(p);
+        if (item == NULL)
+            return NULL;
+        if (p->tokens[p->pos].kind == TOK_AMP)
+        {
+            item = node_background(item, item->kind == NODE_PIPELINE ? NULL : parser_text(p, first, p->pos), p->arena);
+            p->pos++;
+        }
+        else if (p->tokens[p->pos].kind == TOK_SEMI)
+        {
+            p->pos++;
+        }
+        list = list != NULL ? node_new(p->arena, NODE_SEQUENCE, list, item) : item;
+    }
+}
+
+// Function to parse a user input line into its command-list tree, allocated from the arena
+// Returns NULL (after printing why) if the line is invalid
+Node *parse_line(char *input, Arena *arena)
+{
+    // Lex the whole line in one pass
+    Token *tokens;
+    TRACE_BEGIN("lex", 0);
+    int numTokens = tokenize(input, arena, &tokens);
+    TRACE_END("lex", numTokens);
+    if (numTokens < 0)
+    {
+        return NULL;
+    }
+    if (numTokens == 1)
+    {
+        printf("Error: Input is empty or contains only spaces.\n");
+        return NULL;
+    }
+
+    // Groups and backgrounded lists show their text, which must be taken before words are unquoted in place
+    Parser parser = {input, NULL, tokens, 0, arena, false, 0};
+    bool copySource = false;
+    for (int t = 0; t < numTokens; t++)
+    {
+        copySource = copySource || tokens[t].kind == TOK_LPAREN || tokens[t].kind == TOK_AMP;
+        parser.expansions = parser.expansions || tokens[t].expand;
+    }
+    if (copySource)
+        parser.source = arena_strndup(arena, input, strlen(input));
+
+    // Building the tree also validates the line
+    TRACE_BEGIN("parse", numTokens);
+    Node *root = parse_list(&parser, TOK_END);
+    TRACE_END("parse", root != NULL);
+    return root;
+}
+
+/* HASHED COMMAND CACHE (PATH LOOKUP) */
+
+#define HASH_INITIAL_BUCKETS 64 // Initial bucket count of the command cache, always a power of two
+
+// A bare command name resolved against PATH, like an entry of bash's `hash` table
+typedef struct HashEntry
+{
+    char *name;              // Bare command name (the key)
+    char *path;              // Resolved path, dir/name
+    dev_t dev;               // Device of the resolved file, to notice replacements
+    ino_t ino;               // Inode of the resolved file
+    struct timespec mtime;   // mtime of the resolved file when it was hashed
+    struct HashEntry *next;  // Next entry in the same bucket
+} HashEntry;
+
+// Chained hash table from command name to resolved path
+typedef struct
+{
+    HashEntry **buckets; // Bucket heads
+    size_t numBuckets;   // Number of buckets, a power of two
+    size_t numEntries;   // Number of hashed commands
+    char *pathValue;     // Copy of the PATH the entries were resolved against, NULL if none
+    uint64_t generation; // Bumped whenever an entry is dropped, so paths remembered elsewhere can be trusted
+    unsigned long hits;   // Lookups answered from the table
+    unsigned long misses; // Lookups that had to search PATH
+    bool filled;              // Every executable of PATH was hashed, for completion
+    struct timespec filledAt; // Newest mtime of the PATH directories when they were
+} CommandHash;
+
+CommandHash commandHash = {NULL, 0, 0, NULL, 1, 0, 0};
+
+// FNV-1a hash of a NUL-terminated string
+size_t hash_string(const char *str)
+{
+    size_t hash = 14695981039346656037ULL;
+    while (*str)
+    {
+        hash ^= (unsigned char)*str++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Drops every hashed command (PATH changed, or `hash -r`)
+void command_hash_clear(CommandHash *table)
+{
+    for (size_t b = 0; b < table->numBuckets; b++)
+    {
+        HashEntry *entry = table->buckets[b];
+        while (entry != NULL)
+        {
+            HashEntry *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        table->buckets[b] = NULL;
+    }
+    table->numEntries = 0;
+    table->generation++;
+    table->filled = false;
+}
+
+// Doubles the bucket array once the table gets too loaded
+void command_hash_grow(CommandHash *table)
+{
+    size_t newCount = table->numBuckets ? table->numBuckets * 2 : HASH_INITIAL_BUCKETS;
+    HashEntry **newBuckets = calloc(newCount, sizeof(HashEntry *));
+    if (!newBuckets)
+    {
+        perror("Failed to allocate memory for the command hash");
+        exit(EXIT_FAILURE);
+    }
+
+    // Rehash the existing entries into the new buckets
+    for (size_t b = 0; b < table->numBuckets; b++)
+    {
+        HashEntry *entry = table->buckets[b];
+        while (entry != NULL)
+        {
+            HashEntry *next = entry->next;
+            size_t slot = hash_string(entry->name) & (newCount - 1);
+            entry->next = newBuckets[slot];
+            newBuckets[slot] = entry;
+            entry = next;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = newBuckets;
+    table->numBuckets = newCount;
+}
+
+// Unlinks and frees the entry for name, if hashed
+void command_hash_remove(CommandHash *table, const char *name)
+{
+    if (table->numBuckets == 0)
+        return;
+
+    HashEntry **link = &table->buckets[hash_string(name) & (table->numBuckets - 1)];
+    while (*link != NULL)
+    {
+        if (strcmp((*link)->name, name) == 0)
+        {
+            HashEntry *entry = *link;
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            table->numEntries--;
+            table->generation++;
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+// Flushes the table if PATH no longer matches the value its entries were resolved against
+void command_hash_check_path(CommandHash *table, const char *pathValue)
+{
+    if (table->pathValue != NULL && strcmp(table->pathValue, pathValue) == 0)
+        return;
+
+    command_hash_clear(table);
+    free(table->pathValue);
+    table->pathValue = strdup(pathValue);
+}
+
+// Walks the PATH directories looking for an executable regular file called name
+// On success returns a malloc'ed dir/name and fills st with its metadata
+char *search_path(const char *name, const char *pathValue, struct stat *st)
+{
+    size_t nameLen = strlen(name);
+    const char *dir = pathValue;
+
+    while (1)
+    {
+        const char *end = strchr(dir, ':');
+        size_t dirLen = end ? (size_t)(end - dir) : strlen(dir);
+
+        // An empty PATH component means the current directory
+        char *candidate = malloc(dirLen + nameLen + 3);
+        if (!candidate)
+        {
+            perror("Failed to allocate memory for a command path");
+            exit(EXIT_FAILURE);
+        }
+        if (dirLen == 0)
+        {
+            candidate[0] = '.';
+            dirLen = 1;
+        }
+        else
+        {
+            memcpy(candidate, dir, dirLen);
+        }
+        candidate[dirLen] = '/';
+        memcpy(candidate + dirLen + 1, name, nameLen + 1);
+
+        if (stat(candidate, st) == 0 && S_ISREG(st->st_mode) && access(candidate, X_OK) == 0)
+        {
+            return candidate;
+        }
+        free(candidate);
+
+        if (end == NULL)
+            return NULL;
+        dir = end + 1;
+    }
+}
+
+// Returns the entry hashed for name, or NULL
+HashEntry *command_hash_find(CommandHash *table, const char *name)
+{
+    if (table->numBuckets == 0)
+        return NULL;
+    HashEntry *entry = table->buckets[hash_string(name) & (table->numBuckets - 1)];
+    while (entry != NULL && strcmp(entry->name, name) != 0)
+        entry = entry->next;
+    return entry;
+}
+
+// Hashes name as resolved to path (malloc'ed, taken over by the table), whose metadata is st
+HashEntry *command_hash_insert(CommandHash *table, const char *name, char *path, const struct stat *st)
+{
+    if (table->numEntries >= table->numBuckets * 3 / 4)
+        command_hash_grow(table);
+
+    HashEntry *entry = malloc(sizeof(HashEntry));
+    if (!entry || !(entry->name = strdup(name)))
+    {
+        perror("Failed to allocate memory for the command hash");
+        exit(EXIT_FAILURE);
+    }
+    entry->path = path;
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->mtime = st->st_mtim;
+
+    size_t slot = hash_string(name) & (table->numBuckets - 1);
+    entry->next = table->buckets[slot];
+    table->buckets[slot] = entry;
+    table->numEntries++;
+    return entry;
+}
+
+// Value of PATH commands are searched in
+const char *current_path(void)
+{
+    const char *pathValue = getenv("PATH");
+    return pathValue != NULL ? pathValue : "/usr/local/bin:/usr/bin:/bin"; // Same fallback as most shells
+}
+
+// Resolves a command name to the path to execute, NULL if it can't be found
+// Names with a '/' are used as they are, bare names go through the hashed cache and then PATH
+const char *lookup_command(const char *name)
+{
+    if (strchr(name, '/') != NULL)
+        return name;
+
+    const char *pathValue = current_path();
+    command_hash_check_path(&commandHash, pathValue);
+
+    // Cached name: a single stat of the hashed file, no walk over PATH
+    struct stat st;
+    HashEntry *entry = command_hash_find(&commandHash, name);
+    if (entry != NULL)
+    {
+        if (stat(entry->path, &st) == 0 && st.st_dev == entry->dev && st.st_ino == entry->ino &&
+            st.st_mtim.tv_sec == entry->mtime.tv_sec && st.st_mtim.tv_nsec == entry->mtime.tv_nsec)
+        {
+            commandHash.hits++;
+            return entry->path;
+        }
+
+        // The hashed file disappeared or changed, forget it and search again
+        command_hash_remove(&commandHash, name);
+    }
+
+    commandHash.misses++;
+    char *path = search_path(name, pathValue, &st);
+    if (path == NULL)
+        return NULL;
+
+    // Remember it for the next lookup
+    return command_hash_insert(&commandHash, name, path, &st)->path;
+}
+
+// Hashes every executable of the PATH directories that is not hashed yet, the first directory winning,
+// so completion can offer all the command names; runs again only once a directory was modified since
+// Relative and empty entries (the current directory) are searched like search_path() does, as ./name and the
+// like, and since they follow the current directory a PATH with one is searched again on every call
+void command_hash_fill(CommandHash *table)
+{
+    const char *pathValue = current_path();
+    command_hash_check_path(table, pathValue);
+
+    struct timespec newest = {0, 0};
+    struct stat st;
+    bool relative = false;
+    for (const char *dir = pathValue; dir != NULL; dir = strchr(dir, ':') ? strchr(dir, ':') + 1 : NULL)
+    {
+        char dirPath[PATH_MAX];
+        snprintf(dirPath, sizeof(dirPath), "%.*s", (int)strcspn(dir, ":"), dir);
+        relative = relative || dirPath[0] != '/';
+        if (dirPath[0] == '/' && stat(dirPath, &st) == 0 &&
+            (st.st_mtim.tv_sec > newest.tv_sec || (st.st_mtim.tv_sec == newest.tv_sec && st.st_mtim.tv_nsec > newest.tv_nsec)))
+            newest = st.st_mtim;
+    }
+    if (table->filled && !relative && newest.tv_sec == table->filledAt.tv_sec && newest.tv_nsec == table->filledAt.tv_nsec)
+        return;
+
+    for (const char *dir = pathValue; dir != NULL; dir = strchr(dir, ':') ? strchr(dir, ':') + 1 : NULL)
+    {
+        char dirPath[PATH_MAX];
+        int dirLen = snprintf(dirPath, sizeof(dirPath), "%.*s", (int)strcspn(dir, ":"), dir);
+        if (dirLen == 0)
+            dirLen = snprintf(dirPath, sizeof(dirPath), ".");
+        DIR *stream = opendir(dirPath);
+        if (stream == NULL)
+            continue;
+        struct dirent *entry;
+        while ((entry = readdir(stream)) != NULL)
+        {
+            if (entry->d_name[0] == '.' || command_hash_find(table, entry->d_name) != NULL)
+                continue;
+            if (fstatat(dirfd(stream), entry->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode) ||
+                faccessat(dirfd(stream), entry->d_name, X_OK, 0) < 0)
+                continue;
+            char *path = malloc(dirLen + strlen(entry->d_name) + 2);
+            if (!path)
+            {
+                perror("Failed to allocate memory for a command path");
+                exit(EXIT_FAILURE);
+            }
+            sprintf(path, "%s/%s", dirPath, entry->d_name);
+            command_hash_insert(table, entry->d_name, path, &st);
+        }
+        closedir(stream);
+    }
+    table->filled = true;
+    table->filledAt = newest;
+}
+
+/* PARSED-PIPELINE CACHE */
+
+#define PLAN_INITIAL_BUCKETS 256 // Initial bucket count of the plan cache, always a power of two
+
+// A parsed line kept for reuse: its own arena holds the key, the parsed copy of the line, the commands and their argv
+typedef struct PlanEntry
+{
+    uint64_t hash;            // Hash of the raw line
+    char *key;                // Pristine copy of the raw line
+    size_t keyLen;            // Length of key
+    Arena arena;              // Owns everything the plan points to, independent from the line arena
+    struct Node *root;        // Parsed command list
+    size_t bytes;             // Memory charged to this entry
+    int pins;                 // Plans being executed can't be evicted
+    struct PlanEntry *chain;  // Next entry in the same bucket
+    struct PlanEntry *newer;  // LRU neighbours, most recently used at the head
+    struct PlanEntry *older;
+} PlanEntry;
+
+// LRU cache from the hash of a raw input line to its parsed command list, bounded by memory
+typedef struct
+{
+    size_t capacity;        // Memory budget in bytes, 0 disables the cache
+    size_t bytes;           // Memory currently charged to entries
+    PlanEntry **buckets;    // Hash buckets
+    size_t numBuckets;      // Number of buckets, a power of two
+    size_t numEntries;      // Number of cached plans
+    PlanEntry *head;        // Most recently used plan
+    PlanEntry *tail;        // Least recently used plan
+    unsigned long hits;      // Lines executed from a cached plan
+    unsigned long misses;    // Lines that had to be parsed
+    unsigned long evictions; // Plans dropped to stay within capacity
+} PlanCache;
+
+PlanCache planCache = {0};
+
+// FNV-1a hash of len bytes
+uint64_t hash_bytes(const char *data, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Detaches entry from the LRU list
+void plan_cache_unlink(PlanCache *cache, PlanEntry *entry)
+{
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    else
+        cache->head = entry->older;
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    else
+        cache->tail = entry->newer;
+    entry->newer = entry->older = NULL;
+}
+
+// Puts entry at the most recently used end of the LRU list
+void plan_cache_push_front(PlanCache *cache, PlanEntry *entry)
+{
+    entry->older = cache->head;
+    entry->newer = NULL;
+    if (cache->head)
+        cache->head->newer = entry;
+    cache->head = entry;
+    if (cache->tail == NULL)
+        cache->tail = entry;
+}
+
+// Removes entry from the cache and frees it
+void plan_cache_drop(PlanCache *cache, PlanEntry *entry)
+{
+    PlanEntry **link = &cache->buckets[entry->hash & (cache->numBuckets - 1)];
+    while (*link != entry)
+        link = &(*link)->chain;
+    *link = entry->chain;
+
+    plan_cache_unlink(cache, entry);
+    cache->bytes -= entry->bytes;
+    cache->numEntries--;
+    arena_free(&entry->arena);
+    free(entry);
+}
+
+// Evicts least recently used plans (skipping pinned ones) until the cache fits its capacity
+void plan_cache_shrink(PlanCache *cache)
+{
+    PlanEntry *entry = cache->tail;
+    while (cache->bytes > cache->capacity && entry != NULL)
+    {
+        PlanEntry *newer = entry->newer;
+        if (entry->pins == 0)
+        {
+            plan_cache_drop(cache, entry);
+            cache->evictions++;
+        }
+        entry = newer;
+    }
+}
+
+// Returns the cached plan for line, or parses it into a new entry on a miss
+// Returns NULL (after the parser printed why) if the line is invalid; such lines are not cached
+// The returned plan is pinned and must be released with plan_cache_release()
+PlanEntry *plan_cache_get(PlanCache *cache, const char *line)
+{
+    size_t len = strlen(line);
+    uint64_t hash = hash_bytes(line, len);
+
+    if (cache->numBuckets != 0)
+    {
+        for (PlanEntry *entry = cache->buckets[hash & (cache->numBuckets - 1)]; entry != NULL; entry = entry->chain)
+        {
+            if (entry->hash == hash && entry->keyLen == len && memcmp(entry->key, line, len) == 0)
+            {
+                cache->hits++;
+                plan_cache_unlink(cache, entry);
+                plan_cache_push_front(cache, entry);
+                entry->pins++;
+                return entry;
+            }
+        }
+    }
+    cache->misses++;
+
+    // Parse a private copy of the line straight into the entry's arena
+    PlanEntry *entry = calloc(1, sizeof(PlanEntry));
+    if (!entry)
+    {
+        perror("Failed to allocate memory for the plan cache");
+        exit(EXIT_FAILURE);
+    }
+    entry->arena.blockSize = 8 * len + 512; // Enough for the key, the parsed copy, tokens and argv of typical lines
+    entry->hash = hash;
+    entry->keyLen = len;
+    entry->key = arena_strndup(&entry->arena, line, len);
+    char *work = arena_strndup(&entry->arena, line, len);
+    entry->root = parse_line(work, &entry->arena);
+    if (entry->root == NULL)
+    {
+        arena_free(&entry->arena);
+        free(entry);
+        return NULL;
+    }
+    entry->bytes = sizeof(PlanEntry) + arena_footprint(&entry->arena);
+
+    // Link it in, growing the bucket array with the number of entries
+    if (cache->numEntries >= cache->numBuckets * 3 / 4)
+    {
+        size_t newCount = cache->numBuckets ? cache->numBuckets * 2 : PLAN_INITIAL_BUCKETS;
+        PlanEntry **newBuckets = calloc(newCount, sizeof(PlanEntry *));
+        if (!newBuckets)
+        {
+            perror("Failed to allocate memory for the plan cache");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t b = 0; b < cache->numBuckets; b++)
+        {
+            PlanEntry *old = cache->buckets[b];
+            while (old != NULL)
+            {
+                PlanEntry *next = old->chain;
+                old->chain = newBuckets[old->hash & (newCount - 1)];
+                newBuckets[old->hash & (newCount - 1)] = old;
+                old = next;
+            }
+        }
+        free(cache->buckets);
+        cache->buckets = newBuckets;
+        cache->numBuckets = newCount;
+    }
+    PlanEntry **bucket = &cache->buckets[hash & (cache->numBuckets - 1)];
+    entry->chain = *bucket;
+    *bucket = entry;
+    plan_cache_push_front(cache, entry);
+    cache->numEntries++;
+    cache->bytes += entry->bytes;
+    entry->pins = 1;
+
+    plan_cache_shrink(cache);
+    return entry;
+}
+
+// Unpins a plan once its execution finished, evicting it if the cache is over capacity
+void plan_cache_release(PlanCache *cache, PlanEntry *entry)
+{
+    entry->pins--;
+    plan_cache_shrink(cache);
+}
+
+// Drops every cached plan
+void plan_cache_free(PlanCache *cache)
+{
+    while (cache->head != NULL)
+        plan_cache_drop(cache, cache->head);
+    free(cache->buckets);
+    cache->buckets = NULL;
+    cache->numBuckets = 0;
+}
+
+// Prints the counters of the command hash and the plan cache
+void print_cache_stats(FILE *out)
+{
+    fprintf(out, "command hash: %zu entries, %lu hits, %lu misses\n",
+            commandHash.numEntries, commandHash.hits, commandHash.misses);
+    fprintf(out, "plan cache: %zu entries, %zu/%zu bytes, %lu hits, %lu misses, %lu evictions\n",
+            planCache.numEntries, planCache.bytes, planCache.capacity, planCache.hits, planCache.misses, planCache.evictions);
+}
+
+/* PIPELINE INSTRUMENTATION */
+
+// What the shell learned about one process of a pipeline
+typedef struct
+{
+    pid_t pid;              // Process id, -1 when the stage never started
+    char **args;            // argv of the stage (NULL for a fan-out mover)
+    bool builtin;           // Ran a builtin, in a child or in the shell itself
+    struct timespec start;  // When it was launched
+    struct timespec end;    // When it was reaped
+    int status;             // Raw wait status
+    struct rusage usage;    // Resources used, from wait4()
+    bool done;              // Already reaped
+    bool stopped;           // Currently stopped (Ctrl-Z, SIGSTOP)
+    bool zygote;            // Started by the zygote, which reports its status over zygoteFd
+    int watch;              // Event loop watch on the stage's pidfd, 0 when there is none
+} StageStats;
+
+int lastStatus = 0;  // Exit status of the last pipeline, used as the default of `exit`
+int statsLogFd = -1; // --stats-log: JSON lines file receiving one record per pipeline
+
+// Monotonic clock reading
+struct timespec now_monotonic(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts;
+}
+
+// Microseconds from a to b
+long long elapsed_us(struct timespec a, struct timespec b)
+{
+    return (b.tv_sec - a.tv_sec) * 1000000LL + (b.tv_nsec - a.tv_nsec) / 1000;
+}
+
+// Microseconds in a timeval
+long long timeval_us(struct timeval tv)
+{
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// Shell-style exit code of a wait status
+int exit_code(int status)
+{
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// Prints a duration the way bash's `time` does
+void print_time_line(const char *label, long long us)
+{
+    fprintf(stderr, "%s\t%lldm%lld.%03llds\n", label, us / 60000000, us / 1000000 % 60, us / 1000 % 1000);
+}
+
+// Appends the status and resource fields of a finished pipeline, with one object per stage, to a JSON object
+void pipeline_json(StrBuf *json, StageStats *stages, int numStages, int status, struct timespec start, struct timespec end)
+{
+    long long userUs = 0, sysUs = 0;
+    for (int s = 0; s < numStages; s++)
+    {
+        userUs += timeval_us(stages[s].usage.ru_utime);
+        sysUs += timeval_us(stages[s].usage.ru_stime);
+    }
+
+    strbuf_printf(json, "\"status\":%d,\"wall_us\":%lld,\"user_us\":%lld,\"sys_us\":%lld,\"stages\":[",
+                  status, elapsed_us(start, end), userUs, sysUs);
+    for (int s = 0; s < numStages; s++)
+    {
+        StageStats *stage = &stages[s];
+        strbuf_printf(json, "%s{\"argv\":[", s ? "," : "");
+        if (stage->args == NULL)
+            strbuf_json_string(json, "(fan-out)");
+        for (int a = 0; stage->args != NULL && stage->args[a] != NULL; a++)
+        {
+            if (a)
+                strbuf_append(json, ",", 1);
+            strbuf_json_string(json, stage->args[a]);
+        }
+        strbuf_printf(json, "],\"pid\":%d,\"builtin\":%s", stage->pid, stage->builtin ? "true" : "false");
+        if (stage->pid < 0 && !stage->builtin)
+        {
+            strbuf_printf(json, ",\"started\":false}");
+            continue;
+        }
+        strbuf_printf(json, ",\"exit\":%d,\"signal\":%d,\"wall_us\":%lld,\"user_us\":%lld,\"sys_us\":%lld,"
+                            "\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}",
+                      WIFEXITED(stage->status) ? WEXITSTATUS(stage->status) : -1,
+                      WIFSIGNALED(stage->status) ? WTERMSIG(stage->status) : 0,
+                      elapsed_us(stage->start, stage->end), timeval_us(stage->usage.ru_utime), timeval_us(stage->usage.ru_stime),
+                      stage->usage.ru_maxrss, stage->usage.ru_nvcsw, stage->usage.ru_nivcsw);
+    }
+    strbuf_append(json, "]", 1);
+}
+
+// Reports a finished pipeline: `time` output if requested, and a JSON line in the stats log
+void report_pipeline(StageStats *stages, int numStages, int status, bool timed, struct timespec start, struct timespec end, Arena *arena)
+{
+    if (timed)
+    {
+        long long userUs = 0, sysUs = 0;
+        for (int s = 0; s < numStages; s++)
+        {
+            userUs += timeval_us(stages[s].usage.ru_utime);
+            sysUs += timeval_us(stages[s].usage.ru_stime);
+        }
+        fprintf(stderr, "\n");
+        print_time_line("real", elapsed_us(start, end));
+        print_time_line("user", userUs);
+        print_time_line("sys", sysUs);
+    }
+
+    if (statsLogFd < 0)
+        return;
+
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    StrBuf json = {arena, NULL, 0, 0};
+    strbuf_printf(&json, "{\"time\":%lld.%06ld,\"shell_pid\":%d,", (long long)wall.tv_sec, wall.tv_nsec / 1000, getpid());
+    pipeline_json(&json, stages, numStages, status, start, end);
+    strbuf_append(&json, "}\n", 2);
+
+    // One O_APPEND write per record keeps lines whole when several shells share the log
+    if (write(statsLogFd, json.data, json.len) < 0)
+        perror("Failed to write the stats log");
+}
+
+// Difference of two rusage snapshots of the shell itself, for builtins that ran in-process
+void rusage_delta(struct rusage *result, const struct rusage *before, const struct rusage *after)
+{
+    memset(result, 0, sizeof(*result));
+    timersub(&after->ru_utime, &before->ru_utime, &result->ru_utime);
+    timersub(&after->ru_stime, &before->ru_stime, &result->ru_stime);
+    result->ru_maxrss = after->ru_maxrss;
+    result->ru_nvcsw = after->ru_nvcsw - before->ru_nvcsw;
+    result->ru_nivcsw = after->ru_nivcsw - before->ru_nivcsw;
+}
+
+/* EVENT LOOP (IO_URING WITH AN EPOLL FALLBACK) */
+
+#define EVENT_RING_ENTRIES 256 // Submission queue size of the io_uring, the kernel makes the completion queue twice as big
+
+// A descriptor the shell waits on, and what to do once it is readable (or writable)
+typedef struct
+{
+    int fd;                    // Watched descriptor
+    void (*ready)(void *data); // Called when fd is readable or hung up, may unwatch anything
+    void *data;                // Argument of ready
+    bool active;               // Still wanted
+    bool pending;              // io_uring: a poll request for it is in flight, the slot can't be reused yet
+    bool ownsFd;               // Close fd along with the watch
+    bool writable;             // Wait for room to write instead of data to read
+} Watch;
+
+// How the loop sleeps
+typedef enum
+{
+    EVENTS_NONE,     // Not set up yet, or dropped in a forked child
+    EVENTS_IO_URING, // One-shot IORING_OP_POLL_ADD requests, armed again after each completion
+    EVENTS_EPOLL     // Level-triggered epoll set
+} EventBackend;
+
+// The shell's single event loop: every shell-side descriptor of the running jobs is watched here from one thread
+typedef struct
+{
+    EventBackend backend; // Backend in use
+    bool preferEpoll;     // --event-loop=epoll: don't try io_uring
+    int fd;               // io_uring or epoll descriptor
+    Watch *watches;       // Watch id - 1 indexes this table, ids stay valid when it grows
+    int numWatches;       // Slots ever used
+    int capacity;         // Slots allocated
+
+    // io_uring rings shared with the kernel
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;          // Same mapping as sqRing with IORING_FEAT_SINGLE_MMAP
+    size_t cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray, sqEntries;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned toSubmit;     // Requests queued since the last io_uring_enter()
+} EventLoop;
+
+EventLoop events = {EVENTS_NONE, false, -1};
+
+// Maps the rings of a new io_uring, returns false (leaving nothing behind) if the kernel has none for us
+bool event_ring_setup(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(SYS_io_uring_setup, EVENT_RING_ENTRIES, &params);
+    if (fd < 0)
+        return false;
+
+    events.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    events.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (events.cqRingSize > events.sqRingSize)
+            events.sqRingSize = events.cqRingSize;
+        events.cqRingSize = 0;
+    }
+    events.sqRing = mmap(NULL, events.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    events.cqRing = events.cqRingSize == 0 ? events.sqRing
+                                           : mmap(NULL, events.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    events.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    events.sqes = mmap(NULL, events.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (events.sqRing == MAP_FAILED || events.cqRing == MAP_FAILED || events.sqes == MAP_FAILED)
+    {
+        if (events.sqRing != MAP_FAILED)
+            munmap(events.sqRing, events.sqRingSize);
+        if (events.cqRingSize != 0 && events.cqRing != MAP_FAILED)
+            munmap(events.cqRing, events.cqRingSize);
+        if (events.sqes != MAP_FAILED)
+            munmap(events.sqes, events.sqesSize);
+        close(fd);
+        return false;
+    }
+
+    char *sq = events.sqRing, *cq = events.cqRing;
+    events.sqHead = (unsigned *)(sq + params.sq_off.head);
+    events.sqTail = (unsigned *)(sq + params.sq_off.tail);
+    events.sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    events.sqArray = (unsigned *)(sq + params.sq_off.array);
+    events.sqEntries = params.sq_entries;
+    events.cqHead = (unsigned *)(cq + params.cq_off.head);
+    events.cqTail = (unsigned *)(cq + params.cq_off.tail);
+    events.cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    events.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    events.toSubmit = 0;
+    events.fd = fd;
+    return true;
+}
+
+// Sets the loop up on first use: io_uring if the kernel lets us, epoll otherwise
+void event_loop_init(void)
+{
+    if (events.backend != EVENTS_NONE)
+        return;
+    if (!events.preferEpoll && event_ring_setup())
+    {
+        events.backend = EVENTS_IO_URING;
+        return;
+    }
+    events.fd = epoll_create1(EPOLL_CLOEXEC);
+    if (events.fd < 0)
+    {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+    events.backend = EVENTS_EPOLL;
+}
+
+// Hands the queued requests to the kernel and waits for at least minComplete completions
+void event_ring_enter(unsigned minComplete)
+{
+    for (;;)
+    {
+        int done = syscall(SYS_io_uring_enter, events.fd, events.toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (done >= 0)
+        {
+            events.toSubmit -= done;
+            return;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            perror("io_uring_enter failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Next free submission entry, cleared, submitting what is queued if the ring is full
+struct io_uring_sqe *event_ring_sqe(void)
+{
+    if (*events.sqTail - __atomic_load_n(events.sqHead, __ATOMIC_ACQUIRE) >= events.sqEntries)
+        event_ring_enter(0);
+    unsigned tail = *events.sqTail;
+    unsigned index = tail & *events.sqMask;
+    struct io_uring_sqe *sqe = &events.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    events.sqArray[index] = index;
+    __atomic_store_n(events.sqTail, tail + 1, __ATOMIC_RELEASE);
+    events.toSubmit++;
+    return sqe;
+}
+
+// Asks the ring to tell us when the watch's descriptor becomes readable
+void event_arm(int id)
+{
+    Watch *watch = &events.watches[id - 1];
+    struct io_uring_sqe *sqe = event_ring_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = watch->fd;
+    sqe->poll32_events = watch->writable ? POLLOUT : POLLIN;
+    sqe->user_data = id;
+    watch->pending = true;
+}
+
+// Starts watching fd, ready(data) runs from event_loop_run() whenever it is readable, or writable
+// Returns the watch id (never 0); with ownsFd the descriptor is closed by event_unwatch()
+// epoll takes a descriptor once, so a second watch on one needs a dup of it
+int event_watch_for(int fd, bool writable, void (*ready)(void *data), void *data, bool ownsFd)
+{
+    event_loop_init();
+
+    int id = 0;
+    for (int i = 0; i < events.numWatches && id == 0; i++)
+    {
+        if (!events.watches[i].active && !events.watches[i].pending)
+            id = i + 1;
+    }
+    if (id == 0)
+    {
+        if (events.numWatches == events.capacity)
+        {
+            events.capacity = events.capacity ? 2 * events.capacity : 16;
+            events.watches = realloc(events.watches, events.capacity * sizeof(Watch));
+            if (!events.watches)
+            {
+                perror("Failed to allocate memory for the event loop");
+                exit(EXIT_FAILURE);
+            }
+        }
+        id = ++events.numWatches;
+    }
+
+    events.watches[id - 1] = (Watch){fd, ready, data, true, false, ownsFd, writable};
+    if (events.backend == EVENTS_IO_URING)
+    {
+        event_arm(id);
+    }
+    else
+    {
+        struct epoll_event event = {.events = writable ? EPOLLOUT : EPOLLIN, .data.u32 = id};
+        if (epoll_ctl(events.fd, EPOLL_CTL_ADD, fd, &event) < 0)
+            perror("epoll_ctl failed");
+    }
+    return id;
+}
+
+// Starts watching fd for data to read, see event_watch_for()
+int event_watch(int fd, void (*ready)(void *data), void *data, bool ownsFd)
+{
+    return event_watch_for(fd, false, ready, data, ownsFd);
+}
+
+// Stops watching, the id may be handed out again afterwards
+void event_unwatch(int id)
+{
+    Watch *watch = &events.watches[id - 1];
+    if (!watch->active)
+        return;
+    watch->active = false;
+    if (events.backend == EVENTS_IO_URING && watch->pending)
+    {
+        // The slot stays taken until the cancelled poll completes
+        struct io_uring_sqe *sqe = event_ring_sqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = id;
+        sqe->user_data = 0; // Nothing to do with its own completion
+    }
+    else if (events.backend == EVENTS_EPOLL)
+    {
+        epoll_ctl(events.fd, EPOLL_CTL_DEL, watch->fd, NULL);
+    }
+    if (watch->ownsFd)
+        close(watch->fd);
+}
+
+// Sleeps until at least one watched descriptor is readable and runs the ready handler of each one that is
+void event_loop_run(void)
+{
+    event_loop_init();
+
+    if (events.backend == EVENTS_EPOLL)
+    {
+        struct epoll_event ready[32];
+        int n = epoll_wait(events.fd, ready, 32, -1);
+        if (n < 0 && errno != EINTR)
+        {
+            perror("epoll_wait failed");
+            exit(EXIT_FAILURE);
+        }
+        for (int k = 0; k < n; k++)
+        {
+            // An earlier handler may have dropped this watch, the slot is then inactive or someone else's,
+            // and handlers only do non-blocking work, so a spurious call is harmless
+            Watch *watch = &events.watches[ready[k].data.u32 - 1];
+            if (watch->active)
+                watch->ready(watch->data);
+        }
+        return;
+    }
+
+    event_ring_enter(1);
+    unsigned head = *events.cqHead;
+    while (head != __atomic_load_n(events.cqTail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &events.cqes[head & *events.cqMask];
+        int id = cqe->user_data;
+        __atomic_store_n(events.cqHead, ++head, __ATOMIC_RELEASE);
+        if (id == 0)
+            continue; // A POLL_REMOVE finished
+
+        events.watches[id - 1].pending = false;
+        if (!events.watches[id - 1].active)
+            continue; // Cancelled, the slot is free now
+
+        // One-shot polls: ask again unless the handler dropped the watch (the table may move meanwhile)
+        events.watches[id - 1].ready(events.watches[id - 1].data);
+        if (events.watches[id - 1].active && !events.watches[id - 1].pending)
+            event_arm(id);
+    }
+}
+
+#define CAPTURE_CHUNK 4096 // Least room made in a capture buffer before each read, it grows by doubling
+
+// Output the shell reads itself, gathered into an arena string as it arrives
+typedef struct
+{
+    int fd;      // Read end of the pipe, non-blocking
+    int watch;   // Its event loop watch, 0 once every writer is gone
+    StrBuf text; // Everything read so far
+} Capture;
+
+// Reads what is available straight into the buffer, and stops watching at end of file
+void capture_ready(void *data)
+{
+    Capture *capture = data;
+    while (1)
+    {
+        char *room = strbuf_reserve(&capture->text, CAPTURE_CHUNK);
+        ssize_t bytes = read(capture->fd, room, capture->text.cap - capture->text.len - 1);
+        if (bytes > 0)
+        {
+            capture->text.len += bytes;
+            capture->text.data[capture->text.len] = '\0';
+            continue;
+        }
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes < 0 && errno == EAGAIN)
+            return;
+        if (bytes < 0)
+            perror("Failed to read captured output");
+        event_unwatch(capture->watch); // Also closes the pipe
+        capture->watch = 0;
+        return;
+    }
+}
+
+// Starts collecting everything written to the pipe read end fd into an arena string
+void capture_start(Capture *capture, int fd, Arena *arena)
+{
+    capture->fd = fd;
+    capture->text = (StrBuf){arena, NULL, 0, 0};
+    strbuf_append(&capture->text, "", 0); // Empty output is still a string
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    capture->watch = event_watch(fd, capture_ready, capture, true);
+}
+
+// Tears the loop down, closing the descriptors it owns; a later watch sets up a new one
+// Forked children call it first thing, or they would share the parent's ring or epoll set
+void event_loop_close(void)
+{
+    if (events.backend == EVENTS_NONE)
+        return;
+    for (int i = 0; i < events.numWatches; i++)
+    {
+        if (events.watches[i].active && events.watches[i].ownsFd)
+            close(events.watches[i].fd);
+    }
+    if (events.backend == EVENTS_IO_URING)
+    {
+        munmap(events.sqes, events.sqesSize);
+        if (events.cqRingSize != 0)
+            munmap(events.cqRing, events.cqRingSize);
+        munmap(events.sqRing, events.sqRingSize);
+    }
+    close(events.fd);
+    free(events.watches);
+    bool preferEpoll = events.preferEpoll;
+    memset(&events, 0, sizeof(events));
+    events.preferEpoll = preferEpoll;
+    events.fd = -1;
+}
+
+/* JOB CONTROL */
+
+#define JOB_ARENA_BLOCK 1024 // Block size of each job's arena, enough for a typical pipeline
+
+// Where a job is in its life
+typedef enum
+{
+    JOB_RUNNING, // At least one process still runs
+    JOB_STOPPED, // Every live process is stopped
+    JOB_DONE     // Every process has been reaped
+} JobState;
+
+// A pipeline the shell launched, in the foreground or with &
+// Everything it owns lives in its own arena, so it can outlive the line it came from
+typedef struct Job
+{
+    int id;                 // Job number shown by jobs and used as %N, 0 while it runs in the foreground
+    pid_t pgid;             // Process group of the pipeline, 0 without job control
+    JobState state;         // Current state, recomputed after every reap
+    bool background;        // Runs without the terminal (started with & or resumed with bg)
+    bool timed;             // Pipeline was prefixed with `time`
+    bool notified;          // The user has been told about its current state
+    StageStats *stages;     // One entry per process: the stages and fan-out movers
+    int numStages;          // Number of entries in stages
+    int lastStage;          // Stage whose status becomes the job's
+    int status;             // Exit status, once done
+    struct timespec start;  // When the pipeline was launched
+    struct timespec end;    // When its last process was reaped
+    char *text;             // Command line shown by jobs, set once it leaves the foreground
+    char *cgroup;           // cgroup v2 group of the pipeline (stage cgroup), removed with the job
+    char **dropFiles;       // Files redirected with the dontneed hint, dropped from the page cache with the job
+    int numDropFiles;       // Number of entries in dropFiles
+    Arena arena;            // Owns stages, text and the copied argv vectors
+    struct Job *next;       // Next job of the table (or of the free list)
+} Job;
+
+Job *jobs = NULL;        // Every job not yet reaped and reported, newest first
+Job *freeJobs = NULL;    // Finished jobs kept for reuse along with their arenas
+int sigchldFd = -1;      // signalfd receiving SIGCHLD, which stays blocked in the shell
+bool jobControl = false; // Interactive shell: one process group per pipeline and terminal handoff
+pid_t shellPgid = 0;     // Process group the shell gives the terminal back to
+int zygoteFd = -1;       // Socket to the zygote spawner (--spawn=zygote), -1 when not in use
+pid_t zygotePid = -1;    // The zygote, a child of the shell that never belongs to a job
+int zygoteWatch = 0;     // Event loop watch on zygoteFd
+int sigchldWatch = 0;    // Event loop watch on sigchldFd, 0 until the supervisor starts
+
+// What the zygote sends back: the pid of a process it started, or a wait4() report about one
+typedef struct
+{
+    bool spawned;        // Reply to a spawn request, status is then the errno of a failed fork (0 on success)
+    pid_t pid;           // Process the message is about
+    int status;          // Raw wait status
+    struct rusage usage; // Resources used, from the zygote's wait4()
+} ZygoteEvent;
+
+// Signals the interactive shell ignores, which every child gets back at their default
+const int jobSignals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU};
+
+// Keeps SIGCHLD pending for sigchldFd instead of delivering it
+void block_sigchld(void)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+}
+
+// Blocks SIGCHLD and routes it to sigchldFd, and takes over the terminal when job control is on
+void job_control_init(bool interactive)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    block_sigchld();
+    sigchldFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigchldFd < 0)
+    {
+        perror("signalfd failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!interactive)
+        return;
+
+    // Wait until we are in the foreground, then move into a process group of our own
+    while (tcgetpgrp(STDIN_FILENO) != getpgrp())
+        kill(-getpgrp(), SIGTTIN);
+    for (size_t s = 0; s < sizeof(jobSignals) / sizeof(jobSignals[0]); s++)
+        signal(jobSignals[s], SIG_IGN);
+    shellPgid = getpid();
+    if (getpgrp() != shellPgid && setpgid(0, shellPgid) < 0)
+    {
+        perror("Couldn't put the shell in its own process group");
+        return;
+    }
+    tcsetpgrp(STDIN_FILENO, shellPgid);
+    jobControl = true;
+}
+
+// Sets up a forked child of the job before it runs: process group, terminal, signals and mask
+// Only async-signal-safe calls, vfork children come through here too
+void job_child_setup(pid_t pgid, bool foreground)
+{
+    if (jobControl)
+    {
+        setpgid(0, pgid);
+        if (foreground)
+            tcsetpgrp(STDIN_FILENO, pgid ? pgid : getpid());
+        for (size_t s = 0; s < sizeof(jobSignals) / sizeof(jobSignals[0]); s++)
+            signal(jobSignals[s], SIG_DFL);
+    }
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+// Puts a process that just started in the job's process group from the parent side as well,
+// so the group exists whichever process runs first; the first one founds it
+void job_adopt(Job *job, pid_t pid)
+{
+    if (!jobControl || pid <= 0)
+        return;
+    if (job->pgid == 0)
+    {
+        job->pgid = pid;
+        if (!job->background)
+            tcsetpgrp(STDIN_FILENO, pid);
+    }
+    setpgid(pid, job->pgid);
+}
+
+void remote_stage_done(pid_t pid); // With the remote stages
+void remote_forget(void);
+
+// Turns a forked child into a subshell: it forgets the parent's jobs, stays in its process group
+// and reaps its own children through the inherited sigchldFd, which reports the reader's signals
+void job_enter_subshell(void)
+{
+    jobControl = false;
+    jobs = NULL;
+    freeJobs = NULL;
+    remote_forget();
+    block_sigchld();
+}
+
+// Takes a job from the free list (or the heap), links it into the table and sizes its stage array
+Job *job_new(int numCommands)
+{
+    Job *job = freeJobs;
+    if (job != NULL)
+    {
+        freeJobs = job->next;
+    }
+    else
+    {
+        job = calloc(1, sizeof(Job));
+        if (!job)
+        {
+            perror("Failed to allocate memory for a job");
+            exit(EXIT_FAILURE);
+        }
+        job->arena.blockSize = JOB_ARENA_BLOCK;
+    }
+
+    Arena arena = job->arena;
+    memset(job, 0, sizeof(*job));
+    job->arena = arena;
+    job->stages = arena_alloc(&job->arena, 2 * numCommands * sizeof(StageStats));
+    job->lastStage = -1;
+    job->start = now_monotonic();
+    job->next = jobs;
+    jobs = job;
+    return job;
+}
+
+void redirect_drop_cache(const char *path); // With the redirections
+
+// Unlinks a job from the table and keeps it for reuse
+void job_free(Job *job)
+{
+    for (Job **link = &jobs; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == job)
+        {
+            *link = job->next;
+            break;
+        }
+    }
+    if (job->cgroup != NULL)
+        rmdir(job->cgroup); // Empty by now, all its processes have been reaped
+    for (int f = 0; f < job->numDropFiles; f++)
+        redirect_drop_cache(job->dropFiles[f]);
+    arena_reset(&job->arena);
+    job->next = freeJobs;
+    freeJobs = job;
+}
+
+// Keeps a copy of path in the job, to drop it from the page cache once the job is done
+void job_drop_add(Job *job, const char *path)
+{
+    job->dropFiles = arena_grow(&job->arena, job->dropFiles, job->numDropFiles * sizeof(char *), (job->numDropFiles + 1) * sizeof(char *));
+    job->dropFiles[job->numDropFiles++] = arena_strndup(&job->arena, path, strlen(path));
+}
+
+// Copies the job's argv vectors out of the line's memory and builds the text jobs shows
+void job_copy_args(Job *job)
+{
+    if (job->text != NULL)
+        return;
+
+    StrBuf text = {&job->arena, NULL, 0, 0};
+    for (int s = 0; s < job->numStages; s++)
+    {
+        char **args = job->stages[s].args;
+        if (args == NULL)
+            continue; // Fan-out mover
+
+        int argc = 0;
+        while (args[argc] != NULL)
+            argc++;
+        char **copy = arena_alloc(&job->arena, (argc + 1) * sizeof(char *));
+        for (int a = 0; a < argc; a++)
+        {
+            copy[a] = arena_strndup(&job->arena, args[a], strlen(args[a]));
+            if (text.len > 0 || a > 0)
+                strbuf_append(&text, a ? " " : " | ", a ? 1 : 3);
+            strbuf_append(&text, args[a], strlen(args[a]));
+        }
+        copy[argc] = NULL;
+        job->stages[s].args = copy;
+    }
+    job->text = text.data ? text.data : "";
+}
+
+// Gives a job that leaves the foreground a number, and makes it independent of the line it came from
+void job_detach(Job *job)
+{
+    if (job->id != 0)
+        return;
+
+    job->id = 1;
+    for (Job *other = jobs; other != NULL; other = other->next)
+    {
+        if (other != job && other->id >= job->id)
+            job->id = other->id + 1;
+    }
+    job_copy_args(job);
+}
+
+// Recomputes the job's state from its processes, reporting the pipeline when the last one is gone
+void job_update(Job *job)
+{
+    int live = 0, stopped = 0;
+    for (int s = 0; s < job->numStages; s++)
+    {
+        if (job->stages[s].pid > 0 && !job->stages[s].done)
+        {
+            live++;
+            stopped += job->stages[s].stopped;
+        }
+    }
+
+    JobState state = live == 0 ? JOB_DONE : stopped == live ? JOB_STOPPED : JOB_RUNNING;
+    if (state == job->state)
+        return;
+    job->state = state;
+    job->notified = false;
+
+    if (state == JOB_DONE)
+    {
+        // A last stage that never started makes the job fail like a missing command
+        StageStats *last = job->lastStage >= 0 ? &job->stages[job->lastStage] : NULL;
+        job->status = last != NULL && last->pid > 0 ? exit_code(last->status) : 127;
+        job->end = now_monotonic();
+        report_pipeline(job->stages, job->numStages, job->status, job->timed, job->start, job->end, &job->arena);
+    }
+}
+
+// Records a wait status of one stage: stopped, continued or finished
+void stage_record(StageStats *stage, int status, const struct rusage *usage)
+{
+    if (WIFSTOPPED(status))
+        stage->stopped = true;
+    else if (WIFCONTINUED(status))
+        stage->stopped = false;
+    else
+    {
+        TRACE_MARK("exit", stage->pid);
+        remote_stage_done(stage->pid);
+        stage->status = status;
+        stage->usage = *usage;
+        stage->end = now_monotonic();
+        stage->done = true;
+        stage->stopped = false;
+        if (stage->watch != 0)
+        {
+            event_unwatch(stage->watch); // Also closes the pidfd
+            stage->watch = 0;
+        }
+    }
+}
+
+// Applies a wait4() report from the zygote to the stage of whichever job owns the process
+void zygote_event_apply(const ZygoteEvent *event)
+{
+    for (Job *job = jobs; job != NULL; job = job->next)
+    {
+        for (int s = 0; s < job->numStages; s++)
+        {
+            StageStats *stage = &job->stages[s];
+            if (stage->zygote && stage->pid == event->pid && !stage->done)
+            {
+                stage_record(stage, event->status, &event->usage);
+                job_update(job);
+                return;
+            }
+        }
+    }
+}
+
+// The zygote hung up: the processes it started die with it (PR_SET_PDEATHSIG), so their stages count as killed
+// and later launches happen in the shell again
+void zygote_lost(void)
+{
+    fprintf(stderr, "The zygote exited, spawning from the shell from now on\n");
+    if (zygoteWatch != 0)
+        event_unwatch(zygoteWatch);
+    zygoteWatch = 0;
+    close(zygoteFd);
+    zygoteFd = -1;
+    if (zygotePid > 0)
+    {
+        // It may only have failed us, make sure it is gone so its processes go too
+        kill(zygotePid, SIGKILL);
+        waitpid(zygotePid, NULL, 0);
+        zygotePid = -1;
+    }
+
+    struct rusage none;
+    memset(&none, 0, sizeof(none));
+    for (Job *job = jobs; job != NULL; job = job->next)
+    {
+        bool changed = false;
+        for (int s = 0; s < job->numStages; s++)
+        {
+            StageStats *stage = &job->stages[s];
+            if (stage->zygote && !stage->done)
+            {
+                stage_record(stage, SIGKILL, &none);
+                changed = true;
+            }
+        }
+        if (changed)
+            job_update(job);
+    }
+}
+
+// Collects the state changes of the job's own children, returns whether there were any
+bool job_reap(Job *job)
+{
+    bool changed = false;
+    for (int s = 0; s < job->numStages; s++)
+    {
+        StageStats *stage = &job->stages[s];
+        if (stage->pid <= 0 || stage->done)
+            continue;
+        if (stage->zygote)
+            continue; // Not our child, the zygote reaps it
+
+        int status;
+        struct rusage usage;
+        pid_t pid;
+        while ((pid = wait4(stage->pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) < 0 && errno == EINTR)
+            ;
+        if (pid <= 0)
+            continue;
+
+        changed = true;
+        stage_record(stage, status, &usage);
+    }
+    return changed;
+}
+
+// Drains sigchldFd and collects every state change of the processes the jobs own
+// Never blocks, and waits on known pids only, one signal may stand for many children
+// Processes the zygote started are not ours to wait for, their reports come over zygoteFd instead
+void reap_children(void)
+{
+    struct signalfd_siginfo info;
+    while (read(sigchldFd, &info, sizeof(info)) > 0)
+        ;
+
+    for (Job *job = jobs; job != NULL; job = job->next)
+    {
+        if (job->state != JOB_DONE && job_reap(job))
+            job_update(job);
+    }
+
+    ZygoteEvent event;
+    ssize_t bytes = -1;
+    while (zygoteFd >= 0 && (bytes = recv(zygoteFd, &event, sizeof(event), MSG_DONTWAIT)) == sizeof(event))
+        zygote_event_apply(&event);
+    if (zygoteFd >= 0 && bytes == 0)
+        zygote_lost();
+}
+
+// Event loop handler of sigchldFd and zygoteFd
+void children_ready(void *data)
+{
+    (void)data;
+    reap_children();
+}
+
+// A pidfd of the job became readable: one of its processes exited, collect it without scanning every job
+void job_stage_ready(void *data)
+{
+    Job *job = data;
+    if (job->state != JOB_DONE && job_reap(job))
+        job_update(job);
+}
+
+// Starts the event loop that supervises the jobs, which always watches for SIGCHLD and the zygote's reports
+// Stops and continues only show up as SIGCHLD, exits also on the pidfd of each child the shell started
+void supervisor_start(void)
+{
+    if (sigchldWatch != 0)
+        return;
+    sigchldWatch = event_watch(sigchldFd, children_ready, NULL, false);
+    if (zygoteFd >= 0)
+        zygoteWatch = event_watch(zygoteFd, children_ready, NULL, false);
+}
+
+// Lets the event loop see the exit of a stage the shell started itself, through a pidfd
+void job_watch_stage(Job *job, StageStats *stage)
+{
+    if (stage->pid <= 0 || stage->zygote)
+        return;
+    int pidfd = syscall(SYS_pidfd_open, stage->pid, 0);
+    if (pidfd < 0)
+        return; // Old kernel, SIGCHLD alone still covers it
+    supervisor_start();
+    stage->watch = event_watch(pidfd, job_stage_ready, job, true);
+}
+
+// Runs the event loop once: sleeps until a child may have changed state and collects what changed
+void wait_for_children(void)
+{
+    supervisor_start();
+    event_loop_run();
+}
+
+// Blocks until the job is no longer running, reaping whatever else finishes meanwhile
+void job_wait(Job *job)
+{
+    TRACE_BEGIN("wait", job->numStages);
+    reap_children();
+    while (job->state == JOB_RUNNING)
+        wait_for_children();
+    TRACE_END("wait", job->status);
+}
+
+// Waits for a job that owns the terminal, then takes the terminal back
+// A job stopped from the keyboard joins the table, a finished one is released; returns its status
+int job_wait_foreground(Job *job)
+{
+    job_wait(job);
+    if (jobControl)
+        tcsetpgrp(STDIN_FILENO, shellPgid);
+
+    if (job->state == JOB_STOPPED)
+    {
+        job_detach(job);
+        job->background = true;
+        job->notified = true;
+        fprintf(stderr, "\n[%d]+  Stopped                 %s\n", job->id, job->text);
+        return 128 + SIGTSTP;
+    }
+
+    // Like other shells, move past the ^C the terminal echoed
+    if (jobControl && job->status == 128 + SIGINT)
+        fputc('\n', stderr);
+
+    int status = job->status;
+    job_free(job);
+    return status;
+}
+
+// Sends sig to every process of the job, through its process group when it has one
+void job_signal(Job *job, int sig)
+{
+    if (job->pgid > 0)
+    {
+        kill(-job->pgid, sig);
+        return;
+    }
+    for (int s = 0; s < job->numStages; s++)
+    {
+        if (job->stages[s].pid > 0 && !job->stages[s].done)
+            kill(job->stages[s].pid, sig);
+    }
+}
+
+// Finds the job named by a %N, %%, %+ or pid argument (NULL arg: the most recent job)
+Job *job_find(const char *arg)
+{
+    if (arg == NULL || strcmp(arg, "%%") == 0 || strcmp(arg, "%+") == 0)
+    {
+        for (Job *job = jobs; job != NULL; job = job->next)
+        {
+            if (job->id != 0)
+                return job;
+        }
+        return NULL;
+    }
+
+    char *end;
+    long number = strtol(arg + (arg[0] == '%'), &end, 10);
+    if (*end != '\0' || end == arg + (arg[0] == '%'))
+        return NULL;
+    for (Job *job = jobs; job != NULL; job = job->next)
+    {
+        if (job->id == 0)
+            continue;
+        if (arg[0] == '%' && job->id == number)
+            return job;
+        for (int s = 0; arg[0] != '%' && s < job->numStages; s++)
+        {
+            if (job->stages[s].pid == number)
+                return job;
+        }
+    }
+    return NULL;
+}
+
+// Prints the line jobs and the notices use for a job
+void job_print(FILE *out, Job *job)
+{
+    StageStats *last = job->lastStage >= 0 ? &job->stages[job->lastStage] : NULL;
+    char state[32];
+    if (job->state == JOB_RUNNING)
+        snprintf(state, sizeof(state), "Running");
+    else if (job->state == JOB_STOPPED)
+        snprintf(state, sizeof(state), "Stopped");
+    else if (last != NULL && last->pid > 0 && WIFSIGNALED(last->status))
+        snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(last->status)));
+    else if (job->status != 0)
+        snprintf(state, sizeof(state), "Exit %d", job->status);
+    else
+        snprintf(state, sizeof(state), "Done");
+    fprintf(out, "[%d]%c  %-22s  %s%s\n", job->id, job == job_find(NULL) ? '+' : ' ', state, job->text,
+            job->state == JOB_RUNNING ? " &" : "");
+}
+
+// Collects what changed since the last line and tells the user about background jobs (interactive only)
+// Jobs that are done are released here, after being reported
+void job_notify(bool interactive)
+{
+    reap_children();
+    Job *job = jobs;
+    while (job != NULL)
+    {
+        Job *next = job->next;
+        if (job->id != 0 && !job->notified)
+        {
+            if (interactive)
+                job_print(stderr, job);
+            job->notified = true;
+        }
+        if (job->id != 0 && job->state == JOB_DONE)
+            job_free(job);
+        job = next;
+    }
+}
+
+// Moves the job to the front of the table, making it the current job (%+)
+void job_make_current(Job *job)
+{
+    for (Job **link = &jobs; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == job)
+        {
+            *link = job->next;
+            break;
+        }
+    }
+    job->next = jobs;
+    jobs = job;
+}
+
+// Wakes up a stopped job, in the foreground or the background
+void job_continue(Job *job, bool foreground)
+{
+    job_make_current(job);
+    job->background = !foreground;
+    if (foreground && jobControl)
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    for (int s = 0; s < job->numStages; s++)
+        job->stages[s].stopped = false;
+    job->state = JOB_RUNNING;
+    job->notified = true;
+    job_signal(job, SIGCONT);
+}
+
+// Gives every job back to the heap at exit, background processes keep running without us
+void job_table_free(void)
+{
+    while (jobs != NULL)
+        job_free(jobs);
+    while (freeJobs != NULL)
+    {
+        Job *next = freeJobs->next;
+        arena_free(&freeJobs->arena);
+        free(freeJobs);
+        freeJobs = next;
+    }
+}
+
+// jobs: lists the jobs that are running, stopped or done but not yet reported
+int builtin_jobs(char **args)
+{
+    (void)args;
+    reap_children();
+    for (Job *job = jobs; job != NULL; job = job->next)
+    {
+        if (job->id == 0)
+            continue;
+        job_print(stdout, job);
+        job->notified = true;
+    }
+    return 0;
+}
+
+// fg [job]: brings a job to the foreground and waits for it
+int builtin_fg(char **args)
+{
+    Job *job = job_find(args[1]);
+    if (job == NULL)
+    {
+        fprintf(stderr, "fg: %s: no such job\n", args[1] ? args[1] : "current");
+        return 1;
+    }
+    printf("%s\n", job->text);
+    fflush(stdout);
+    if (job->state != JOB_DONE)
+        job_continue(job, true);
+
+    return job_wait_foreground(job);
+}
+
+// bg [job]: resumes a stopped job in the background
+int builtin_bg(char **args)
+{
+    Job *job = job_find(args[1]);
+    if (job == NULL)
+    {
+        fprintf(stderr, "bg: %s: no such job\n", args[1] ? args[1] : "current");
+        return 1;
+    }
+    if (job->state == JOB_STOPPED)
+        job_continue(job, false);
+    printf("[%d]+ %s &\n", job->id, job->text);
+    return 0;
+}
+
+// wait [job...]: waits for the given jobs (or every background job) and returns the last one's status
+int builtin_wait(char **args)
+{
+    int status = 0;
+    if (args[1] == NULL)
+    {
+        // Every job that is still running, then forget the finished ones without a notice
+        Job *job;
+        do
+        {
+            for (job = jobs; job != NULL && !(job->id != 0 && job->state == JOB_RUNNING); job = job->next)
+                ;
+            if (job != NULL)
+                job_wait(job);
+        } while (job != NULL);
+
+        for (job = jobs; job != NULL;)
+        {
+            Job *next = job->next;
+            if (job->id != 0 && job->state == JOB_DONE)
+                job_free(job);
+            job = next;
+        }
+        return 0;
+    }
+
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        Job *job = job_find(args[i]);
+        if (job == NULL)
+        {
+            fprintf(stderr, "wait: %s: no such job\n", args[i]);
+            status = 127;
+            continue;
+        }
+        job_wait(job);
+        if (job->state == JOB_DONE)
+        {
+            status = job->status;
+            job_free(job);
+        }
+        else
+        {
+            status = 128 + SIGTSTP;
+        }
+    }
+    return status;
+}
+
+/* PIPE CONFIGURATION */
+
+size_t *pipeSizes = NULL; // Requested buffer size of each pipe of a pipeline, the last one repeats (0 = kernel default)
+int numPipeSizes = 0;     // Number of entries in pipeSizes
+
+// Parses a byte count with an optional K/M/G suffix, returns false if it isn't one
+bool parse_size(const char *text, size_t *size)
+{
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text || errno != 0)
+        return false;
+
+    int shift = 0;
+    if (*end == 'K' || *end == 'k')
+        shift = 10;
+    else if (*end == 'M' || *end == 'm')
+        shift = 20;
+    else if (*end == 'G' || *end == 'g')
+        shift = 30;
+    if (shift != 0)
+    {
+        if (value > ULLONG_MAX >> shift)
+            return false;
+        value <<= shift;
+        end++;
+    }
+
+    *size = value;
+    return *end == '\0';
+}
+
+// Sets the pipe sizes from a comma-separated list ("1M" or "1M,64K,..."), "default" clears them
+// An invalid list leaves the current sizes as they are
+bool configure_pipe_sizes(const char *spec)
+{
+    if (strcmp(spec, "default") == 0)
+    {
+        free(pipeSizes);
+        pipeSizes = NULL;
+        numPipeSizes = 0;
+        return true;
+    }
+
+    char *copy = strdup(spec);
+    size_t *sizes = malloc((strlen(spec) / 2 + 1) * sizeof(size_t)); // Every item takes a digit and a comma
+    if (!copy || !sizes)
+    {
+        perror("Failed to allocate memory for the pipe sizes");
+        exit(EXIT_FAILURE);
+    }
+    int count = 0;
+    char *rest;
+    for (char *item = strtok_r(copy, ",", &rest); item != NULL; item = strtok_r(NULL, ",", &rest))
+    {
+        // F_SETPIPE_SZ takes an int
+        if (!parse_size(item, &sizes[count]) || sizes[count] > INT_MAX)
+        {
+            free(copy);
+            free(sizes);
+            return false;
+        }
+        count++;
+    }
+    free(copy);
+    if (count == 0)
+    {
+        free(sizes);
+        return false;
+    }
+
+    free(pipeSizes);
+    pipeSizes = sizes;
+    numPipeSizes = count;
+    return true;
+}
+
+// Applies the configured buffer size to the pipe between stages index and index + 1
+void set_pipe_size(int fd, int index)
+{
+    static bool warned = false; // Only complain once about sizes the kernel refuses
+    if (numPipeSizes == 0)
+        return;
+
+    size_t size = pipeSizes[index < numPipeSizes ? index : numPipeSizes - 1];
+    if (size != 0 && fcntl(fd, F_SETPIPE_SZ, (int)size) < 0 && !warned)
+    {
+        // Unprivileged users are capped by /proc/sys/fs/pipe-max-size
+        fprintf(stderr, "Warning: couldn't set pipe size to %zu bytes: %s\n", size, strerror(errno));
+        warned = true;
+    }
+}
+
+// Moves a new fd out of 0-2, so a pipe end never sits on the stdio fd it gets dup2'ed to
+// (dup2 onto itself would keep O_CLOEXEC set); only happens if the shell runs with stdio closed
+int keep_above_stdio(int fd)
+{
+    if (fd > STDERR_FILENO)
+        return fd;
+
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+    close(fd);
+    return moved;
+}
+
+// pipesize [SIZE[,SIZE...] | default]: shows or sets the buffer size of each pipe of later pipelines
+int builtin_pipesize(char **args)
+{
+    if (args[1] == NULL)
+    {
+        if (numPipeSizes == 0)
+            printf("default\n");
+        for (int i = 0; i < numPipeSizes; i++)
+            printf("%zu%s", pipeSizes[i], i + 1 < numPipeSizes ? "," : "\n");
+        return 0;
+    }
+
+    if (!configure_pipe_sizes(args[1]))
+    {
+        fprintf(stderr, "pipesize: invalid size list: %s\n", args[1]);
+        return 1;
+    }
+    return 0;
+}
+
+/* STAGE PLACEMENT AND LIMITS */
+
+#define STAGE_UNSET INT_MIN // Per-stage value that leaves the stage as it would have been
+
+// An rlimit set on every process of later pipelines
+typedef struct
+{
+    int resource; // RLIMIT_*
+    rlim_t value; // Soft and hard limit
+} StageLimit;
+
+// Names `stage limit` accepts, as in ulimit
+const struct
+{
+    const char *name;
+    int resource;
+} limitNames[] = {
+    {"as", RLIMIT_AS},         {"core", RLIMIT_CORE},   {"cpu", RLIMIT_CPU},         {"data", RLIMIT_DATA},
+    {"fsize", RLIMIT_FSIZE},   {"memlock", RLIMIT_MEMLOCK}, {"nofile", RLIMIT_NOFILE}, {"nproc", RLIMIT_NPROC},
+    {"rss", RLIMIT_RSS},       {"stack", RLIMIT_STACK},
+};
+
+// Where the stages of later pipelines run and what they may use, set with the stage builtin
+// Per-stage lists repeat their last entry, like the pipe sizes
+typedef struct
+{
+    cpu_set_t *cpus;     // CPUs each stage is pinned to, an empty set leaves the stage unpinned
+    int numCpus;         // Number of entries in cpus
+    int *nodes;          // NUMA node each stage runs on and takes its memory from, STAGE_UNSET for none
+    cpu_set_t *nodeCpus; // CPUs of each of those nodes, read from sysfs when they are set
+    int numNodes;        // Number of entries in nodes and nodeCpus
+    int *nices;          // Nice level of each stage, STAGE_UNSET to inherit the shell's
+    int numNices;        // Number of entries in nices
+    int *ioprios;        // I/O priority of each stage (IOPRIO_PRIO_VALUE), STAGE_UNSET to inherit
+    int numIoprios;      // Number of entries in ioprios
+    bool colocate;       // Stages without a CPU of their own go on neighbouring CPUs, SMT siblings first
+    int *order;          // CPUs the shell may use, sorted so that siblings are next to each other
+    int numOrder;        // Number of entries in order, 0 until colocation first needs it
+    StageLimit *limits;  // rlimits of every process of a pipeline
+    int numLimits;       // Number of entries in limits
+    char **cgroupFiles;  // file=value settings of the cgroup v2 group each pipeline gets, NULL-free
+    int numCgroupFiles;  // Number of entries in cgroupFiles
+    char *cgroupParent;  // Directory the per-pipeline groups are created in
+    unsigned cgroupSerial; // Numbers the groups created so far
+} StagePlacement;
+
+StagePlacement placement = {0};
+
+// What one stage applies to itself between fork/vfork and execve(), computed by the shell beforehand
+typedef struct
+{
+    bool pin;         // Set the affinity to cpus
+    cpu_set_t cpus;   // CPUs the stage may run on
+    int node;         // Preferred NUMA node of its memory, STAGE_UNSET for none
+    int nice;         // Nice level, STAGE_UNSET for none
+    int ioprio;       // I/O priority, STAGE_UNSET for none
+    int cgroupProcs;  // cgroup.procs of the pipeline's group, -1 for none
+} StageSetup;
+
+// Entry of a per-stage list for stage i, the last one repeating
+int stage_pick(int count, int i)
+{
+    return i < count ? i : count - 1;
+}
+
+// Parses a CPU list like the kernel prints them ("0-3,8,10-11"), returns false if it isn't one
+bool parse_cpu_list(const char *text, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *c = text;
+    while (*c != '\0' && *c != '\n')
+    {
+        char *end;
+        long first = strtol(c, &end, 10), last = first;
+        if (end == c || first < 0)
+            return false;
+        if (*end == '-')
+        {
+            c = end + 1;
+            last = strtol(c, &end, 10);
+            if (end == c || last < first)
+                return false;
+        }
+        if (last >= CPU_SETSIZE)
+            return false;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        c = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0' && *end != '\n')
+            return false;
+    }
+    return true;
+}
+
+// Reads a small sysfs file into buffer, returns false if it can't be read
+bool read_sysfs(const char *path, char *buffer, size_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    ssize_t bytes = read(fd, buffer, size - 1);
+    close(fd);
+    if (bytes < 0)
+        return false;
+    buffer[bytes] = '\0';
+    return true;
+}
+
+// Sysfs topology value of a CPU (core_id, physical_package_id), -1 when unknown
+int cpu_topology(int cpu, const char *name)
+{
+    char path[96], value[32];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    return read_sysfs(path, value, sizeof(value)) ? atoi(value) : -1;
+}
+
+// Sort key of a CPU for colocation: package, then core, then the CPU number
+typedef struct
+{
+    int package;
+    int core;
+    int cpu;
+} CpuPlace;
+
+int cpu_place_compare(const void *a, const void *b)
+{
+    const CpuPlace *x = a, *y = b;
+    if (x->package != y->package)
+        return x->package < y->package ? -1 : 1;
+    if (x->core != y->core)
+        return x->core < y->core ? -1 : 1;
+    return x->cpu - y->cpu;
+}
+
+// Orders the CPUs the shell may run on so that the SMT siblings of a core, then the cores of a package, are adjacent
+void colocate_order_init(void)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return;
+    CpuPlace *places = malloc(CPU_COUNT(&allowed) * sizeof(CpuPlace));
+    placement.order = malloc(CPU_COUNT(&allowed) * sizeof(int));
+    if (!places || !placement.order)
+    {
+        perror("Failed to allocate memory for the CPU order");
+        exit(EXIT_FAILURE);
+    }
+    int count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+            places[count++] = (CpuPlace){cpu_topology(cpu, "physical_package_id"), cpu_topology(cpu, "core_id"), cpu};
+    }
+    qsort(places, count, sizeof(CpuPlace), cpu_place_compare);
+    for (int k = 0; k < count; k++)
+        placement.order[k] = places[k].cpu;
+    placement.numOrder = count;
+    free(places);
+}
+
+// Position in the colocation order the stages of a new pipeline start from: the CPU the shell runs on
+int colocate_base(void)
+{
+    if (!placement.colocate)
+        return 0;
+    if (placement.numOrder == 0)
+        colocate_order_init();
+    int cpu = sched_getcpu();
+    for (int k = 0; k < placement.numOrder; k++)
+    {
+        if (placement.order[k] == cpu)
+            return k;
+    }
+    return 0;
+}
+
+// Whether stages need a setup of their own before execve(), which only the fork and vfork paths provide
+bool stage_placement_active(void)
+{
+    return placement.numCpus > 0 || placement.numNodes > 0 || placement.numNices > 0 || placement.numIoprios > 0 ||
+           placement.colocate || placement.numLimits > 0 || placement.numCgroupFiles > 0;
+}
+
+// Fills in what stage i of a pipeline applies to itself
+void stage_setup_prepare(StageSetup *setup, int i, int base, int cgroupProcs)
+{
+    setup->pin = false;
+    setup->node = STAGE_UNSET;
+    if (placement.numCpus > 0)
+    {
+        setup->cpus = placement.cpus[stage_pick(placement.numCpus, i)];
+        setup->pin = CPU_COUNT(&setup->cpus) > 0;
+    }
+    if (!setup->pin && placement.numNodes > 0)
+    {
+        int k = stage_pick(placement.numNodes, i);
+        setup->node = placement.nodes[k];
+        setup->cpus = placement.nodeCpus[k];
+        setup->pin = setup->node != STAGE_UNSET;
+    }
+    if (!setup->pin && placement.colocate && placement.numOrder > 0)
+    {
+        // Stage i next to stage i - 1, so the pipe between them stays in a cache they share
+        CPU_ZERO(&setup->cpus);
+        CPU_SET(placement.order[(base + i) % placement.numOrder], &setup->cpus);
+        setup->pin = true;
+    }
+    setup->nice = placement.numNices > 0 ? placement.nices[stage_pick(placement.numNices, i)] : STAGE_UNSET;
+    setup->ioprio = placement.numIoprios > 0 ? placement.ioprios[stage_pick(placement.numIoprios, i)] : STAGE_UNSET;
+    setup->cgroupProcs = cgroupProcs;
+}
+
+// Applies a stage setup to the calling process, only system calls so that a vfork child may run it
+// Returns NULL, or the step that failed with errno set
+const char *stage_setup_apply(const StageSetup *setup)
+{
+    // The group first, so its limits cover everything the stage allocates
+    if (setup->cgroupProcs >= 0 && write(setup->cgroupProcs, "0", 1) < 0)
+        return "cgroup.procs";
+    if (setup->pin && sched_setaffinity(0, sizeof(setup->cpus), &setup->cpus) < 0)
+        return "sched_setaffinity";
+    if (setup->node != STAGE_UNSET)
+    {
+        unsigned long mask[CPU_SETSIZE / (8 * sizeof(unsigned long))] = {0};
+        mask[setup->node / (8 * sizeof(unsigned long))] |= 1UL << setup->node % (8 * sizeof(unsigned long));
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, (unsigned long)CPU_SETSIZE) < 0)
+            return "set_mempolicy";
+    }
+    if (setup->nice != STAGE_UNSET && setpriority(PRIO_PROCESS, 0, setup->nice) < 0)
+        return "setpriority";
+    if (setup->ioprio != STAGE_UNSET && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, setup->ioprio) < 0)
+        return "ioprio_set";
+    for (int l = 0; l < placement.numLimits; l++)
+    {
+        struct rlimit limit = {placement.limits[l].value, placement.limits[l].value};
+        if (setrlimit(placement.limits[l].resource, &limit) < 0)
+            return "setrlimit";
+    }
+    return NULL;
+}
+
+// Where this shell sits in the cgroup v2 hierarchy, as a directory path (NULL without cgroup v2)
+char *cgroup_self(void)
+{
+    // The unified hierarchy's mount point (/sys/fs/cgroup, or .../unified on hybrid systems)
+    FILE *mounts = fopen("/proc/self/mounts", "r");
+    if (mounts == NULL)
+        return NULL;
+    char line[4096], mount[4096] = "";
+    while (fgets(line, sizeof(line), mounts) != NULL)
+    {
+        char dir[4096], type[64];
+        if (sscanf(line, "%*s %4095s %63s", dir, type) == 2 && strcmp(type, "cgroup2") == 0)
+        {
+            strcpy(mount, dir);
+            break;
+        }
+    }
+    fclose(mounts);
+
+    // And the group within it, the "0::" line
+    FILE *groups = fopen("/proc/self/cgroup", "r");
+    if (groups == NULL || mount[0] == '\0')
+    {
+        if (groups != NULL)
+            fclose(groups);
+        return NULL;
+    }
+    char *path = NULL;
+    while (path == NULL && fgets(line, sizeof(line), groups) != NULL)
+    {
+        if (strncmp(line, "0::", 3) == 0)
+        {
+            line[strcspn(line, "\n")] = '\0';
+            path = malloc(strlen(mount) + strlen(line + 3) + 1);
+            if (!path)
+            {
+                perror("Failed to allocate memory for the cgroup path");
+                exit(EXIT_FAILURE);
+            }
+            sprintf(path, "%s%s", mount, strcmp(line + 3, "/") == 0 ? "" : line + 3);
+        }
+    }
+    fclose(groups);
+    return path;
+}
+
+// Creates the cgroup of a new pipeline with the configured settings, kept in job->cgroup until the job is freed
+// Returns its open cgroup.procs, or -1 (after a warning) when the pipeline runs without one
+int cgroup_create(Job *job)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/minishell-%d-%u", placement.cgroupParent, (int)getpid(), placement.cgroupSerial++);
+    if (mkdir(path, 0755) < 0)
+    {
+        fprintf(stderr, "Warning: couldn't create cgroup %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    job->cgroup = arena_strndup(&job->arena, path, strlen(path));
+
+    // Its files are opened relative to it, their names are checked to have no /
+    int dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (int s = 0; s < placement.numCgroupFiles && dir >= 0; s++)
+    {
+        const char *setting = placement.cgroupFiles[s];
+        const char *value = strchr(setting, '=') + 1;
+        char name[NAME_MAX + 1];
+        snprintf(name, sizeof(name), "%.*s", (int)(value - 1 - setting), setting);
+        int fd = openat(dir, name, O_WRONLY | O_CLOEXEC);
+        if (fd < 0 || write(fd, value, strlen(value)) < 0)
+            fprintf(stderr, "Warning: couldn't set %s/%s to %s: %s\n", path, name, value, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+    }
+
+    int fd = dir >= 0 ? openat(dir, "cgroup.procs", O_WRONLY | O_CLOEXEC) : -1;
+    if (fd < 0)
+        fprintf(stderr, "Warning: couldn't open %s/cgroup.procs: %s\n", path, strerror(errno));
+    if (dir >= 0)
+        close(dir);
+    return fd;
+}
+
+// Parses a value of `stage limit`: a count with an optional K/M/G suffix, or unlimited
+bool parse_limit(const char *text, rlim_t *value)
+{
+    size_t size;
+    if (strcmp(text, "unlimited") == 0)
+    {
+        *value = RLIM_INFINITY;
+        return true;
+    }
+    if (!parse_size(text, &size))
+        return false;
+    *value = size;
+    return true;
+}
+
+// Parses an I/O priority: rt[:LEVEL], be[:LEVEL] or idle, the level 0 (highest) to 7
+bool parse_ioprio(const char *text, int *ioprio)
+{
+    size_t len = strcspn(text, ":");
+    int ioClass;
+    if (len == 2 && strncmp(text, "rt", 2) == 0)
+        ioClass = IOPRIO_CLASS_RT;
+    else if (len == 2 && strncmp(text, "be", 2) == 0)
+        ioClass = IOPRIO_CLASS_BE;
+    else if (len == 4 && strncmp(text, "idle", 4) == 0)
+        ioClass = IOPRIO_CLASS_IDLE;
+    else
+        return false;
+
+    int level = 4; // The kernel's default level
+    if (text[len] == ':')
+    {
+        char *end;
+        level = strtol(text + len + 1, &end, 10);
+        if (end == text + len + 1 || *end != '\0' || level < 0 || level > 7)
+            return false;
+    }
+    *ioprio = IOPRIO_PRIO_VALUE(ioClass, ioClass == IOPRIO_CLASS_IDLE ? 0 : level);
+    return true;
+}
+
+// Prints a per-stage list of numbers on one line, - for the stages it leaves alone
+void stage_print_levels(const char *name, const int *levels, int count)
+{
+    for (int k = 0; k < count; k++)
+    {
+        printf("%s", k == 0 ? name : "");
+        if (levels[k] == STAGE_UNSET)
+            printf(" -");
+        else
+            printf(" %d", levels[k]);
+        printf("%s", k + 1 == count ? "\n" : "");
+    }
+}
+
+// Prints the current placement, one setting per line
+void stage_print(void)
+{
+    if (!stage_placement_active())
+        printf("default\n");
+    for (int k = 0; k < placement.numCpus; k++)
+    {
+        printf("%s", k == 0 ? "cpus" : "");
+        if (CPU_COUNT(&placement.cpus[k]) == 0)
+            printf(" -");
+        else
+        {
+            // Back to the list form, one range at a time
+            printf(" ");
+            const char *separator = "";
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            {
+                if (!CPU_ISSET(cpu, &placement.cpus[k]))
+                    continue;
+                int last = cpu;
+                while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &placement.cpus[k]))
+                    last++;
+                printf(last > cpu ? "%s%d-%d" : "%s%d", separator, cpu, last);
+                separator = ",";
+                cpu = last;
+            }
+        }
+        printf("%s", k + 1 == placement.numCpus ? "\n" : "");
+    }
+    stage_print_levels("node", placement.nodes, placement.numNodes);
+    stage_print_levels("nice", placement.nices, placement.numNices);
+    for (int k = 0; k < placement.numIoprios; k++)
+    {
+        static const char *classes[] = {"none", "rt", "be", "idle"};
+        int ioprio = placement.ioprios[k];
+        printf("%s", k == 0 ? "ionice" : "");
+        if (ioprio == STAGE_UNSET)
+            printf(" -");
+        else
+            printf(" %s:%d", classes[IOPRIO_PRIO_CLASS(ioprio) & 3], (int)IOPRIO_PRIO_DATA(ioprio));
+        printf("%s", k + 1 == placement.numIoprios ? "\n" : "");
+    }
+    if (placement.colocate)
+        printf("colocate on\n");
+    for (int l = 0; l < placement.numLimits; l++)
+    {
+        const char *name = "?";
+        for (size_t n = 0; n < sizeof(limitNames) / sizeof(limitNames[0]); n++)
+        {
+            if (limitNames[n].resource == placement.limits[l].resource)
+                name = limitNames[n].name;
+        }
+        if (placement.limits[l].value == RLIM_INFINITY)
+            printf("%s %s=unlimited%s", l == 0 ? "limit" : "", name, l + 1 == placement.numLimits ? "\n" : "");
+        else
+            printf("%s %s=%llu%s", l == 0 ? "limit" : "", name, (unsigned long long)placement.limits[l].value,
+                   l + 1 == placement.numLimits ? "\n" : "");
+    }
+    for (int s = 0; s < placement.numCgroupFiles; s++)
+        printf("%s %s%s", s == 0 ? "cgroup" : "", placement.cgroupFiles[s], s + 1 == placement.numCgroupFiles ? "\n" : "");
+    if (placement.numCgroupFiles > 0)
+        printf("cgroup-parent %s\n", placement.cgroupParent);
+}
+
+// Releases the cgroup settings
+void stage_clear_cgroup(void)
+{
+    for (int s = 0; s < placement.numCgroupFiles; s++)
+        free(placement.cgroupFiles[s]);
+    free(placement.cgroupFiles);
+    placement.cgroupFiles = NULL;
+    placement.numCgroupFiles = 0;
+}
+
+// Releases every setting, back to stages that inherit everything from the shell
+void stage_reset(void)
+{
+    stage_clear_cgroup();
+    free(placement.cgroupParent);
+    free(placement.cpus);
+    free(placement.nodes);
+    free(placement.nodeCpus);
+    free(placement.nices);
+    free(placement.ioprios);
+    free(placement.limits);
+    free(placement.order);
+    placement = (StagePlacement){0};
+}
+
+// stage [cpus LIST...|node N...|nice N...|ionice CLASS[:LEVEL]...|colocate on|off|limit NAME=VALUE...|cgroup FILE=VALUE...|cgroup-parent DIR|reset]
+// Places or limits the stages of later pipelines; per-stage values are given in stage order, - leaves one stage alone
+int builtin_stage(char **args)
+{
+    if (args[1] == NULL)
+    {
+        stage_print();
+        return 0;
+    }
+
+    int count = 0;
+    while (args[2 + count] != NULL)
+        count++;
+    char **values = &args[2];
+    const char *what = args[1];
+
+    if (strcmp(what, "reset") == 0)
+    {
+        stage_reset();
+        return 0;
+    }
+    if (strcmp(what, "colocate") == 0 && count == 1 && (strcmp(values[0], "on") == 0 || strcmp(values[0], "off") == 0))
+    {
+        placement.colocate = strcmp(values[0], "on") == 0;
+        return 0;
+    }
+    if (strcmp(what, "cpus") == 0)
+    {
+        cpu_set_t *cpus = malloc((count + 1) * sizeof(cpu_set_t));
+        if (!cpus)
+        {
+            perror("Failed to allocate memory for the stage CPUs");
+            exit(EXIT_FAILURE);
+        }
+        for (int k = 0; k < count; k++)
+        {
+            if (strcmp(values[k], "-") == 0)
+                CPU_ZERO(&cpus[k]);
+            else if (!parse_cpu_list(values[k], &cpus[k]))
+            {
+                fprintf(stderr, "stage: invalid CPU list: %s\n", values[k]);
+                free(cpus);
+                return 1;
+            }
+        }
+        free(placement.cpus);
+        placement.cpus = cpus;
+        placement.numCpus = count;
+        return 0;
+    }
+    if (strcmp(what, "node") == 0)
+    {
+        int *nodes = malloc((count + 1) * sizeof(int));
+        cpu_set_t *nodeCpus = malloc((count + 1) * sizeof(cpu_set_t));
+        if (!nodes || !nodeCpus)
+        {
+            perror("Failed to allocate memory for the stage nodes");
+            exit(EXIT_FAILURE);
+        }
+        for (int k = 0; k < count; k++)
+        {
+            char path[96], list[4096], *end;
+            nodes[k] = STAGE_UNSET;
+            CPU_ZERO(&nodeCpus[k]);
+            if (strcmp(values[k], "-") == 0)
+                continue;
+            long node = strtol(values[k], &end, 10);
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%ld/cpulist", node);
+            if (end == values[k] || *end != '\0' || node < 0 || node >= CPU_SETSIZE || !read_sysfs(path, list, sizeof(list)) ||
+                !parse_cpu_list(list, &nodeCpus[k]))
+            {
+                fprintf(stderr, "stage: no such NUMA node: %s\n", values[k]);
+                free(nodes);
+                free(nodeCpus);
+                return 1;
+            }
+            nodes[k] = node;
+        }
+        free(placement.nodes);
+        free(placement.nodeCpus);
+        placement.nodes = nodes;
+        placement.nodeCpus = nodeCpus;
+        placement.numNodes = count;
+        return 0;
+    }
+    if (strcmp(what, "nice") == 0 || strcmp(what, "ionice") == 0)
+    {
+        bool nice = strcmp(what, "nice") == 0;
+        int *levels = malloc((count + 1) * sizeof(int));
+        if (!levels)
+        {
+            perror("Failed to allocate memory for the stage levels");
+            exit(EXIT_FAILURE);
+        }
+        for (int k = 0; k < count; k++)
+        {
+            levels[k] = STAGE_UNSET;
+            if (strcmp(values[k], "-") == 0)
+                continue;
+
+            bool valid;
+            if (nice)
+            {
+                char *end;
+                long level = strtol(values[k], &end, 10);
+                valid = end != values[k] && *end == '\0' && level >= -20 && level <= 19;
+                levels[k] = level;
+            }
+            else
+                valid = parse_ioprio(values[k], &levels[k]);
+            if (!valid)
+            {
+                fprintf(stderr, "stage: invalid %s level: %s\n", what, values[k]);
+                free(levels);
+                return 1;
+            }
+        }
+        if (nice)
+        {
+            free(placement.nices);
+            placement.nices = levels;
+            placement.numNices = count;
+        }
+        else
+        {
+            free(placement.ioprios);
+            placement.ioprios = levels;
+            placement.numIoprios = count;
+        }
+        return 0;
+    }
+    if (strcmp(what, "limit") == 0)
+    {
+        StageLimit *limits = malloc((count + 1) * sizeof(StageLimit));
+        if (!limits)
+        {
+            perror("Failed to allocate memory for the stage limits");
+            exit(EXIT_FAILURE);
+        }
+        for (int k = 0; k < count; k++)
+        {
+            size_t len = strcspn(values[k], "=");
+            size_t n = 0;
+            while (n < sizeof(limitNames) / sizeof(limitNames[0]) &&
+                   (strlen(limitNames[n].name) != len || strncmp(limitNames[n].name, values[k], len) != 0))
+                n++;
+            if (n == sizeof(limitNames) / sizeof(limitNames[0]) || values[k][len] != '=' || !parse_limit(values[k] + len + 1, &limits[k].value))
+            {
+                fprintf(stderr, "stage: invalid limit: %s\n", values[k]);
+                free(limits);
+                return 1;
+            }
+            limits[k].resource = limitNames[n].resource;
+        }
+        free(placement.limits);
+        placement.limits = limits;
+        placement.numLimits = count;
+        return 0;
+    }
+    if (strcmp(what, "cgroup") == 0)
+    {
+        for (int k = 0; k < count; k++)
+        {
+            // Only files of the group itself, like memory.max or cpu.max
+            const char *equals = strchr(values[k], '=');
+            if (equals == NULL || equals == values[k] || memchr(values[k], '/', equals - values[k]) != NULL)
+            {
+                fprintf(stderr, "stage: invalid cgroup setting: %s\n", values[k]);
+                return 1;
+            }
+        }
+        if (count > 0 && placement.cgroupParent == NULL && (placement.cgroupParent = cgroup_self()) == NULL)
+        {
+            fprintf(stderr, "stage: no cgroup v2 hierarchy\n");
+            return 1;
+        }
+        stage_clear_cgroup();
+        placement.cgroupFiles = malloc((count + 1) * sizeof(char *));
+        if (!placement.cgroupFiles)
+        {
+            perror("Failed to allocate memory for the cgroup settings");
+            exit(EXIT_FAILURE);
+        }
+        for (int k = 0; k < count; k++)
+        {
+            placement.cgroupFiles[k] = strdup(values[k]);
+            if (!placement.cgroupFiles[k])
+            {
+                perror("Failed to allocate memory for the cgroup settings");
+                exit(EXIT_FAILURE);
+            }
+        }
+        placement.numCgroupFiles = count;
+        return 0;
+    }
+    if (strcmp(what, "cgroup-parent") == 0 && count == 1)
+    {
+        free(placement.cgroupParent);
+        placement.cgroupParent = strdup(values[0]);
+        if (!placement.cgroupParent)
+        {
+            perror("Failed to allocate memory for the cgroup parent");
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
+
+    fprintf(stderr, "Usage: stage [cpus LIST...|node N...|nice N...|ionice CLASS[:LEVEL]...|colocate on|off|limit NAME=VALUE...|cgroup FILE=VALUE...|cgroup-parent DIR|reset]\n");
+    return 2;
+}
+
+/* ENVIRONMENT */
+
+// A block of NAME=value strings that can be handed to execve() as it is
+// The exported variables are one (also installed as environ, so getenv() sees them), the unexported ones another
+typedef struct
+{
+    char **vars;   // NULL-terminated NAME=value strings
+    bool *owned;   // Whether vars[i] was malloc'ed by us, the inherited ones were not
+    int count;     // Number of variables
+    int capacity;  // Room in vars, not counting the NULL
+    long generation; // Bumped on every change, tells the zygote when its copy is stale
+} VarBlock;
+
+VarBlock shellEnv = {0};  // Exported variables, the environment of every child
+VarBlock shellVars = {0}; // Variables set by a bare NAME=value, not exported
+pid_t shellPid;           // What $$ expands to, the same in subshells
+
+// Length of the NAME part of a NAME=value string
+size_t var_name_len(const char *var)
+{
+    return strcspn(var, "=");
+}
+
+// Index of the variable called name (nameLen bytes) in the block, or -1
+int var_find(const VarBlock *block, const char *name, size_t nameLen)
+{
+    for (int i = 0; i < block->count; i++)
+    {
+        if (block->vars[i][0] == name[0] && strncmp(block->vars[i], name, nameLen) == 0 && block->vars[i][nameLen] == '=')
+            return i;
+    }
+    return -1;
+}
+
+// Value of the variable called name in the block, or NULL if it is not set
+const char *var_get(const VarBlock *block, const char *name, size_t nameLen)
+{
+    int i = var_find(block, name, nameLen);
+    return i >= 0 ? block->vars[i] + nameLen + 1 : NULL;
+}
+
+// Sets the variable of a NAME=value string in the block, storing a copy of the string
+void var_set(VarBlock *block, const char *assignment)
+{
+    char *copy = strdup(assignment);
+    if (!copy)
+    {
+        perror("Failed to allocate memory for a variable");
+        exit(EXIT_FAILURE);
+    }
+
+    block->generation++;
+    int i = var_find(block, assignment, var_name_len(assignment));
+    if (i >= 0)
+    {
+        if (block->owned[i])
+            free(block->vars[i]);
+        block->vars[i] = copy;
+        block->owned[i] = true;
+        return;
+    }
+
+    if (block->count == block->capacity)
+    {
+        block->capacity = block->capacity ? 2 * block->capacity : 64;
+        block->vars = realloc(block->vars, (block->capacity + 1) * sizeof(char *));
+        block->owned = realloc(block->owned, block->capacity * sizeof(bool));
+        if (!block->vars || !block->owned)
+        {
+            perror("Failed to allocate memory for a variable");
+            exit(EXIT_FAILURE);
+        }
+    }
+    block->vars[block->count] = copy;
+    block->owned[block->count++] = true;
+    block->vars[block->count] = NULL;
+}
+
+// Removes the variable called name from the block, the order of the others may change
+void var_unset(VarBlock *block, const char *name, size_t nameLen)
+{
+    int i = var_find(block, name, nameLen);
+    if (i < 0)
+        return;
+    block->generation++;
+    if (block->owned[i])
+        free(block->vars[i]);
+    block->count--;
+    block->vars[i] = block->vars[block->count];
+    block->owned[i] = block->owned[block->count];
+    block->vars[block->count] = NULL;
+}
+
+// Gives every string we own and both arrays back to the heap
+void var_block_free(VarBlock *block)
+{
+    for (int i = 0; i < block->count; i++)
+    {
+        if (block->owned[i])
+            free(block->vars[i]);
+    }
+    free(block->vars);
+    free(block->owned);
+    memset(block, 0, sizeof(*block));
+}
+
+// Adopts the inherited environment: only the pointer array is copied, the strings stay where they are
+void env_init(void)
+{
+    extern char **environ;
+    int count = 0;
+    while (environ[count] != NULL)
+        count++;
+
+    shellEnv.capacity = count + 16;
+    shellEnv.count = count;
+    shellEnv.vars = malloc((shellEnv.capacity + 1) * sizeof(char *));
+    shellEnv.owned = calloc(shellEnv.capacity, sizeof(bool));
+    if (!shellEnv.vars || !shellEnv.owned)
+    {
+        perror("Failed to allocate memory for the environment");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(shellEnv.vars, environ, (count + 1) * sizeof(char *));
+    environ = shellEnv.vars;
+    shellPid = getpid();
+}
+
+// Exports the variable of a NAME=value string, dropping an unexported one of the same name
+void env_export(const char *assignment)
+{
+    extern char **environ;
+    var_unset(&shellVars, assignment, var_name_len(assignment));
+    var_set(&shellEnv, assignment);
+    environ = shellEnv.vars; // May have moved
+}
+
+// Exports name=value
+void env_set(const char *name, const char *value)
+{
+    size_t nameLen = strlen(name);
+    size_t valueLen = strlen(value);
+    char small[256];
+    char *assignment = nameLen + valueLen + 2 <= sizeof(small) ? small : malloc(nameLen + valueLen + 2);
+    if (!assignment)
+    {
+        perror("Failed to allocate memory for a variable");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(assignment, name, nameLen);
+    assignment[nameLen] = '=';
+    memcpy(assignment + nameLen + 1, value, valueLen + 1);
+    env_export(assignment);
+    if (assignment != small)
+        free(assignment);
+}
+
+// Applies a bare NAME=value: exported variables stay exported, others become shell variables
+void shell_assign(const char *assignment)
+{
+    if (var_find(&shellEnv, assignment, var_name_len(assignment)) >= 0)
+        env_export(assignment);
+    else
+        var_set(&shellVars, assignment);
+}
+
+// Environment of a command with NAME=value prefixes: the shared block with those entries replaced or added
+// Only a pointer array is built, in the arena, no string is copied; the last prefix of a name wins
+char **env_with_overrides(char **assigns, int numAssigns, Arena *arena)
+{
+    char **envp = arena_alloc(arena, (shellEnv.count + numAssigns + 1) * sizeof(char *));
+    int n = 0;
+    for (int i = 0; i < shellEnv.count; i++)
+    {
+        const char *var = shellEnv.vars[i];
+        bool overridden = false;
+        for (int a = 0; a < numAssigns && !overridden; a++)
+            overridden = var[0] == assigns[a][0] && strncmp(var, assigns[a], var_name_len(assigns[a]) + 1) == 0;
+        if (!overridden)
+            envp[n++] = (char *)var;
+    }
+    for (int a = 0; a < numAssigns; a++)
+    {
+        bool repeated = false;
+        for (int later = a + 1; later < numAssigns && !repeated; later++)
+            repeated = strncmp(assigns[later], assigns[a], var_name_len(assigns[a]) + 1) == 0;
+        if (!repeated)
+            envp[n++] = assigns[a];
+    }
+    envp[n] = NULL;
+    return envp;
+}
+
+// Value a NAME=value prefix of the command gives to name, or NULL
+const char *command_assigned(const Command *command, const char *name)
+{
+    size_t nameLen = strlen(name);
+    const char *value = NULL;
+    for (int a = 0; a < command->numAssigns; a++)
+    {
+        if (strncmp(command->assigns[a], name, nameLen) == 0 && command->assigns[a][nameLen] == '=')
+            value = command->assigns[a] + nameLen + 1;
+    }
+    return value;
+}
+
+/* COMMAND HISTORY */
+
+#define HISTORY_FILE ".minishell_history" // In $HOME, unless $HISTFILE names another file
+#define HISTORY_INDEX_STEP 4096           // Older records indexed at a time, searches seldom go back far
+
+// Start offsets of history records
+typedef struct
+{
+    size_t *starts; // Offsets into the history file
+    size_t count;   // Number of records
+    size_t capacity; // Room in starts
+} HistoryIndex;
+
+// The history file holds one line per record, appended with a single O_APPEND write each, so concurrent
+// shells share it without locks; it is read through a shared mapping and indexed only as far as it is used
+typedef struct
+{
+    int fd;             // The file, opened for appending
+    const char *map;    // Shared read-only mapping of the file
+    size_t mapSize;     // Bytes mapped
+    size_t base;        // End of the last complete record at startup
+    size_t scanned;     // Records from here up to base are in older
+    size_t tail;        // Records from base up to here are in newer
+    HistoryIndex older; // Records before base, newest first, extended backwards on demand
+    HistoryIndex newer; // Records after base, oldest first, added as the file grows
+} History;
+
+History history = {-1};
+
+// Adds a record start to an index
+void history_index_push(HistoryIndex *index, size_t start)
+{
+    if (index->count == index->capacity)
+    {
+        index->capacity = index->capacity ? 2 * index->capacity : HISTORY_INDEX_STEP;
+        index->starts = realloc(index->starts, index->capacity * sizeof(size_t));
+        if (!index->starts)
+        {
+            perror("Failed to allocate memory for the history index");
+            exit(EXIT_FAILURE);
+        }
+    }
+    index->starts[index->count++] = start;
+}
+
+// Maps the first size bytes of the history file, replacing the current mapping
+void history_map(size_t size)
+{
+    void *map = size == 0 ? NULL
+                : history.map != NULL ? mremap((void *)history.map, history.mapSize, size, MREMAP_MAYMOVE)
+                                      : mmap(NULL, size, PROT_READ, MAP_SHARED, history.fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("Couldn't map the history file");
+        return;
+    }
+    history.map = map;
+    history.mapSize = size;
+}
+
+// Maps the history file as it is now and forgets any index
+// Nothing is read beyond the last record, so this takes the same time however long the history is
+void history_load(void)
+{
+    struct stat st;
+    if (history.map != NULL)
+        munmap((void *)history.map, history.mapSize);
+    history.map = NULL;
+    history.mapSize = 0;
+    if (fstat(history.fd, &st) == 0)
+        history_map(st.st_size);
+
+    const char *last = history.map != NULL ? memrchr(history.map, '\n', history.mapSize) : NULL;
+    history.base = history.scanned = history.tail = last != NULL ? last - history.map + 1 : 0;
+    history.older.count = 0;
+    history.newer.count = 0;
+}
+
+// Opens $HISTFILE or ~/.minishell_history; without a usable file the history lasts for the session
+void history_init(void)
+{
+    const char *path = var_get(&shellEnv, "HISTFILE", 8);
+    const char *home = var_get(&shellEnv, "HOME", 4);
+    char defaultPath[PATH_MAX];
+    if (path == NULL && home != NULL)
+    {
+        snprintf(defaultPath, sizeof(defaultPath), "%s/%s", home, HISTORY_FILE);
+        path = defaultPath;
+    }
+    history.fd = path != NULL ? open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600) : -1;
+    if (history.fd < 0)
+        history.fd = memfd_create("minishell-history", MFD_CLOEXEC);
+    if (history.fd < 0)
+        return;
+    history.fd = keep_above_stdio(history.fd);
+    history_load();
+}
+
+// Picks up the records appended since the last look, by this shell or any other
+void history_refresh(void)
+{
+    struct stat st;
+    if (history.fd < 0 || fstat(history.fd, &st) < 0)
+        return;
+    if ((size_t)st.st_size < history.mapSize)
+    {
+        history_load(); // Truncated behind our back
+        return;
+    }
+    if ((size_t)st.st_size > history.mapSize)
+        history_map(st.st_size);
+
+    const char *newline;
+    while (history.tail < history.mapSize &&
+           (newline = memchr(history.map + history.tail, '\n', history.mapSize - history.tail)) != NULL)
+    {
+        history_index_push(&history.newer, history.tail);
+        history.tail = newline - history.map + 1;
+    }
+}
+
+// Indexes up to HISTORY_INDEX_STEP more records before base, returns false when the start of the file was reached
+bool history_index_older(void)
+{
+    for (int n = 0; n < HISTORY_INDEX_STEP; n++)
+    {
+        if (history.scanned == 0)
+            return n > 0;
+        const char *start = memrchr(history.map, '\n', history.scanned - 1);
+        history.scanned = start != NULL ? start - history.map + 1 : 0;
+        history_index_push(&history.older, history.scanned);
+    }
+    return true;
+}
+
+// Record k, counting back from 0 for the newest, with its length in *len; NULL past the oldest
+const char *history_entry(size_t k, size_t *len)
+{
+    size_t start;
+    if (k < history.newer.count)
+    {
+        start = history.newer.starts[history.newer.count - 1 - k];
+    }
+    else
+    {
+        k -= history.newer.count;
+        while (k >= history.older.count && history_index_older())
+            ;
+        if (k >= history.older.count)
+            return NULL;
+        start = history.older.starts[k];
+    }
+    *len = (const char *)memchr(history.map + start, '\n', history.mapSize - start) - (history.map + start);
+    return history.map + start;
+}
+
+// Finds the newest record from number from on that starts with (prefix) or contains the len bytes of text
+// Returns its number, or -1 if there is none
+long history_search(const char *text, size_t len, bool prefix, size_t from)
+{
+    size_t entryLen;
+    const char *entry;
+    for (size_t k = from; (entry = history_entry(k, &entryLen)) != NULL; k++)
+    {
+        if (prefix ? entryLen >= len && memcmp(entry, text, len) == 0 : memmem(entry, entryLen, text, len) != NULL)
+            return k;
+    }
+    return -1;
+}
+
+// Appends a line to the history file as one record, unless it is blank, starts with a space or repeats the last one
+void history_add(const char *line)
+{
+    size_t len = strlen(line);
+    if (history.fd < 0 || len == 0 || isspace((unsigned char)line[0]))
+        return;
+    history_refresh();
+    size_t lastLen;
+    const char *last = history_entry(0, &lastLen);
+    if (last != NULL && lastLen == len && memcmp(last, line, len) == 0)
+        return;
+
+    // One write per record: O_APPEND places it atomically after whatever the other shells wrote
+    struct iovec record[2] = {{(void *)line, len}, {"\n", 1}};
+    if (writev(history.fd, record, 2) < 0)
+        perror("Couldn't write the history file");
+}
+
+// Unmaps and closes the history file
+void history_close(void)
+{
+    if (history.map != NULL)
+        munmap((void *)history.map, history.mapSize);
+    if (history.fd >= 0)
+        close(history.fd);
+    free(history.older.starts);
+    free(history.newer.starts);
+}
+
+/* BUILTIN COMMANDS */
+
+// open() flags used for each redirection kind
+int redirect_open_flags(RedirKind kind)
+{
+    switch (kind)
+    {
+    case REDIR_IN:
+        return O_RDONLY;
+    case REDIR_APPEND:
+        return O_WRONLY | O_CREAT | O_APPEND;
+    case REDIR_RDWR:
+        return O_RDWR | O_CREAT;
+    default:
+        return O_WRONLY | O_CREAT | O_TRUNC;
+    }
+}
+
+// Opens the file of a file redirection (O_CLOEXEC) with its I/O hints applied, async-signal-safe
+// Returns the descriptor, or -1 with errno set
+int redirect_open(const Redirect *redir)
+{
+    int flags = redirect_open_flags(redir->kind) | O_CLOEXEC | (redir->hints & IOHINT_DIRECT ? O_DIRECT : 0);
+    int fd = open(redir->target, flags, 0666);
+    if (fd < 0 || (redir->hints == 0 && redir->prealloc == 0))
+        return fd;
+
+    // Only advice: a file system that ignores it still gets the data through
+    if (redir->hints & IOHINT_SEQUENTIAL)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (redir->hints & IOHINT_WILLNEED)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    if (redir->prealloc > 0)
+    {
+        // Reserved past what the file holds, without changing the size its readers see
+        struct stat st;
+        off_t from = redir->kind != REDIR_OUT && fstat(fd, &st) == 0 ? st.st_size : 0;
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, from, redir->prealloc);
+    }
+    return fd;
+}
+
+// Writes back and drops a file from the page cache, for the dontneed hint once its job is done
+void redirect_drop_cache(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+    if (fd < 0)
+        fd = open(path, O_RDONLY | O_CLOEXEC); // O_NOATIME needs to own the file
+    if (fd < 0)
+        return;
+    fdatasync(fd); // Dirty pages can't be dropped
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// Returns true if a redirection of the command has I/O hints, which the stage must apply to its own open file
+bool command_has_hints(const Command *command)
+{
+    for (int r = 0; r < command->numRedirs; r++)
+    {
+        if (command->redirs[r].hints != 0 || command->redirs[r].prealloc != 0)
+            return true;
+    }
+    return false;
+}
+
+// Applies one redirection to the calling process with open() and dup3(), nothing else
+// Async-signal-safe, so fork and vfork children and the shell itself share it; returns -1 with errno set on failure
+int apply_redirect(const Redirect *redir)
+{
+    int fd;
+    switch (redir->kind)
+    {
+    case REDIR_CLOSE:
+        close(redir->fd);
+        return 0;
+    case REDIR_DUP:
+    case REDIR_STRING:
+    case REDIR_HEREDOC:
+        // dup3() refuses to duplicate a descriptor onto itself, which is a no-op anyway
+        if (redir->srcFd == redir->fd)
+            return fcntl(redir->fd, F_SETFD, 0);
+        return dup3(redir->srcFd, redir->fd, 0) < 0 ? -1 : 0;
+    default:
+        // O_CLOEXEC on the temporary fd, the dup3() copy is the one the program keeps
+        fd = redirect_open(redir);
+        if (fd < 0)
+            return -1;
+        if (fd == redir->fd)
+            return fcntl(fd, F_SETFD, 0);
+        int result = dup3(fd, redir->fd, 0);
+        close(fd);
+        return result < 0 ? -1 : 0;
+    }
+}
+
+// What to blame when apply_redirect() fails
+const char *redirect_error(const Redirect *redir)
+{
+    if (redir->kind == REDIR_DUP)
+        return "Bad file descriptor in redirection";
+    return redir->kind == REDIR_IN || redir->kind == REDIR_RDWR ? "Failed to open input file" : "Failed to open output file";
+}
+
+// Returns a close-on-exec descriptor that reads back the len bytes of text, without touching the filesystem
+// Bodies that fit a pipe's buffer are written into a pipe right away, so no feeder is needed; larger ones go to a memfd
+int body_fd(const char *text, size_t len)
+{
+    int fds[2];
+    if (len <= PIPE_BUF * 16 && pipe2(fds, O_CLOEXEC) == 0)
+    {
+        // Pipes usually hold 64 KiB, but a user over pipe-user-pages-soft gets one page, so the write must not
+        // block: a short one falls back to the memfd
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        if (write(fds[1], text, len) == (ssize_t)len)
+        {
+            close(fds[1]);
+            return keep_above_stdio(fds[0]);
+        }
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    int fd = memfd_create("minishell-body", MFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("memfd_create failed");
+        return -1;
+    }
+    for (size_t done = 0; done < len;)
+    {
+        ssize_t bytes = write(fd, text + done, len - done);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes < 0)
+        {
+            perror("Failed to write a here-document");
+            close(fd);
+            return -1;
+        }
+        done += bytes;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return keep_above_stdio(fd);
+}
+
+// Gives every <<< and << of the command a descriptor holding its text for this launch
+// Returns false (after an error) if one can't be made
+bool redirect_prepare(Command *command, Arena *arena)
+{
+    for (int r = 0; r < command->numRedirs; r++)
+    {
+        Redirect *redir = &command->redirs[r];
+        if (redir->kind == REDIR_HEREDOC)
+        {
+            redir->srcFd = body_fd(redir->body ? redir->body : "", redir->body ? strlen(redir->body) : 0);
+            if (redir->srcFd < 0)
+                return false;
+            continue;
+        }
+        if (redir->kind != REDIR_STRING)
+            continue;
+
+        // A here-string is its word plus a newline
+        size_t len = strlen(redir->target);
+        char *text = arena_alloc(arena, len + 1);
+        memcpy(text, redir->target, len);
+        text[len] = '\n';
+        redir->srcFd = body_fd(text, len + 1);
+        if (redir->srcFd < 0)
+            return false;
+    }
+    return true;
+}
+
+// Closes the shell's copies of the descriptors redirect_prepare() made, once the stage launched
+void redirect_finish(Command *command)
+{
+    for (int r = 0; r < command->numRedirs; r++)
+    {
+        Redirect *redir = &command->redirs[r];
+        if ((redir->kind == REDIR_STRING || redir->kind == REDIR_HEREDOC) && redir->srcFd >= 0)
+        {
+            close(redir->srcFd);
+            redir->srcFd = -1;
+        }
+    }
+}
+
+// A builtin receives its null-terminated argv and returns its exit status
+typedef int (*BuiltinFunc)(char **args);
+
+// Entry of the builtin dispatch table
+typedef struct
+{
+    const char *name;             // Command name
+    BuiltinFunc run;              // Implementation
+    bool (*handles)(char **args); // Whether the builtin supports these arguments (NULL: always), else PATH is used
+} Builtin;
+
+// true and :
+int builtin_true(char **args)
+{
+    return 0;
+}
+
+// false
+int builtin_false(char **args)
+{
+    return 1;
+}
+
+// echo [-n] [args...]
+int builtin_echo(char **args)
+{
+    int i = 1;
+    bool newline = true;
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0)
+    {
+        newline = false;
+        i++;
+    }
+
+    for (; args[i] != NULL; i++)
+    {
+        fputs(args[i], stdout);
+        if (args[i + 1] != NULL)
+            putchar(' ');
+    }
+    if (newline)
+        putchar('\n');
+    return 0;
+}
+
+long cwdGeneration = 0; // Bumped by every successful cd, tells the zygote when its working directory is stale
+
+// cd [dir | -], defaults to $HOME and keeps PWD/OLDPWD up to date
+int builtin_cd(char **args)
+{
+    const char *dir = args[1];
+    if (dir == NULL)
+        dir = getenv("HOME");
+    else if (strcmp(dir, "-") == 0)
+    {
+        dir = getenv("OLDPWD");
+        if (dir != NULL)
+            printf("%s\n", dir);
+    }
+    if (dir == NULL)
+    {
+        fprintf(stderr, "cd: %s not set\n", args[1] ? "OLDPWD" : "HOME");
+        return 1;
+    }
+
+    char *oldCwd = getcwd(NULL, 0);
+    if (chdir(dir) < 0)
+    {
+        fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+        free(oldCwd);
+        return 1;
+    }
+    cwdGeneration++;
+
+    char *newCwd = getcwd(NULL, 0);
+    if (oldCwd != NULL)
+        env_set("OLDPWD", oldCwd);
+    if (newCwd != NULL)
+        env_set("PWD", newCwd);
+    free(oldCwd);
+    free(newCwd);
+    return 0;
+}
+
+// pwd
+int builtin_pwd(char **args)
+{
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL)
+    {
+        perror("pwd");
+        return 1;
+    }
+    printf("%s\n", cwd);
+    free(cwd);
+    return 0;
+}
+
+// exit [status], defaults to the status of the last pipeline
+int builtin_exit(char **args)
+{
+    int status = args[1] != NULL ? atoi(args[1]) : lastStatus;
+    fflush(stdout);
+    exit(status & 0xff);
+}
+
+// export [NAME[=value]...], without arguments lists the environment
+int builtin_export(char **args)
+{
+    if (args[1] == NULL)
+    {
+        for (int i = 0; i < shellEnv.count; i++)
+            printf("export %s\n", shellEnv.vars[i]);
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        size_t nameLen = var_name_len(args[i]);
+        if (!is_name(args[i], nameLen))
+        {
+            fprintf(stderr, "export: `%s': not a valid identifier\n", args[i]);
+            status = 1;
+        }
+        else if (args[i][nameLen] == '=')
+        {
+            env_export(args[i]);
+        }
+        else
+        {
+            // export NAME: a shell variable of that name becomes part of the environment
+            const char *value = var_get(&shellVars, args[i], nameLen);
+            if (value != NULL)
+                env_set(args[i], value);
+        }
+    }
+    return status;
+}
+
+// unset NAME...: removes exported and shell variables
+int builtin_unset(char **args)
+{
+    extern char **environ;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        var_unset(&shellEnv, args[i], strlen(args[i]));
+        var_unset(&shellVars, args[i], strlen(args[i]));
+    }
+    environ = shellEnv.vars;
+    return 0;
+}
+
+// hash [-r] [name...]: lists, clears or preloads the hashed command cache
+int builtin_hash(char **args)
+{
+    if (args[1] == NULL)
+    {
+        for (size_t b = 0; b < commandHash.numBuckets; b++)
+            for (HashEntry *entry = commandHash.buckets[b]; entry != NULL; entry = entry->next)
+                printf("%s\t%s\n", entry->name, entry->path);
+        print_cache_stats(stdout);
+        return 0;
+    }
+
+    if (strcmp(args[1], "-r") == 0)
+    {
+        command_hash_clear(&commandHash);
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (lookup_command(args[i]) == NULL)
+        {
+            fprintf(stderr, "hash: %s: not found\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// history [count]: lists the last count records of the shared history, or all of them, numbered from the oldest
+int builtin_history(char **args)
+{
+    long count = args[1] != NULL ? atol(args[1]) : -1;
+    history_refresh();
+    while (history_index_older())
+        ;
+    size_t total = history.older.count + history.newer.count;
+    size_t shown = count >= 0 && (size_t)count < total ? (size_t)count : total;
+    for (size_t k = shown; k-- > 0;)
+    {
+        size_t len;
+        const char *entry = history_entry(k, &len);
+        printf("%5zu  %.*s\n", total - k, (int)len, entry);
+    }
+    return 0;
+}
+
+// Evaluates a unary test operator
+bool test_unary(const char *op, const char *arg)
+{
+    struct stat st;
+    switch (op[1])
+    {
+    case 'n':
+        return arg[0] != '\0';
+    case 'z':
+        return arg[0] == '\0';
+    case 'e':
+        return stat(arg, &st) == 0;
+    case 'f':
+        return stat(arg, &st) == 0 && S_ISREG(st.st_mode);
+    case 'd':
+        return stat(arg, &st) == 0 && S_ISDIR(st.st_mode);
+    case 's':
+        return stat(arg, &st) == 0 && st.st_size > 0;
+    case 'r':
+        return access(arg, R_OK) == 0;
+    case 'w':
+        return access(arg, W_OK) == 0;
+    case 'x':
+        return access(arg, X_OK) == 0;
+    default:
+        return false;
+    }
+}
+
+// Evaluates a binary test operator, *valid is cleared for unknown operators
+bool test_binary(const char *left, const char *op, const char *right, bool *valid)
+{
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+        return strcmp(left, right) == 0;
+    if (strcmp(op, "!=") == 0)
+        return strcmp(left, right) != 0;
+
+    long a = atol(left), b = atol(right);
+    if (strcmp(op, "-eq") == 0)
+        return a == b;
+    if (strcmp(op, "-ne") == 0)
+        return a != b;
+    if (strcmp(op, "-lt") == 0)
+        return a < b;
+    if (strcmp(op, "-le") == 0)
+        return a <= b;
+    if (strcmp(op, "-gt") == 0)
+        return a > b;
+    if (strcmp(op, "-ge") == 0)
+        return a >= b;
+
+    *valid = false;
+    return false;
+}
+
+// test EXPR and [ EXPR ]: one to three operands, optionally negated with a leading !
+int builtin_test(char **args)
+{
+    int argc = 0;
+    while (args[argc] != NULL)
+        argc++;
+
+    if (strcmp(args[0], "[") == 0)
+    {
+        if (strcmp(args[argc - 1], "]") != 0)
+        {
+            fprintf(stderr, "[: missing `]'\n");
+            return 2;
+        }
+        argc--;
+    }
+
+    char **operands = args + 1;
+    int count = argc - 1;
+    bool negate = false;
+    if (count > 1 && strcmp(operands[0], "!") == 0)
+    {
+        negate = true;
+        operands++;
+        count--;
+    }
+
+    bool result;
+    bool valid = true;
+    if (count == 0)
+        result = false;
+    else if (count == 1)
+        result = operands[0][0] != '\0';
+    else if (count == 2 && operands[0][0] == '-' && strchr("nzefdsrwx", operands[0][1]) && operands[0][2] == '\0')
+        result = test_unary(operands[0], operands[1]);
+    else if (count == 3)
+        result = test_binary(operands[0], operands[1], operands[2], &valid);
+    else
+        valid = false;
+
+    if (!valid)
+    {
+        fprintf(stderr, "%s: unsupported expression\n", args[0]);
+        return 2;
+    }
+    return result != negate ? 0 : 1;
+}
+
+/* ZERO-COPY DATA MOVER */
+
+#define COPY_CHUNK (1 << 30)     // Bytes asked for per splice/sendfile/copy_file_range call
+#define FALLBACK_BUFFER (1 << 17) // Buffer of the read/write fallback
+
+// Plain read/write copy of up to limit bytes (all of in when limit is 0), used when the kernel can't move the data itself
+// Returns the number of bytes copied, or -1 on error
+ssize_t copy_user_space(int in, int out, size_t limit)
+{
+    static char buffer[FALLBACK_BUFFER];
+    size_t total = 0;
+    while (limit == 0 || total < limit)
+    {
+        size_t want = sizeof(buffer);
+        if (limit != 0 && limit - total < want)
+            want = limit - total;
+
+        ssize_t got = read(in, buffer, want);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return got < 0 ? -1 : (ssize_t)total;
+
+        for (ssize_t done = 0; done < got;)
+        {
+            ssize_t put = write(out, buffer + done, got - done);
+            if (put < 0 && errno == EINTR)
+                continue;
+            if (put < 0)
+                return -1;
+            done += put;
+        }
+        total += got;
+    }
+    return total;
+}
+
+// Moves exactly len bytes from in to out with splice() (one of them must be a pipe), in user space if splice refuses
+bool splice_exactly(int in, int out, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t moved = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved < 0 && errno == EINTR)
+            continue;
+        if (moved < 0 && errno == EINVAL)
+            return copy_user_space(in, out, len) == (ssize_t)len; // e.g. an O_APPEND target
+        if (moved <= 0)
+            return false;
+        len -= moved;
+    }
+    return true;
+}
+
+// Copies everything from in to out, picking the cheapest kernel mechanism for the pair of fd types:
+// copy_file_range between regular files, splice when a pipe is involved, sendfile from a regular file,
+// and read/write only when none of them applies
+int copy_fd(int in, int out)
+{
+    struct stat inSt, outSt;
+    if (fstat(in, &inSt) < 0 || fstat(out, &outSt) < 0)
+        return -1;
+
+    // copy_file_range and sendfile refuse O_APPEND outputs
+    int outFlags = fcntl(out, F_GETFL);
+    bool appending = outFlags >= 0 && (outFlags & O_APPEND);
+
+    if (S_ISREG(inSt.st_mode) && S_ISREG(outSt.st_mode) && !appending)
+    {
+        ssize_t moved;
+        while ((moved = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) > 0)
+            ;
+        if (moved == 0)
+            return 0;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+            return -1;
+    }
+
+    if (S_ISFIFO(inSt.st_mode) || S_ISFIFO(outSt.st_mode))
+    {
+        ssize_t moved;
+        while ((moved = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0 || (moved < 0 && errno == EINTR))
+            ;
+        if (moved == 0)
+            return 0;
+        if (errno != EINVAL)
+            return -1;
+    }
+
+    if (S_ISREG(inSt.st_mode) && !appending)
+    {
+        ssize_t moved;
+        while ((moved = sendfile(out, in, NULL, COPY_CHUNK)) > 0 || (moved < 0 && errno == EINTR))
+            ;
+        if (moved == 0)
+            return 0;
+        if (errno != EINVAL && errno != ENOSYS)
+            return -1;
+    }
+
+    return copy_user_space(in, out, 0) < 0 ? -1 : 0;
+}
+
+// Copies everything from the pipe in to each of outs without reading the bytes into user space:
+// every chunk is tee()'d into a scratch pipe and spliced to all outputs but the last, which consumes it
+void fan_out_copy(int in, int *outs, int numOuts)
+{
+    int scratch[2];
+    if (numOuts == 1 || pipe2(scratch, O_CLOEXEC) < 0)
+    {
+        copy_fd(in, outs[0]); // Nothing to duplicate (or no scratch pipe): a plain move
+        for (int k = 1; k < numOuts; k++)
+            copy_fd(in, outs[k]);
+        return;
+    }
+
+    // An empty scratch pipe as large as the input takes a whole tee() of it, every time
+    int size = fcntl(in, F_GETPIPE_SZ);
+    if (size > 0)
+        fcntl(scratch[1], F_SETPIPE_SZ, size);
+
+    while (1)
+    {
+        ssize_t chunk = tee(in, scratch[1], size > 0 ? size : COPY_CHUNK, 0);
+        if (chunk < 0 && errno == EINTR)
+            continue;
+        if (chunk <= 0)
+            break; // EOF, or tee() isn't supported here and nothing was duplicated
+
+        bool ok = splice_exactly(scratch[0], outs[0], chunk);
+        for (int k = 1; ok && k < numOuts - 1; k++)
+        {
+            // Same buffers at the head of in and an empty scratch pipe: this copies the same chunk again
+            ok = tee(in, scratch[1], chunk, 0) == chunk && splice_exactly(scratch[0], outs[k], chunk);
+        }
+        if (!ok || !splice_exactly(in, outs[numOuts - 1], chunk))
+        {
+            perror("fan-out failed");
+            break;
+        }
+    }
+
+    close(scratch[0]);
+    close(scratch[1]);
+}
+
+// State of a stage whose stdout is fanned out to several files
+typedef struct
+{
+    int readFd;         // Read end of the pipe the stage writes to
+    int writeFd;        // Write end, dup'ed onto the stage's stdout
+    int *outs;          // Opened output files
+    int numOuts;        // Number of output files
+    Redirect *redirs;   // The stage's own redirections, put back after it launched
+    int numRedirs;
+} FanOut;
+
+// Returns true if the command has more than one stdout file redirection (> or >>)
+bool has_fan_out(const Command *command)
+{
+    int outputs = 0;
+    for (int r = 0; r < command->numRedirs; r++)
+    {
+        if (command->redirs[r].fd == STDOUT_FILENO && (command->redirs[r].kind == REDIR_OUT || command->redirs[r].kind == REDIR_APPEND))
+            outputs++;
+    }
+    return outputs > 1;
+}
+
+// Opens every stdout target of the command and points its stdout at a new pipe instead
+// The command's redirections are swapped for the launch; returns false (after an error) if a file can't be opened
+bool fan_out_prepare(Command *command, FanOut *fan, Arena *arena)
+{
+    fan->outs = arena_alloc(arena, command->numRedirs * sizeof(int));
+    fan->numOuts = 0;
+    Redirect *redirs = arena_alloc(arena, command->numRedirs * sizeof(Redirect));
+    int numRedirs = 0;
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        perror("Couldn't create a pipe");
+        return false;
+    }
+    fan->readFd = keep_above_stdio(fds[0]);
+    fan->writeFd = keep_above_stdio(fds[1]);
+
+    for (int r = 0; r < command->numRedirs; r++)
+    {
+        Redirect *redir = &command->redirs[r];
+        if (redir->fd != STDOUT_FILENO || (redir->kind != REDIR_OUT && redir->kind != REDIR_APPEND))
+        {
+            redirs[numRedirs++] = *redir;
+            continue;
+        }
+
+        int fd = redirect_open(redir);
+        if (fd < 0)
+        {
+            fprintf(stderr, "Failed to open output file: %s: %s\n", redir->target, strerror(errno));
+            for (int k = 0; k < fan->numOuts; k++)
+                close(fan->outs[k]);
+            close(fan->readFd);
+            close(fan->writeFd);
+            return false;
+        }
+
+        // The first stdout redirection becomes the pipe, the others only feed the mover
+        if (fan->numOuts == 0)
+            redirs[numRedirs++] = (Redirect){REDIR_DUP, STDOUT_FILENO, NULL, fan->writeFd};
+        fan->outs[fan->numOuts++] = fd;
+    }
+
+    fan->redirs = command->redirs;
+    fan->numRedirs = command->numRedirs;
+    command->redirs = redirs;
+    command->numRedirs = numRedirs;
+    return true;
+}
+
+// Restores the command's redirections and forks the process moving the stage's output to its files
+pid_t fan_out_start(Command *command, FanOut *fan, PipeFD *pipes, int numCommands, Job *job)
+{
+    command->redirs = fan->redirs;
+    command->numRedirs = fan->numRedirs;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        job_child_setup(job->pgid, false);
+
+        // Drop every pipe end, or the stages around it would never see EOF
+        for (int j = 0; j < numCommands - 1; j++)
+        {
+            close(pipes[j].read_fd);
+            close(pipes[j].write_fd);
+        }
+        close(fan->writeFd);
+        fan_out_copy(fan->readFd, fan->outs, fan->numOuts);
+        _exit(0);
+    }
+    else if (pid < 0)
+    {
+        perror("fork failed");
+    }
+
+    close(fan->readFd);
+    close(fan->writeFd);
+    for (int k = 0; k < fan->numOuts; k++)
+        close(fan->outs[k]);
+    return pid;
+}
+
+// cat [file | -]...: concatenates through copy_fd, so file bytes never pass through user space
+int builtin_cat(char **args)
+{
+    int status = 0;
+    fflush(stdout); // Anything already printed goes first
+
+    if (args[1] == NULL)
+    {
+        if (copy_fd(STDIN_FILENO, STDOUT_FILENO) < 0)
+        {
+            perror("cat");
+            return 1;
+        }
+        return 0;
+    }
+
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        int fd = strcmp(args[i], "-") == 0 ? STDIN_FILENO : open(args[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            fprintf(stderr, "cat: %s: %s\n", args[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        if (copy_fd(fd, STDOUT_FILENO) < 0)
+        {
+            fprintf(stderr, "cat: %s: %s\n", args[i], strerror(errno));
+            status = 1;
+        }
+        if (fd != STDIN_FILENO)
+            close(fd);
+    }
+    return status;
+}
+
+// The builtin cat only takes file operands, anything with options goes to the real cat
+bool builtin_cat_handles(char **args)
+{
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (args[i][0] == '-' && args[i][1] != '\0')
+            return false;
+    }
+    return true;
+}
+
+int builtin_parallel(char **args); // With the parallel executor, which needs the whole pipeline machinery
+int builtin_remote(char **args);   // With the remote stages
+
+// Dispatch table, checked before looking a name up in PATH
+const Builtin builtins[] = {
+    {":", builtin_true},
+    {"true", builtin_true},
+    {"false", builtin_false},
+    {"echo", builtin_echo},
+    {"cd", builtin_cd},
+    {"pwd", builtin_pwd},
+    {"exit", builtin_exit},
+    {"export", builtin_export},
+    {"unset", builtin_unset},
+    {"hash", builtin_hash},
+    {"history", builtin_history},
+    {"pipesize", builtin_pipesize},
+    {"test", builtin_test},
+    {"[", builtin_test},
+    {"cat", builtin_cat, builtin_cat_handles},
+    {"jobs", builtin_jobs},
+    {"fg", builtin_fg},
+    {"bg", builtin_bg},
+    {"wait", builtin_wait},
+    {"parallel", builtin_parallel},
+    {"trace", builtin_trace},
+    {"stage", builtin_stage},
+    {"remote", builtin_remote},
+};
+
+// Returns the builtin that runs this argv, or NULL if it goes to an external command
+const Builtin *find_builtin(char **args)
+{
+    // Assignments alone have nothing to run, they behave like :
+    if (args[0] == NULL)
+        return &builtins[0];
+
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    {
+        if (strcmp(builtins[i].name, args[0]) == 0)
+            return builtins[i].handles == NULL || builtins[i].handles(args) ? &builtins[i] : NULL;
+    }
+    return NULL;
+}
+
+// Runs a builtin that makes up the whole pipeline inside the shell process, no child at all
+// Its redirections are applied to the shell's own fds and undone afterwards
+int run_builtin_inprocess(const Builtin *builtin, Command *command)
+{
+    int saved[10];       // Copies of the shell's fds 0-9, while redirected
+    bool touched[10] = {0}; // Which of them a redirection changed (a closed one has no copy)
+    int status = 1;
+
+    fflush(stdout);
+    fflush(stderr);
+    TRACE_BEGIN("redirect", command->numRedirs);
+    for (int r = 0; r < command->numRedirs; r++)
+    {
+        Redirect *redir = &command->redirs[r];
+        if (!touched[redir->fd])
+        {
+            saved[redir->fd] = fcntl(redir->fd, F_DUPFD_CLOEXEC, 10);
+            touched[redir->fd] = true;
+        }
+        if (apply_redirect(redir) < 0)
+        {
+            fprintf(stderr, "%s: %s\n", redir->target ? redir->target : redirect_error(redir), strerror(errno));
+            TRACE_END("redirect", -1);
+            goto restore;
+        }
+    }
+    TRACE_END("redirect", 0);
+
+    status = builtin->run(command->args);
+
+restore:
+    fflush(stdout);
+    fflush(stderr);
+    for (int fd = 0; fd < 10; fd++)
+    {
+        if (touched[fd] && saved[fd] >= 0)
+        {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+        }
+        else if (touched[fd])
+        {
+            close(fd);
+        }
+    }
+    return status;
+}
+
+// Backends available to launch each pipeline stage
+typedef enum
+{
+    SPAWN_POSIX, // posix_spawn() with file actions for pipes and redirections (default)
+    SPAWN_VFORK, // vfork() + execve(), the child only touches fds before exec
+    SPAWN_FORK,  // Classic fork() + execve(), kept as the fallback path
+    SPAWN_ZYGOTE // Requests to a small helper process forked at startup, which does the fork() + execve()
+} SpawnBackend;
+
+SpawnBackend spawnBackend = SPAWN_POSIX; // Selected with --spawn=posix|vfork|fork|zygote
+
+int run_node(struct Node *node, Arena *arena); // With execute_commands, groups need the whole executor
+
+// Launches stage i of the pipeline with fork(), setting up fds in the child
+// Builtins and ( list ) groups inside a pipeline also come through here: the child runs them instead of execve()
+pid_t spawn_stage_fork(Command *commands, int i, int numCommands, PipeFD *pipes, const Builtin *builtin, Job *job, const StageSetup *setup)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    { // Child process
+
+        // Join the job's process group and get the default signal dispositions back
+        job_child_setup(job->pgid, !job->background);
+
+        // A builtin or group may launch processes itself, but its requests would get mixed up with the shell's
+        if (zygoteFd >= 0)
+        {
+            close(zygoteFd);
+            zygoteFd = -1; // Stages it launches fall back to posix_spawn()
+            zygoteWatch = 0;
+        }
+        event_loop_close(); // Nor may it share the shell's ring or epoll set
+        sigchldWatch = 0;
+
+        // CPUs, priorities and limits of the stage
+        const char *failed = setup != NULL ? stage_setup_apply(setup) : NULL;
+        if (failed != NULL)
+        {
+            perror(failed);
+            exit(EXIT_FAILURE);
+        }
+
+
+        /* HANDLE WITH PIPE REDIRECTION */
+
+        // If not the first command, get input from the previous pipe
+        if (i != 0)
+        {
+            dup2(pipes[i - 1].read_fd, STDIN_FILENO); // Duplicate the read end of the previous pipe to stdin (file descriptor = 0)
+        }
+
+        // If not the last command, set output to the next pipe
+        if (i != numCommands - 1)
+        {
+            dup2(pipes[i].write_fd, STDOUT_FILENO); // Duplicate the write end of the next pipe to stdout (file descriptor = 1)
+        }
+
+        // The pipes are O_CLOEXEC, so execve() drops the originals by itself
+        // A builtin or group never gets there and must close them, or the readers of its pipes would never see EOF
+        if (builtin != NULL || commands[i].group != NULL)
+        {
+            for (int j = 0; j < numCommands - 1; j++)
+            {
+                close(pipes[j].read_fd);
+                close(pipes[j].write_fd);
+            }
+        }
+
+        /* HANDLE WITH INPUT/OUTPUT REDIRECTION */
+
+        // A forked child records into its own copy of the ring, only the trace_marker copy gets out
+        TRACE_BEGIN("redirect", commands[i].numRedirs);
+        for (int r = 0; r < commands[i].numRedirs; r++)
+        {
+            // Raw open()/dup3(), output modes create the file if it doesn't exist
+            if (apply_redirect(&commands[i].redirs[r]) < 0)
+            {
+                perror(redirect_error(&commands[i].redirs[r]));
+                exit(EXIT_FAILURE); // Exit the child process if file opening fails
+            }
+        }
+        TRACE_END("redirect", 0);
+
+        /* EXECUTING THE COMMAND */
+
+        if (builtin != NULL)
+        {
+            extern char **environ;
+            environ = commands[i].envp; // Prefix assignments are visible to the builtin's getenv()
+            exit(builtin->run(commands[i].args)); // exit() also flushes what the builtin printed
+        }
+        if (commands[i].group != NULL)
+        {
+            // A subshell: the list runs with the shell's state copied, no job control of its own
+            Arena arena = {NULL, NULL, NULL, 0};
+            job_enter_subshell();
+            exit(run_node(commands[i].group, &arena));
+        }
+
+        TRACE_MARK("execve", i);
+        if (execve(commands[i].path, commands[i].args, commands[i].envp) == -1)
+        {
+            perror("execve failed");
+
+            // If not the first command, stdin may be duplicated from a pipe.
+            if (i != 0)
+            {
+                close(STDIN_FILENO);
+            }
+
+            // If not the last command, stdout may be duplicated to a pipe.
+            if (i != numCommands - 1)
+            {
+                close(STDOUT_FILENO);
+            }
+
+            // Exit the child process if execve fails
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (pid < 0)
+    {
+        perror("fork failed");
+    }
+
+    return pid;
+}
+
+// Launches stage i of the pipeline with vfork()
+// The child shares our memory until execve(), so it must only touch fds and report errors through vforkErrno
+pid_t spawn_stage_vfork(Command *commands, int i, int numCommands, PipeFD *pipes, Job *job, const StageSetup *setup)
+{
+    static volatile int vforkErrno;       // errno of the failed step, written by the child
+    static const char *volatile vforkWhat; // Which step failed, written by the child
+
+    vforkErrno = 0;
+    vforkWhat = NULL;
+
+    pid_t pid = vfork();
+    if (pid == 0)
+    { // Child process, only async-signal-safe calls from here on
+
+        job_child_setup(job->pgid, !job->background);
+
+        if (setup != NULL && (vforkWhat = stage_setup_apply(setup)) != NULL)
+        {
+            vforkErrno = errno;
+            _exit(EXIT_FAILURE);
+        }
+
+        // Hook this stage into its pipes, the O_CLOEXEC originals vanish at execve()
+        if (i != 0)
+            dup2(pipes[i - 1].read_fd, STDIN_FILENO);
+        if (i != numCommands - 1)
+            dup2(pipes[i].write_fd, STDOUT_FILENO);
+
+        TRACE_BEGIN("redirect", commands[i].numRedirs);
+        for (int r = 0; r < commands[i].numRedirs; r++)
+        {
+            if (apply_redirect(&commands[i].redirs[r]) < 0)
+            {
+                vforkWhat = redirect_error(&commands[i].redirs[r]);
+                vforkErrno = errno;
+                TRACE_END("redirect", -1);
+                _exit(EXIT_FAILURE);
+            }
+        }
+        TRACE_END("redirect", 0);
+
+        TRACE_MARK("execve", i);
+        execve(commands[i].path, commands[i].args, commands[i].envp);
+        vforkWhat = "execve failed";
+        vforkErrno = errno;
+        _exit(EXIT_FAILURE);
+    }
+    else if (pid < 0)
+    {
+        perror("vfork failed");
+    }
+    else if (vforkWhat != NULL)
+    {
+        // The child already exited, report its failure from the parent
+        fprintf(stderr, "%s: %s\n", vforkWhat, strerror(vforkErrno));
+    }
+
+    return pid;
+}
+
+// Launches stage i of the pipeline with posix_spawn(), describing the fd setup as file actions
+pid_t spawn_stage_posix(Command *commands, int i, int numCommands, PipeFD *pipes, Job *job)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+
+    // Pipe redirection first, so explicit file redirections override it like in the fork path
+    // Only two dup2 actions per stage: the pipes are O_CLOEXEC, so no close actions are needed
+    if (i != 0)
+        posix_spawn_file_actions_adddup2(&actions, pipes[i - 1].read_fd, STDIN_FILENO);
+    if (i != numCommands - 1)
+        posix_spawn_file_actions_adddup2(&actions, pipes[i].write_fd, STDOUT_FILENO);
+
+    // Input/output redirections, opened directly onto their target fds
+    for (int r = 0; r < commands[i].numRedirs; r++)
+    {
+        Redirect *redir = &commands[i].redirs[r];
+        if (redir->kind == REDIR_DUP || redir->kind == REDIR_STRING || redir->kind == REDIR_HEREDOC)
+            posix_spawn_file_actions_adddup2(&actions, redir->srcFd, redir->fd);
+        else if (redir->kind == REDIR_CLOSE)
+            posix_spawn_file_actions_addclose(&actions, redir->fd);
+        else
+            posix_spawn_file_actions_addopen(&actions, redir->fd, redir->target, redirect_open_flags(redir->kind), 0666);
+    }
+
+    // The child starts with SIGCHLD unblocked, and under job control in the job's process group
+    // with the default dispositions of the signals the shell ignores
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    if (jobControl)
+    {
+        for (size_t s = 0; s < sizeof(jobSignals) / sizeof(jobSignals[0]); s++)
+            sigaddset(&mask, jobSignals[s]);
+        posix_spawnattr_setsigdefault(&attr, &mask);
+        posix_spawnattr_setpgroup(&attr, job->pgid);
+        flags |= POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP;
+#ifdef POSIX_SPAWN_TCSETPGROUP
+        if (!job->background)
+        {
+            posix_spawnattr_tcsetpgrp_np(&attr, STDIN_FILENO);
+            flags |= POSIX_SPAWN_TCSETPGROUP;
+        }
+#endif
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    pid_t pid;
+    int err = posix_spawn(&pid, commands[i].path, &actions, &attr, commands[i].args, commands[i].envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err != 0)
+    {
+        // Covers both a failed execve and a failed redirection open in the child
+        fprintf(stderr, "posix_spawn failed for %s: %s\n", commands[i].command, strerror(err));
+        return -1;
+    }
+
+    return pid;
+}
+
+/* ZYGOTE SPAWNER */
+
+#define ZYGOTE_MAX_FDS 10               // A request sets up the child's fds 0-9, the ones redirections can name
+#define ZYGOTE_MAX_REQUEST (128 * 1024) // Largest request, stages with more argv and environment are spawned directly
+
+// Header of a spawn request, followed by the path, the argv strings and the environment strings, each NUL-terminated
+// The descriptors travel alongside as SCM_RIGHTS, one for each entry of targets
+typedef struct
+{
+    pid_t pgid;                  // Process group to join under job control (0 founds a new one)
+    bool foreground;             // Give the terminal to that group
+    bool keptEnv;                // No environment strings follow, the copy the zygote kept is used
+    bool storeEnv;               // Keep the environment strings that follow for later requests
+    bool chdir;                  // The last descriptor passed is a directory to move the zygote to first
+    int numFds;                  // Descriptors passed along for the child
+    int targets[ZYGOTE_MAX_FDS]; // Child fd each passed descriptor becomes
+    int numArgs;                 // argv strings after the path
+    int numEnv;                  // Environment strings after argv
+} ZygoteRequest;
+
+long zygoteEnvGeneration = -1; // shellEnv.generation of the environment the zygote kept
+long zygoteCwdGeneration = 0;  // cwdGeneration of the zygote's working directory, it starts in ours
+
+// Builds a NULL-terminated vector of the count strings stored one after the other at *cursor, and moves past them
+char **zygote_unpack(char **cursor, int count)
+{
+    char **vector = malloc((count + 1) * sizeof(char *));
+    if (!vector)
+    {
+        perror("zygote: malloc failed");
+        _exit(EXIT_FAILURE);
+    }
+    for (int k = 0; k < count; k++)
+    {
+        vector[k] = *cursor;
+        *cursor += strlen(*cursor) + 1;
+    }
+    vector[count] = NULL;
+    return vector;
+}
+
+// Starts the program of a request with vfork(), in a frame of its own so no local of zygote_serve() lives across it
+// The child borrows our memory until execve(), so it only writes to lifted and execErrno
+// It dies with the zygote: the shell counts the zygote's processes as killed once it is gone, so none may linger
+// Returns the child (-1 with errno if vfork failed) and sets *execError to why execve() failed, 0 if it didn't
+__attribute__((noinline)) pid_t zygote_spawn(const ZygoteRequest *request, const char *path, char **argv, char **envp,
+                                             const int *fds, int numFds, int *execError)
+{
+    int lifted[ZYGOTE_MAX_FDS + 1];
+    static volatile int execErrno;
+    execErrno = 0;
+    pid_t self = getpid();
+    pid_t pid = vfork();
+    if (pid == 0)
+    { // Child process, only async-signal-safe calls from here on
+
+        // A zygote killed before this point has already handed us to another parent
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != self)
+            _exit(EXIT_FAILURE);
+        job_child_setup(request->pgid, request->foreground);
+
+        // Lift every received descriptor above fds 0-9 first, so placing one never clobbers another
+        // Whatever the request leaves out is closed, the zygote's own stdio may be stale by now
+        for (int k = 0; k < numFds; k++)
+            lifted[k] = fcntl(fds[k], F_DUPFD_CLOEXEC, ZYGOTE_MAX_FDS);
+        for (int fd = 0; fd < ZYGOTE_MAX_FDS; fd++)
+            close(fd);
+        for (int k = 0; k < numFds && k < request->numFds; k++)
+            dup2(lifted[k], request->targets[k]);
+
+        execve(path, argv, envp);
+        execErrno = errno;
+        _exit(EXIT_FAILURE);
+    }
+    *execError = execErrno;
+    return pid;
+}
+
+// Once the shell hung up, waits for the processes the zygote started before exiting, since they die with it
+// Its stdio goes to /dev/null meanwhile, so it holds none of the shell's terminal or pipes open
+void zygote_linger(void)
+{
+    int devNull = open("/dev/null", O_RDWR);
+    for (int fd = 0; devNull >= 0 && fd <= STDERR_FILENO; fd++)
+        dup2(devNull, fd);
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+        ;
+    _exit(EXIT_SUCCESS);
+}
+
+// Main loop of the zygote: starts the program of each request and reports on every process it started,
+// until the shell hangs up. It lives in the small address space the shell had at startup, so starting a child stays cheap
+void zygote_serve(int sock)
+{
+    char *buffer = malloc(ZYGOTE_MAX_REQUEST + 1);
+    char *keptStrings = NULL; // Environment stored by the last request with storeEnv
+    char **keptEnv = NULL;
+    if (!buffer)
+    {
+        perror("zygote: malloc failed");
+        _exit(EXIT_FAILURE);
+    }
+
+    for (;;)
+    {
+        // Children that stopped, continued or exited since the last round, SIGCHLD is blocked here too
+        struct signalfd_siginfo info;
+        while (read(sigchldFd, &info, sizeof(info)) > 0)
+            ;
+        ZygoteEvent event;
+        memset(&event, 0, sizeof(event));
+        while ((event.pid = wait4(-1, &event.status, WNOHANG | WUNTRACED | WCONTINUED, &event.usage)) > 0)
+            send(sock, &event, sizeof(event), MSG_NOSIGNAL);
+
+        struct pollfd pfds[2] = {{sock, POLLIN, 0}, {sigchldFd, POLLIN, 0}};
+        if (poll(pfds, 2, -1) < 0 && errno != EINTR)
+            _exit(EXIT_FAILURE);
+        if (!(pfds[0].revents & (POLLIN | POLLHUP)))
+            continue;
+
+        ZygoteRequest request;
+        int fds[ZYGOTE_MAX_FDS + 1];
+        char control[CMSG_SPACE(sizeof(fds))];
+        struct iovec iov[2] = {{&request, sizeof(request)}, {buffer, ZYGOTE_MAX_REQUEST}};
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2, .msg_control = control, .msg_controllen = sizeof(control)};
+        ssize_t bytes = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes < (ssize_t)sizeof(request))
+            zygote_linger(); // The shell is gone
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        int numFds = 0;
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            numFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), numFds * sizeof(int));
+        }
+        size_t dataLen = bytes - sizeof(request);
+        buffer[dataLen] = '\0';
+
+        // The shell changed directory since the last request, later ones stay there too
+        if (request.chdir && numFds > 0)
+        {
+            if (fchdir(fds[--numFds]) < 0)
+                perror("zygote: fchdir failed");
+            close(fds[numFds]);
+        }
+
+        char *cursor = buffer;
+        char *path = cursor;
+        cursor += strlen(path) + 1;
+        char **argv = zygote_unpack(&cursor, request.numArgs);
+        char **envp = keptEnv;
+        if (request.storeEnv)
+        {
+            size_t envLen = buffer + dataLen - cursor;
+            free(keptStrings);
+            free(keptEnv);
+            keptStrings = malloc(envLen + 1);
+            if (!keptStrings)
+            {
+                perror("zygote: malloc failed");
+                _exit(EXIT_FAILURE);
+            }
+            memcpy(keptStrings, cursor, envLen + 1);
+            cursor = keptStrings;
+            envp = keptEnv = zygote_unpack(&cursor, request.numEnv);
+        }
+        else if (!request.keptEnv)
+        {
+            envp = zygote_unpack(&cursor, request.numEnv);
+        }
+
+        ZygoteEvent reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.spawned = true;
+        int execErrno;
+        reply.pid = zygote_spawn(&request, path, argv, envp, fds, numFds, &execErrno);
+        if (reply.pid < 0)
+        {
+            reply.status = errno;
+        }
+        else if (execErrno != 0)
+        {
+            // The child already exited, tell its stderr why
+            for (int k = 0; k < numFds && k < request.numFds; k++)
+            {
+                if (request.targets[k] == STDERR_FILENO)
+                    dprintf(fds[k], "execve failed: %s\n", strerror(execErrno));
+            }
+        }
+        if (reply.pid > 0 && jobControl)
+        {
+            // From this side too, so the group exists by the time the shell hands it the terminal
+            setpgid(reply.pid, request.pgid ? request.pgid : reply.pid);
+        }
+        send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+
+        for (int k = 0; k < numFds; k++)
+            close(fds[k]);
+        free(argv);
+        if (envp != keptEnv)
+            free(envp);
+    }
+}
+
+// Forks the zygote while the shell is still small, before its caches and arenas grow
+void zygote_start(void)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+    {
+        perror("socketpair failed");
+        exit(EXIT_FAILURE);
+    }
+
+    zygotePid = fork();
+    if (zygotePid < 0)
+    {
+        perror("fork failed");
+        exit(EXIT_FAILURE);
+    }
+    if (zygotePid == 0)
+    {
+        close(sv[0]);
+        zygote_serve(sv[1]);
+    }
+    close(sv[1]);
+    zygoteFd = sv[0];
+}
+
+// Hangs up on the zygote, which exits once it reads the end of the socket and the processes it started are done
+// Background jobs may run on long after the shell, so it is not waited for
+void zygote_stop(void)
+{
+    if (zygoteFd >= 0)
+        close(zygoteFd);
+    zygoteFd = -1;
+}
+
+// Launches stage i of the pipeline through the zygote
+// The shell resolves the stage's whole fd setup itself, opening the redirection files, and passes what each
+// of the child's fds 0-9 ends up as. *viaZygote tells whether the zygote or the posix_spawn() fallback started it
+pid_t spawn_stage_zygote(Command *commands, int i, int numCommands, PipeFD *pipes, Job *job, bool *viaZygote)
+{
+    Command *command = &commands[i];
+    ZygoteRequest request;
+    memset(&request, 0, sizeof(request));
+    request.pgid = job->pgid;
+    request.foreground = !job->background;
+
+    // The shared environment is sent only when it changed since the zygote kept a copy
+    bool shared = command->envp == shellEnv.vars;
+    request.keptEnv = shared && zygoteEnvGeneration == shellEnv.generation;
+    request.storeEnv = shared && !request.keptEnv;
+
+    size_t dataLen = strlen(command->path) + 1;
+    for (char **arg = command->args; *arg != NULL; arg++, request.numArgs++)
+        dataLen += strlen(*arg) + 1;
+    for (char **var = command->envp; !request.keptEnv && *var != NULL; var++, request.numEnv++)
+        dataLen += strlen(*var) + 1;
+
+    *viaZygote = zygoteFd >= 0 && dataLen <= ZYGOTE_MAX_REQUEST;
+    if (!*viaZygote)
+        return spawn_stage_posix(commands, i, numCommands, pipes, job);
+
+    // Our descriptor each child fd gets: stdio to begin with, -2 for the others (our fd of the same number,
+    // which >&N may still name), -1 once closed
+    int map[ZYGOTE_MAX_FDS];
+    for (int fd = 0; fd < ZYGOTE_MAX_FDS; fd++)
+        map[fd] = fd <= STDERR_FILENO ? fd : -2;
+    if (i != 0)
+        map[STDIN_FILENO] = pipes[i - 1].read_fd;
+    if (i != numCommands - 1)
+        map[STDOUT_FILENO] = pipes[i].write_fd;
+
+    int opened[command->numRedirs + 1]; // Files opened for the redirections, closed once the request is sent
+    int numOpened = 0;
+    for (int r = 0; r < command->numRedirs; r++)
+    {
+        Redirect *redir = &command->redirs[r];
+        int fd;
+        switch (redir->kind)
+        {
+        case REDIR_CLOSE:
+            fd = -1;
+            break;
+        case REDIR_STRING:
+        case REDIR_HEREDOC:
+            fd = redir->srcFd; // Our descriptor holding the text
+            break;
+        case REDIR_DUP:
+            fd = redir->srcFd < ZYGOTE_MAX_FDS ? map[redir->srcFd] : redir->srcFd;
+            if (fd == -2)
+                fd = redir->srcFd;
+            if (fd < 0 || fcntl(fd, F_GETFD) < 0)
+            {
+                errno = EBADF;
+                fd = -1;
+            }
+            break;
+        default:
+            // The hints stick to the open file, which the zygote passes on as it is
+            fd = redirect_open(redir);
+            if (fd >= 0)
+                opened[numOpened++] = fd;
+            break;
+        }
+        if (fd < 0 && redir->kind != REDIR_CLOSE)
+        {
+            fprintf(stderr, "%s: %s\n", redirect_error(redir), strerror(errno));
+            for (int k = 0; k < numOpened; k++)
+                close(opened[k]);
+            return -1;
+        }
+        map[redir->fd] = fd;
+    }
+
+    int fds[ZYGOTE_MAX_FDS + 1];
+    int numFds = 0;
+    for (int fd = 0; fd < ZYGOTE_MAX_FDS; fd++)
+    {
+        if (map[fd] >= 0)
+        {
+            request.targets[numFds] = fd;
+            fds[numFds++] = map[fd];
+        }
+    }
+    request.numFds = numFds;
+
+    // After a cd the zygote follows us into the new directory once, through a descriptor of it
+    int cwdFd = -1;
+    if (zygoteCwdGeneration != cwdGeneration && (cwdFd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) >= 0)
+    {
+        request.chdir = true;
+        fds[numFds++] = cwdFd;
+    }
+
+    char *data = malloc(dataLen);
+    if (!data)
+    {
+        perror("Failed to allocate memory for a spawn request");
+        exit(EXIT_FAILURE);
+    }
+    char *cursor = data;
+    cursor = stpcpy(cursor, command->path) + 1;
+    for (char **arg = command->args; *arg != NULL; arg++)
+        cursor = stpcpy(cursor, *arg) + 1;
+    for (char **var = command->envp; !request.keptEnv && *var != NULL; var++)
+        cursor = stpcpy(cursor, *var) + 1;
+
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov[2] = {{&request, sizeof(request)}, {data, dataLen}};
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+    if (numFds > 0)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(numFds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(numFds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, numFds * sizeof(int));
+    }
+    ssize_t sent = sendmsg(zygoteFd, &msg, MSG_NOSIGNAL);
+    free(data);
+    for (int k = 0; k < numOpened; k++)
+        close(opened[k]);
+    if (cwdFd >= 0)
+        close(cwdFd);
+
+    // Reports about earlier processes may come before the reply
+    ZygoteEvent event;
+    ssize_t bytes = -1;
+    while (sent >= 0 && ((bytes = recv(zygoteFd, &event, sizeof(event), 0)) == sizeof(event) || (bytes < 0 && errno == EINTR)))
+    {
+        if (bytes < 0)
+            continue;
+        if (event.spawned)
+            break;
+        zygote_event_apply(&event);
+    }
+    if (bytes != sizeof(event))
+    {
+        // A request that never reached the zygote is spawned from the shell like every later stage; one that did
+        // may have started the program before the zygote died, and running it again could run it twice
+        zygote_lost();
+        *viaZygote = false;
+        if (sent < 0)
+            return spawn_stage_posix(commands, i, numCommands, pipes, job);
+        fprintf(stderr, "%s: the zygote exited while starting it\n", command->args[0]);
+        return -1;
+    }
+
+    if (event.pid < 0)
+    {
+        fprintf(stderr, "fork failed: %s\n", strerror(event.status));
+        return -1;
+    }
+    if (request.storeEnv)
+        zygoteEnvGeneration = shellEnv.generation;
+    if (request.chdir)
+        zygoteCwdGeneration = cwdGeneration;
+    return event.pid;
+}
+
+/* REMOTE STAGES (@host cmd) */
+
+#define REMOTE_PORT "7070"       // Agent port when an address has none
+#define REMOTE_MAX_CONNS 32      // Connections kept to agents, busy and idle
+#define REMOTE_MAX_FRAME (1 << 20) // Largest payload sent in one frame
+#define REMOTE_MAX_TOKEN 256       // Room for MINISHELL_AGENT_TOKEN and its NUL
+#define REMOTE_ZCHUNK (64 * 1024)  // Bytes compressed per frame
+
+// Kinds of frame on an agent connection; a stage is RUN, DATA... EOF one way and DATA/ERR... EXIT the other
+enum
+{
+    FRAME_HELLO = 1, // First frame of a connection: MINISHELL_AGENT_TOKEN, which the agent must share
+    FRAME_RUN,       // argv of the program to start, NUL-separated; FRAME_COMPRESSED asks for compressed output
+    FRAME_DATA,      // Bytes for the program's stdin, or from its stdout
+    FRAME_ERR,       // Bytes from the program's stderr
+    FRAME_EOF,       // End of the program's stdin
+    FRAME_EXIT       // The program's wait status, after its stdout and stderr ended
+};
+
+#define FRAME_COMPRESSED 1 // Payload is a 4-byte raw length and the zlib stream of the bytes
+
+// Header of every frame, sent in host byte order since both ends run this same code
+typedef struct
+{
+    uint8_t type;    // FRAME_*
+    uint8_t flags;   // FRAME_COMPRESSED
+    uint16_t unused;
+    uint32_t length; // Payload bytes after the header
+} RemoteFrame;
+
+// A connection to an agent, reused by later stages for the same address once its stage is done
+typedef struct
+{
+    int fd;            // Socket, -1 for a free slot
+    pid_t pid;         // Relay process using it, 0 while idle
+    bool reusable;     // Written by the relay when its stage ended cleanly, in memory it shares with the shell
+    char address[108]; // Address as written after the @
+} RemoteConn;
+
+RemoteConn *remoteConns = NULL; // REMOTE_MAX_CONNS slots in a shared mapping, NULL until the first remote stage
+bool remoteCompress = false;    // remote compress on: stage data travels deflated both ways
+char *agentAddress = NULL;      // --agent=ADDRESS: serve remote stages there instead of reading commands
+
+// Writes all of the len bytes, returns false on an error
+bool write_all(int fd, const void *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t put = write(fd, data, len);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            return false;
+        data = (const char *)data + put;
+        len -= put;
+    }
+    return true;
+}
+
+// Reads exactly len bytes, returns false on an error or an early end
+bool read_all(int fd, void *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t got = read(fd, data, len);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        data = (char *)data + got;
+        len -= got;
+    }
+    return true;
+}
+
+// Sends a frame whose payload is in memory
+bool frame_send(int sock, int type, int flags, const void *payload, size_t len)
+{
+    RemoteFrame frame = {type, flags, 0, len};
+    struct iovec parts[2] = {{&frame, sizeof(frame)}, {(void *)payload, len}};
+    ssize_t put;
+    while ((put = writev(sock, parts, len > 0 ? 2 : 1)) < 0 && errno == EINTR)
+        ;
+    if (put < 0)
+        return false;
+
+    // Whatever a short write left over
+    size_t done = put;
+    if (done < sizeof(frame))
+        return write_all(sock, (char *)&frame + done, sizeof(frame) - done) && write_all(sock, payload, len);
+    return write_all(sock, (const char *)payload + (done - sizeof(frame)), len - (done - sizeof(frame)));
+}
+
+// Sends what can be read from fd right now as one DATA/ERR frame, spliced from a pipe when uncompressed
+// Returns the bytes sent, 0 at the end of fd, -1 if the connection failed
+ssize_t frame_send_from(int fd, int sock, int type, bool compress)
+{
+    static char buffer[REMOTE_MAX_FRAME];
+    int available = 0;
+    struct stat st;
+    if (!compress && fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode) && ioctl(fd, FIONREAD, &available) == 0 && available > 0)
+    {
+        // Kernel to kernel: the header, then the pipe's bytes straight into the socket
+        size_t len = available < REMOTE_MAX_FRAME ? available : REMOTE_MAX_FRAME;
+        RemoteFrame frame = {type, 0, 0, len};
+        return write_all(sock, &frame, sizeof(frame)) && splice_exactly(fd, sock, len) ? (ssize_t)len : -1;
+    }
+
+    ssize_t got;
+    while ((got = read(fd, buffer, compress ? REMOTE_ZCHUNK : sizeof(buffer))) < 0 && errno == EINTR)
+        ;
+    if (got <= 0)
+        return 0; // A read error ends the stream like its end
+#ifdef MINISHELL_ZLIB
+    if (compress)
+    {
+        static unsigned char packed[4 + REMOTE_ZCHUNK + REMOTE_ZCHUNK / 8 + 64];
+        uLongf packedLen = sizeof(packed) - 4;
+        uint32_t rawLen = got;
+        memcpy(packed, &rawLen, 4);
+        if (compress2(packed + 4, &packedLen, (const Bytef *)buffer, got, 1) == Z_OK)
+            return frame_send(sock, type, FRAME_COMPRESSED, packed, 4 + packedLen) ? got : -1;
+    }
+#endif
+    return frame_send(sock, type, 0, buffer, got) ? got : -1;
+}
+
+// Moves the len-byte payload of a frame from the socket to out, or drops it once out is gone (*open cleared)
+// Returns false if the connection failed
+bool frame_forward(int sock, int out, size_t len, int flags, bool *open)
+{
+    static char buffer[REMOTE_MAX_FRAME];
+    if (flags & FRAME_COMPRESSED)
+    {
+#ifdef MINISHELL_ZLIB
+        static char raw[REMOTE_ZCHUNK];
+        uint32_t rawLen;
+        uLongf rawSize = sizeof(raw);
+        if (len < 4 || len > sizeof(buffer) || !read_all(sock, buffer, len))
+            return false;
+        memcpy(&rawLen, buffer, 4);
+        if (uncompress((Bytef *)raw, &rawSize, (const Bytef *)buffer + 4, len - 4) != Z_OK || rawSize != rawLen)
+            return false;
+        if (*open && !write_all(out, raw, rawSize))
+            *open = false;
+        return true;
+#else
+        return false; // The agent only compresses when asked, which a build without zlib never does
+#endif
+    }
+
+    while (len > 0 && *open)
+    {
+        // Socket to pipe without user space when out is a pipe
+        ssize_t moved = splice(sock, NULL, out, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved < 0 && errno == EINTR)
+            continue;
+        if (moved < 0 && errno == EINVAL)
+        {
+            ssize_t got = read(sock, buffer, len < sizeof(buffer) ? len : sizeof(buffer));
+            if (got <= 0)
+                return false;
+            if (!write_all(out, buffer, got))
+                *open = false;
+            len -= got;
+            continue;
+        }
+        if (moved == 0)
+            return false;
+        if (moved < 0)
+        {
+            // EPIPE and the like: the reader is gone, the rest of the stream is dropped
+            *open = false;
+            break;
+        }
+        len -= moved;
+    }
+    while (len > 0)
+    {
+        ssize_t got = read(sock, buffer, len < sizeof(buffer) ? len : sizeof(buffer));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        len -= got;
+    }
+    return true;
+}
+
+// Opens a stream socket to a Unix socket path (any address with a /) or to HOST[:PORT]
+// With listen, binds and listens on it instead; returns -1 after printing why
+int remote_socket(const char *address, bool listening)
+{
+    if (strchr(address, '/') != NULL)
+    {
+        struct sockaddr_un un = {AF_UNIX, {0}};
+        if (strlen(address) >= sizeof(un.sun_path))
+        {
+            fprintf(stderr, "%s: address too long\n", address);
+            return -1;
+        }
+        strcpy(un.sun_path, address);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listening)
+            unlink(address); // A socket left by an agent that is gone
+        if (fd < 0 || (listening ? bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0 || listen(fd, 64) < 0
+                                 : connect(fd, (struct sockaddr *)&un, sizeof(un)) < 0))
+        {
+            perror(address);
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // HOST[:PORT], an empty HOST listens on every interface
+    char host[256];
+    const char *colon = strrchr(address, ':');
+    size_t hostLen = colon != NULL ? (size_t)(colon - address) : strlen(address);
+    snprintf(host, sizeof(host), "%.*s", (int)hostLen, address);
+    struct addrinfo hints = {0}, *found;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    int err = getaddrinfo(host[0] != '\0' ? host : NULL, colon != NULL ? colon + 1 : REMOTE_PORT, &hints, &found);
+    if (err != 0)
+    {
+        fprintf(stderr, "%s: %s\n", address, gai_strerror(err));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = found; ai != NULL && fd < 0; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        int on = 1;
+        if (fd >= 0 && listening)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (fd >= 0 && (listening ? bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 || listen(fd, 64) < 0
+                                  : connect(fd, ai->ai_addr, ai->ai_addrlen) < 0))
+        {
+            close(fd);
+            fd = -1;
+        }
+        // Frames are written header first, which must not wait for an ACK
+        if (fd >= 0)
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    if (fd < 0)
+        fprintf(stderr, "%s: %s\n", address, strerror(errno));
+    freeaddrinfo(found);
+    return fd;
+}
+
+// Takes an idle connection to the address, or opens one; returns its slot, -1 after printing why
+int remote_acquire(const char *address)
+{
+    if (remoteConns == NULL)
+    {
+        // Shared with the relays, which report through it that their connection is still in step
+        remoteConns = mmap(NULL, REMOTE_MAX_CONNS * sizeof(RemoteConn), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (remoteConns == MAP_FAILED)
+        {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        for (int k = 0; k < REMOTE_MAX_CONNS; k++)
+            remoteConns[k].fd = -1;
+    }
+
+    int freeSlot = -1;
+    for (int k = 0; k < REMOTE_MAX_CONNS; k++)
+    {
+        RemoteConn *conn = &remoteConns[k];
+        if (conn->fd < 0)
+        {
+            freeSlot = freeSlot < 0 ? k : freeSlot;
+            continue;
+        }
+        if (conn->pid != 0 || strcmp(conn->address, address) != 0)
+            continue;
+
+        // An idle connection has nothing to say, anything readable means the agent closed it
+        struct pollfd idle = {conn->fd, POLLIN, 0};
+        if (poll(&idle, 1, 0) == 0)
+            return k;
+        close(conn->fd);
+        conn->fd = -1;
+        freeSlot = freeSlot < 0 ? k : freeSlot;
+    }
+    if (freeSlot < 0)
+    {
+        fprintf(stderr, "%s: too many remote connections\n", address);
+        return -1;
+    }
+    if (strlen(address) >= sizeof(remoteConns[0].address))
+    {
+        fprintf(stderr, "%s: address too long\n", address);
+        return -1;
+    }
+
+    int fd = remote_socket(address, false);
+    const char *token = getenv("MINISHELL_AGENT_TOKEN");
+    if (fd < 0 || !frame_send(fd, FRAME_HELLO, 0, token ? token : "", token ? strlen(token) : 0))
+    {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    RemoteConn *conn = &remoteConns[freeSlot];
+    conn->fd = fd;
+    conn->pid = 0;
+    strcpy(conn->address, address);
+    return freeSlot;
+}
+
+// Called as each stage is reaped: a relay's connection goes back to the pool, or is closed if it lost step
+void remote_stage_done(pid_t pid)
+{
+    for (int k = 0; remoteConns != NULL && k < REMOTE_MAX_CONNS; k++)
+    {
+        RemoteConn *conn = &remoteConns[k];
+        if (conn->fd < 0 || conn->pid != pid)
+            continue;
+        if (!conn->reusable)
+        {
+            close(conn->fd);
+            conn->fd = -1;
+        }
+        conn->pid = 0;
+        conn->reusable = false;
+    }
+}
+
+// A subshell keeps its own pool, the shell's connections stay with the shell
+void remote_forget(void)
+{
+    remoteConns = NULL;
+}
+
+// Sends everything on fd as DATA frames, then EOF; the half of a connection that runs in a process of its own,
+// so that neither end ever blocks writing while the other waits for it to read. Returns false if the connection failed
+// SIGTERM only stops it while it waits for fd, between two frames, so the connection stays in step
+bool frame_pump(int fd, int sock, bool compress)
+{
+    sigset_t term, waiting;
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    signal(SIGTERM, SIG_DFL);
+    sigprocmask(SIG_BLOCK, &term, &waiting);
+    sigdelset(&waiting, SIGTERM);
+
+    while (1)
+    {
+        struct pollfd ready = {fd, POLLIN, 0};
+        if (ppoll(&ready, 1, NULL, &waiting) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        ssize_t sent = frame_send_from(fd, sock, FRAME_DATA, compress);
+        if (sent <= 0)
+            return sent == 0 && frame_send(sock, FRAME_EOF, 0, NULL, 0);
+    }
+}
+
+// Runs a stage on the agent behind the slot's connection with our stdin and stdout (already set up)
+// Runs in the stage's child; returns the exit status the program had there
+int remote_relay(int slot, char **args)
+{
+    RemoteConn *conn = &remoteConns[slot];
+    int sock = conn->fd;
+    signal(SIGPIPE, SIG_IGN); // A reader that goes away shows as EPIPE, the stream still has to be drained
+
+    StrBuf argv = {NULL, NULL, 0, 0};
+    Arena arena = {NULL, NULL, NULL, 0};
+    argv.arena = &arena;
+    for (int a = 0; args[a] != NULL; a++)
+        strbuf_append(&argv, args[a], strlen(args[a]) + 1);
+    if (!frame_send(sock, FRAME_RUN, remoteCompress ? FRAME_COMPRESSED : 0, argv.data, argv.len))
+    {
+        fprintf(stderr, "%s: connection lost\n", conn->address);
+        return 255;
+    }
+
+    // Our stdin goes out from a second process while this one takes the output in
+    pid_t pump = fork();
+    if (pump == 0)
+        _exit(frame_pump(STDIN_FILENO, sock, remoteCompress) ? 0 : 1);
+    if (pump < 0)
+    {
+        perror("fork failed");
+        return 255;
+    }
+
+    bool outOpen = true, errOpen = true;
+    int status = -1;
+    RemoteFrame frame;
+    while (status < 0 && outOpen && read_all(sock, &frame, sizeof(frame)))
+    {
+        if (frame.type == FRAME_EXIT)
+        {
+            int32_t value;
+            if (frame.length != sizeof(value) || !read_all(sock, &value, sizeof(value)))
+                break;
+            status = value;
+        }
+        else if (frame.type == FRAME_DATA || frame.type == FRAME_ERR)
+        {
+            bool *open = frame.type == FRAME_DATA ? &outOpen : &errOpen;
+            if (!frame_forward(sock, frame.type == FRAME_DATA ? STDOUT_FILENO : STDERR_FILENO, frame.length, frame.flags, open))
+                break;
+        }
+        else
+            break;
+    }
+
+    // A program that is done with its stdin before we are: the pump stops between two frames and the EOF is ours to send
+    int pumped;
+    bool stopped = false;
+    if (waitpid(pump, &pumped, WNOHANG) == 0)
+    {
+        kill(pump, SIGTERM);
+        waitpid(pump, &pumped, 0);
+        stopped = WIFSIGNALED(pumped) && WTERMSIG(pumped) == SIGTERM;
+    }
+    if (!outOpen)
+        return 128 + SIGPIPE; // Our reader is gone, the program is cut off like a local one would be
+    if (status < 0)
+    {
+        fprintf(stderr, "%s: connection lost\n", conn->address);
+        return 255;
+    }
+    conn->reusable = (WIFEXITED(pumped) && WEXITSTATUS(pumped) == 0) || (stopped && frame_send(sock, FRAME_EOF, 0, NULL, 0));
+    return exit_code(status);
+}
+
+// Launches stage i on the agent named after its @, through a relay child that joins the pipeline in its place
+// The relay has the stage's pipes and local redirections, so the rest of the pipeline doesn't see a difference
+pid_t spawn_stage_remote(Command *commands, int i, int numCommands, PipeFD *pipes, Job *job)
+{
+    int slot = remote_acquire(commands[i].remote);
+    if (slot < 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        job_child_setup(job->pgid, !job->background);
+        if (i != 0)
+            dup2(pipes[i - 1].read_fd, STDIN_FILENO);
+        if (i != numCommands - 1)
+            dup2(pipes[i].write_fd, STDOUT_FILENO);
+        // No execve() to drop the O_CLOEXEC pipes, their readers must still see EOF
+        for (int j = 0; j < numCommands - 1; j++)
+        {
+            close(pipes[j].read_fd);
+            close(pipes[j].write_fd);
+        }
+        for (int r = 0; r < commands[i].numRedirs; r++)
+        {
+            if (apply_redirect(&commands[i].redirs[r]) < 0)
+            {
+                perror(redirect_error(&commands[i].redirs[r]));
+                _exit(EXIT_FAILURE);
+            }
+        }
+        _exit(remote_relay(slot, commands[i].args));
+    }
+    if (pid < 0)
+    {
+        perror("fork failed");
+        return -1;
+    }
+    remoteConns[slot].pid = pid;
+    remoteConns[slot].reusable = false;
+    return pid;
+}
+
+// Runs one stage for a client: the program with pipes for its stdio, relayed against the connection's frames
+// Its stdin is fed by a second process, so the program's output never waits behind its input; returns false when the connection is gone
+bool agent_run(int sock, char *argvBlock, size_t len, bool compress)
+{
+    // One argument per NUL, empty ones included; the block is NUL-terminated past len
+    int argc = 0;
+    for (size_t at = 0; at < len; at += strlen(argvBlock + at) + 1)
+        argc++;
+    char **args = malloc((argc + 1) * sizeof(char *));
+    if (!args)
+    {
+        perror("agent: malloc");
+        return false;
+    }
+    argc = 0;
+    for (size_t at = 0; at < len; at += strlen(argvBlock + at) + 1)
+        args[argc++] = argvBlock + at;
+    args[argc] = NULL;
+
+    int in[2], out[2], err[2];
+    if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0 || pipe2(err, O_CLOEXEC) < 0)
+    {
+        perror("agent: pipe");
+        free(args);
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        signal(SIGPIPE, SIG_DFL);
+        execvp(args[0], args);
+        fprintf(stderr, "%s: %s\n", args[0], errno == ENOENT ? "command not found" : strerror(errno));
+        _exit(errno == ENOENT ? 127 : 126);
+    }
+    free(args);
+    close(in[0]);
+    close(out[1]);
+    close(err[1]);
+
+    // The client's DATA frames go to the program until its EOF, the rest is dropped once the program stops reading
+    pid_t feeder = fork();
+    if (feeder == 0)
+    {
+        close(out[0]);
+        close(err[0]);
+        RemoteFrame frame;
+        bool open = true;
+        while (read_all(sock, &frame, sizeof(frame)) && frame.type == FRAME_DATA)
+        {
+            if (!frame_forward(sock, in[1], frame.length, frame.flags, &open))
+                _exit(1);
+        }
+        _exit(frame.type == FRAME_EOF ? 0 : 1);
+    }
+    close(in[1]);
+
+    int fds[2] = {out[0], err[0]};
+    bool alive = feeder > 0;
+    while (alive && (fds[0] >= 0 || fds[1] >= 0))
+    {
+        struct pollfd ready[2] = {{fds[0], POLLIN, 0}, {fds[1], POLLIN, 0}};
+        if (poll(ready, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (int k = 0; k < 2 && alive; k++)
+        {
+            if (ready[k].revents == 0)
+                continue;
+            ssize_t sent = frame_send_from(fds[k], sock, k == 0 ? FRAME_DATA : FRAME_ERR, compress);
+            alive = sent >= 0;
+            if (sent == 0)
+            {
+                close(fds[k]);
+                fds[k] = -1;
+            }
+        }
+    }
+    for (int k = 0; k < 2; k++)
+    {
+        if (fds[k] >= 0)
+            close(fds[k]);
+    }
+
+    // Its output is all sent, its status follows; a client that went away in the middle takes the program with it
+    int status;
+    if (!alive)
+        kill(pid, SIGHUP);
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    int32_t value = status;
+    alive = alive && frame_send(sock, FRAME_EXIT, 0, &value, sizeof(value));
+
+    // The next RUN comes after the client's EOF, which the feeder reads
+    int fed = 1;
+    if (feeder > 0)
+    {
+        if (!alive)
+            kill(feeder, SIGKILL);
+        waitpid(feeder, &fed, 0);
+    }
+    return alive && WIFEXITED(fed) && WEXITSTATUS(fed) == 0;
+}
+
+// Serves one client connection, one stage after the other until it closes
+void agent_session(int sock)
+{
+    // The client must share our token (agent_serve only lets a Unix socket go without one)
+    RemoteFrame frame;
+    char token[REMOTE_MAX_TOKEN] = {0};
+    const char *expected = getenv("MINISHELL_AGENT_TOKEN");
+    expected = expected ? expected : "";
+    if (!read_all(sock, &frame, sizeof(frame)) || frame.type != FRAME_HELLO || frame.length >= sizeof(token) ||
+        !read_all(sock, token, frame.length))
+        return;
+    token[frame.length] = '\0';
+
+    // Compared in constant time, so the time to a refusal tells nothing about how much of the token was right
+    size_t expectedLen = strlen(expected);
+    unsigned char diff = frame.length != expectedLen;
+    for (size_t k = 0; k < sizeof(token); k++)
+        diff |= (unsigned char)token[k] ^ (unsigned char)(k < expectedLen ? expected[k] : 0);
+    if (diff != 0)
+    {
+        fprintf(stderr, "agent: client with a wrong token\n");
+        return;
+    }
+
+    while (read_all(sock, &frame, sizeof(frame)))
+    {
+        if (frame.type != FRAME_RUN || frame.length == 0 || frame.length > REMOTE_MAX_FRAME)
+            return;
+        char *argvBlock = malloc(frame.length + 1);
+        bool ok = argvBlock != NULL && read_all(sock, argvBlock, frame.length);
+        if (ok)
+        {
+            argvBlock[frame.length] = '\0';
+            ok = agent_run(sock, argvBlock, frame.length, frame.flags & FRAME_COMPRESSED);
+        }
+        free(argvBlock);
+        if (!ok)
+            return;
+    }
+}
+
+// --agent=ADDRESS: accepts minishells' remote stages on ADDRESS, one process per connection
+int agent_serve(const char *address)
+{
+    // Anyone who can connect runs any program: over TCP that needs a token, a Unix socket has its file permissions
+    const char *token = getenv("MINISHELL_AGENT_TOKEN");
+    if (strchr(address, '/') == NULL && (token == NULL || token[0] == '\0'))
+    {
+        fprintf(stderr, "agent: a TCP agent needs MINISHELL_AGENT_TOKEN set on both sides\n");
+        return EXIT_FAILURE;
+    }
+    if (token != NULL && strlen(token) >= REMOTE_MAX_TOKEN)
+    {
+        fprintf(stderr, "agent: MINISHELL_AGENT_TOKEN is longer than %d bytes\n", REMOTE_MAX_TOKEN - 1);
+        return EXIT_FAILURE;
+    }
+
+    int listener = remote_socket(address, true);
+    if (listener < 0)
+        return EXIT_FAILURE;
+    signal(SIGCHLD, SIG_IGN); // Sessions are reaped by the kernel
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "agent: listening on %s\n", address);
+
+    while (1)
+    {
+        int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("agent: accept");
+            return EXIT_FAILURE;
+        }
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(listener);
+            signal(SIGCHLD, SIG_DFL); // The session waits for its programs itself
+            agent_session(sock);
+            _exit(0);
+        }
+        if (pid < 0)
+            perror("agent: fork");
+        close(sock);
+    }
+}
+
+// remote [close|compress on|off]: lists the agent connections, closes the idle ones or switches compression
+int builtin_remote(char **args)
+{
+    if (args[1] == NULL)
+    {
+        for (int k = 0; remoteConns != NULL && k < REMOTE_MAX_CONNS; k++)
+        {
+            if (remoteConns[k].fd >= 0)
+                printf("%s\t%s\n", remoteConns[k].address, remoteConns[k].pid != 0 ? "busy" : "idle");
+        }
+        printf("compress %s\n", remoteCompress ? "on" : "off");
+        return 0;
+    }
+    if (strcmp(args[1], "close") == 0)
+    {
+        for (int k = 0; remoteConns != NULL && k < REMOTE_MAX_CONNS; k++)
+        {
+            if (remoteConns[k].fd >= 0 && remoteConns[k].pid == 0)
+            {
+                close(remoteConns[k].fd);
+                remoteConns[k].fd = -1;
+            }
+        }
+        return 0;
+    }
+    if (strcmp(args[1], "compress") == 0 && args[2] != NULL && (strcmp(args[2], "on") == 0 || strcmp(args[2], "off") == 0))
+    {
+#ifndef MINISHELL_ZLIB
+        if (strcmp(args[2], "on") == 0)
+        {
+            fprintf(stderr, "remote: built without zlib (make ZLIB=1)\n");
+            return 1;
+        }
+#endif
+        remoteCompress = strcmp(args[2], "on") == 0;
+        return 0;
+    }
+    fprintf(stderr, "Usage: remote [close|compress on|off]\n");
+    return 2;
+}
+
+void expand_command(Command *command, Arena *arena); // With the word expansion, which runs whole pipelines for $(...)
+
+// Launches all commands of the pipeline and returns the job tracking them, without waiting
+// A lone builtin runs to completion in the shell instead, setting lastStatus, and NULL is returned
+Job *launch_pipeline(Command *commands, int *numCommands, Arena *arena)
+{
+    int i;
+
+    // Words with $(...) get their values first, which runs the substitutions
+    TRACE_BEGIN("expand", *numCommands);
+    for (i = 0; i < *numCommands; i++)
+    {
+        if (commands[i].words != NULL)
+            expand_command(&commands[i], arena);
+    }
+    TRACE_END("expand", 0);
+
+    // A lone builtin runs right here in the shell, so cd/exit/export work and nothing is spawned
+    // With & it needs a child like any other job, and so does one whose output the shell captures
+    const Builtin *builtin = *numCommands == 1 && commands[0].group == NULL && commands[0].remote == NULL ? find_builtin(commands[0].args) : NULL;
+    if (builtin != NULL && !has_fan_out(&commands[0]) && !commands[0].background && !commands[0].captured)
+    {
+        StageStats *stages = arena_alloc(arena, sizeof(StageStats));
+        struct timespec pipelineStart = now_monotonic();
+
+        struct rusage before, after;
+        getrusage(RUSAGE_SELF, &before);
+        TRACE_BEGIN("builtin", 0);
+        lastStatus = redirect_prepare(&commands[0], arena) ? run_builtin_inprocess(builtin, &commands[0]) : 1;
+        redirect_finish(&commands[0]);
+        for (int r = 0; r < commands[0].numRedirs; r++)
+        {
+            if (commands[0].redirs[r].hints & IOHINT_DONTNEED)
+                redirect_drop_cache(commands[0].redirs[r].target);
+        }
+        TRACE_END("builtin", lastStatus);
+        getrusage(RUSAGE_SELF, &after);
+        if (commands[0].args[0] == NULL)
+        {
+            // NAME=value alone sets shell variables
+            for (int a = 0; a < commands[0].numAssigns; a++)
+                shell_assign(commands[0].assigns[a]);
+        }
+
+        StageStats *stage = &stages[0];
+        memset(stage, 0, sizeof(*stage));
+        stage->pid = getpid();
+        stage->args = commands[0].args;
+        stage->builtin = true;
+        stage->start = pipelineStart;
+        stage->end = now_monotonic();
+        stage->status = (lastStatus & 0xff) << 8; // As if it had exited with lastStatus
+        rusage_delta(&stage->usage, &before, &after);
+        report_pipeline(stages, 1, lastStatus, commands[0].timed, pipelineStart, stage->end, arena);
+        return NULL;
+    }
+
+    // Every process of the pipeline is tracked by its job, with one entry per stage plus room for fan-out movers
+    Job *job = job_new(*numCommands);
+    job->background = commands[0].background;
+    job->timed = commands[0].timed;
+    StageStats *stages = job->stages;
+
+    // Allocate memory for the pipe descriptors (released with the rest of the line)
+    PipeFD *pipes = arena_alloc(arena, (*numCommands - 1) * sizeof(PipeFD));
+
+    // Create the pipes, close-on-exec so that no child has to close the ones it doesn't use
+    int tmp_fds[2]; // Temporary file descriptors for pipe creation
+    TRACE_BEGIN("pipes", *numCommands - 1);
+    for (i = 0; i < *numCommands - 1; i++)
+    {
+        if (pipe2(tmp_fds, O_CLOEXEC) < 0)
+        {
+            perror("Couldn't create a pipe");
+            exit(EXIT_FAILURE);
+        }
+        pipes[i].read_fd = keep_above_stdio(tmp_fds[0]);
+        pipes[i].write_fd = keep_above_stdio(tmp_fds[1]);
+        set_pipe_size(pipes[i].write_fd, i);
+    }
+    TRACE_END("pipes", 0);
+
+    // Children must not inherit unflushed stdio buffers (and vfork children share ours)
+    fflush(stdout);
+
+    // Placed or limited stages set themselves up between fork and execve(), which posix_spawn() and the zygote can't do
+    bool placed = stage_placement_active();
+    int colocateFrom = placed ? colocate_base() : 0;
+    int cgroupProcs = placed && placement.numCgroupFiles > 0 ? cgroup_create(job) : -1;
+    StageSetup setup;
+
+    // A PATH change flushes the command hash, which also invalidates the paths kept in cached plans
+    command_hash_check_path(&commandHash, current_path());
+
+    // Execute commands in a loop (concurrently)
+    // Notice that even if, for example, cmd1 | cmd2 | cmd3 is the input, the loop will execute cmd1, cmd2, and cmd3 concurrently
+    // But it is not a problem, because the pipes are set up correctly... the OS will handle data dependencies and if cmd2 executes before cmd1,
+    // it will just wait for the data to be available in the pipe by cmd1
+    for (i = 0; i < *numCommands; i++)
+    {
+        // Builtins inside a pipeline need a child of their own, which only the fork path provides, and so do groups
+        bool inShell = commands[i].group != NULL; // Runs shell code in the child instead of a program
+        bool remote = commands[i].remote != NULL;   // Runs on an agent, whatever the name is there
+        builtin = inShell || remote ? NULL : find_builtin(commands[i].args);
+        inShell = inShell || builtin != NULL;
+
+        // The environment is the shared block itself, unless the command has NAME=value prefixes
+        commands[i].envp = commands[i].numAssigns > 0 ? env_with_overrides(commands[i].assigns, commands[i].numAssigns, arena) : shellEnv.vars;
+
+        // Resolve bare names against PATH, a missing command only skips its own stage
+        // Cached plans keep their path while no hashed command has been dropped since it was resolved
+        const char *pathOverride = inShell || remote ? NULL : command_assigned(&commands[i], "PATH");
+        if (pathOverride != NULL)
+        {
+            // PATH=... cmd searches its own PATH, bypassing the hash
+            struct stat st;
+            char *found = strchr(commands[i].command, '/') ? strdup(commands[i].command) : search_path(commands[i].command, pathOverride, &st);
+            commands[i].path = found ? arena_strndup(arena, found, strlen(found)) : NULL;
+            commands[i].pathGeneration = 0;
+            free(found);
+        }
+        else if (!inShell && !remote && (commands[i].path == NULL || commands[i].pathGeneration != commandHash.generation))
+        {
+            commands[i].path = lookup_command(commands[i].command);
+            commands[i].pathGeneration = commandHash.generation;
+        }
+        job->lastStage = job->numStages;
+        StageStats *stage = &stages[job->numStages++];
+        memset(stage, 0, sizeof(*stage));
+        stage->pid = -1;
+        stage->args = commands[i].args;
+        stage->builtin = inShell;
+        stage->start = now_monotonic();
+
+        if (!inShell && !remote && commands[i].path == NULL)
+        {
+            fprintf(stderr, "%s: command not found\n", commands[i].command);
+            continue;
+        }
+
+        // Files the job drops from the page cache when it is done
+        for (int r = 0; r < commands[i].numRedirs; r++)
+        {
+            if (commands[i].redirs[r].hints & IOHINT_DONTNEED)
+                job_drop_add(job, commands[i].redirs[r].target);
+        }
+
+        // Here-strings get their descriptors, released right after the launch
+        TRACE_BEGIN("redirect_prepare", commands[i].numRedirs);
+        bool prepared = redirect_prepare(&commands[i], arena);
+        TRACE_END("redirect_prepare", prepared);
+        if (!prepared)
+        {
+            redirect_finish(&commands[i]);
+            continue;
+        }
+
+        // Several > on one stage fan its output out to every file through a mover process
+        FanOut fan;
+        bool fanning = has_fan_out(&commands[i]);
+        if (fanning && !fan_out_prepare(&commands[i], &fan, arena))
+        {
+            redirect_finish(&commands[i]);
+            continue;
+        }
+
+        TRACE_BEGIN("spawn", i);
+        if (placed)
+        {
+            stage_setup_prepare(&setup, i, colocateFrom, cgroupProcs);
+        }
+        if (remote)
+        {
+            stage->pid = spawn_stage_remote(commands, i, *numCommands, pipes, job);
+        }
+        else if (inShell)
+        {
+            stage->pid = spawn_stage_fork(commands, i, *numCommands, pipes, builtin, job, placed ? &setup : NULL);
+        }
+        else if ((placed && spawnBackend != SPAWN_FORK) || (spawnBackend == SPAWN_POSIX && command_has_hints(&commands[i])))
+        {
+            // Hints apply to the open file, which posix_spawn() opens out of our reach
+            stage->pid = spawn_stage_vfork(commands, i, *numCommands, pipes, job, placed ? &setup : NULL);
+        }
+        else
+        {
+            switch (spawnBackend)
+            {
+            case SPAWN_POSIX:
+                stage->pid = spawn_stage_posix(commands, i, *numCommands, pipes, job);
+                break;
+            case SPAWN_VFORK:
+                stage->pid = spawn_stage_vfork(commands, i, *numCommands, pipes, job, NULL);
+                break;
+            case SPAWN_FORK:
+                stage->pid = spawn_stage_fork(commands, i, *numCommands, pipes, NULL, job, placed ? &setup : NULL);
+                break;
+            case SPAWN_ZYGOTE:
+                stage->pid = spawn_stage_zygote(commands, i, *numCommands, pipes, job, &stage->zygote);
+                break;
+            }
+        }
+        TRACE_END("spawn", stage->pid);
+        job_adopt(job, stage->pid);
+        job_watch_stage(job, stage);
+
+        if (fanning)
+        {
+            StageStats *mover = &stages[job->numStages++];
+            memset(mover, 0, sizeof(*mover));
+            mover->start = now_monotonic();
+            mover->pid = fan_out_start(&commands[i], &fan, pipes, *numCommands, job);
+            job_adopt(job, mover->pid);
+            job_watch_stage(job, mover);
+        }
+        redirect_finish(&commands[i]);
+    }
+
+    // Parent closes all pipe file descriptors
+    for (int i = 0; i < *numCommands - 1; i++)
+    {
+        close(pipes[i].read_fd);
+        close(pipes[i].write_fd);
+    }
+    if (cgroupProcs >= 0)
+    {
+        close(cgroupProcs);
+    }
+
+    // The last stage decides the pipeline's status (127 if it never started)
+    job->state = JOB_RUNNING;
+    job_update(job);
+    return job;
+}
+
+// Function to execute all commands in the pipeline
+void execute_commands(Command *commands, int *numCommands, Arena *arena)
+{
+    TRACE_BEGIN("launch", *numCommands);
+    Job *job = launch_pipeline(commands, numCommands, arena);
+    TRACE_END("launch", job != NULL ? job->numStages : 0);
+    if (job == NULL)
+        return;
+
+    // A background job only gets its number, the reaper picks it up later
+    if (job->background)
+    {
+        job_detach(job);
+        job->notified = job->state != JOB_DONE;
+        if (jobControl)
+            fprintf(stderr, "[%d] %d\n", job->id, job->stages[job->lastStage].pid);
+        lastStatus = 0;
+        return;
+    }
+    lastStatus = job_wait_foreground(job);
+}
+
+// Runs a command list in the shell itself, only its pipelines start processes
+// Returns the status of the last pipeline that ran, which is also left in lastStatus
+int run_node(Node *node, Arena *arena)
+{
+    switch (node->kind)
+    {
+    case NODE_PIPELINE:
+        execute_commands(node->commands, &node->numCommands, arena);
+        break;
+    case NODE_SEQUENCE:
+        run_node(node->left, arena);
+        run_node(node->right, arena);
+        break;
+    case NODE_AND:
+        if (run_node(node->left, arena) == 0)
+            run_node(node->right, arena);
+        break;
+    case NODE_OR:
+        if (run_node(node->left, arena) != 0)
+            run_node(node->right, arena);
+        break;
+    }
+    return lastStatus;
+}
+
+/* WORD EXPANSION AND COMMAND SUBSTITUTION */
+
+// How long a directory's entries are trusted when its change time can't be told apart from the scan
+#define DIR_CACHE_RACY_NS 20000000L // Covers the coarsest timestamp tick of the file systems we run on
+#define DIR_CACHE_BUCKETS 64        // Directories a line globs over are few
+#define DIR_CACHE_BUDGET (64 << 20) // Bytes a script's cache may hold before it starts over
+
+// One directory entry as pathname expansion needs it
+typedef struct
+{
+    char *name;         // Entry name
+    unsigned char type; // d_type, DT_UNKNOWN when the file system doesn't say
+} CachedEntry;
+
+// The entries of a directory, read once and reused while its modification time stays the same
+typedef struct CachedDir
+{
+    dev_t dev;               // Identity of the directory, so relative names survive a cd
+    ino_t ino;
+    struct timespec mtime;   // Modification time when it was read
+    bool racy;               // mtime was too close to the read to prove no change slipped in since
+    CachedEntry *entries;    // Everything but . and .., sorted by name
+    int count;               // Number of entries
+    struct CachedDir *next;  // Next directory in the same bucket
+} CachedDir;
+
+// Directory listings shared by every pattern of a line, or of a window of script lines
+// A listing is checked against the directory's mtime before each use, so a change in between is seen
+typedef struct
+{
+    CachedDir *buckets[DIR_CACHE_BUCKETS]; // Chains of directories by inode
+    Arena arena;                           // Listings, released all at once
+} DirCache;
+
+DirCache dirCache = {0};
+
+// Orders cached entries by name
+int cached_entry_compare(const void *a, const void *b)
+{
+    return strcmp(((const CachedEntry *)a)->name, ((const CachedEntry *)b)->name);
+}
+
+// Returns the listing of the directory at path, reading it again only if it changed since the last read
+// Returns NULL if it is not a directory that can be read
+CachedDir *dir_cache_get(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    CachedDir **bucket = &dirCache.buckets[(st.st_ino ^ st.st_dev * 31) % DIR_CACHE_BUCKETS];
+    CachedDir *dir = *bucket;
+    while (dir != NULL && (dir->ino != st.st_ino || dir->dev != st.st_dev))
+        dir = dir->next;
+    if (dir != NULL && !dir->racy && dir->mtime.tv_sec == st.st_mtim.tv_sec && dir->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        return dir;
+
+    DIR *stream = opendir(path);
+    if (stream == NULL)
+        return NULL;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (dir == NULL)
+    {
+        dir = arena_alloc(&dirCache.arena, sizeof(CachedDir));
+        dir->dev = st.st_dev;
+        dir->ino = st.st_ino;
+        dir->next = *bucket;
+        *bucket = dir;
+    }
+    dir->mtime = st.st_mtim;
+    dir->racy = (now.tv_sec - st.st_mtim.tv_sec) * 1000000000L + (now.tv_nsec - st.st_mtim.tv_nsec) < DIR_CACHE_RACY_NS;
+
+    // A stale listing stays in the arena until the cache starts over, a walk may still be going through it
+    int capacity = 64;
+    dir->entries = arena_alloc(&dirCache.arena, capacity * sizeof(CachedEntry));
+    dir->count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(stream)) != NULL)
+    {
+        if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+            continue;
+        if (dir->count == capacity)
+        {
+            dir->entries = arena_grow(&dirCache.arena, dir->entries, capacity * sizeof(CachedEntry), 2 * capacity * sizeof(CachedEntry));
+            capacity *= 2;
+        }
+        dir->entries[dir->count].name = arena_strndup(&dirCache.arena, entry->d_name, strlen(entry->d_name));
+        dir->entries[dir->count++].type = entry->d_type;
+    }
+    closedir(stream);
+    qsort(dir->entries, dir->count, sizeof(CachedEntry), cached_entry_compare);
+    return dir;
+}
+
+// Ends a line's use of the cache: a terminal starts over every line, a script once it outgrows DIR_CACHE_BUDGET
+void dir_cache_end_line(bool interactive)
+{
+    if (dirCache.arena.first == NULL)
+        return;
+    if (interactive)
+        arena_reset(&dirCache.arena);
+    else if (arena_footprint(&dirCache.arena) > DIR_CACHE_BUDGET)
+        arena_free(&dirCache.arena);
+    else
+        return;
+    memset(dirCache.buckets, 0, sizeof(dirCache.buckets));
+}
+
+// The fields a command's words expand to, built in the line's arena
+typedef struct
+{
+    char **fields;  // Finished fields, with room for a NULL after them
+    int count;      // Number of finished fields
+    int capacity;   // Room in fields
+    StrBuf current; // Field being built
+    StrBuf pattern; // The same field as a glob pattern, quoted characters escaped with backslashes
+    bool open;      // current is a field even while empty, "" makes an empty argument
+    bool globbing;  // Fields undergo pathname expansion (argv words, not assignments or targets)
+    bool glob;      // An unquoted *, ? or [ went into the field being built
+} Fields;
+
+// Adds a finished field
+void fields_append(Fields *f, char *field)
+{
+    if (f->count + 1 >= f->capacity)
+    {
+        int newCapacity = f->capacity ? 2 * f->capacity : INITIAL_ARGS;
+        f->fields = arena_grow(f->current.arena, f->fields, f->capacity * sizeof(char *), newCapacity * sizeof(char *));
+        f->capacity = newCapacity;
+    }
+    f->fields[f->count++] = field;
+    f->fields[f->count] = NULL;
+}
+
+// Returns true if the len bytes of a pattern component have an unescaped *, ?, or [ closed by a later ]
+bool glob_has_meta(const char *p, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (p[i] == '\\')
+            i++;
+        else if (p[i] == '*' || p[i] == '?' || (p[i] == '[' && memchr(p + i + 1, ']', len - i - 1) != NULL))
+            return true;
+    }
+    return false;
+}
+
+// Matches a NUL-terminated pattern component against a name; a leading . must be matched explicitly
+// *suffix and prefix* skip fnmatch, they are what scripts glob huge directories with
+bool glob_match(const char *comp, size_t len, const char *name)
+{
+    if (comp[0] == '*' && strpbrk(comp + 1, "*?[\\") == NULL)
+    {
+        size_t nameLen = strlen(name);
+        return name[0] != '.' && nameLen >= len - 1 && memcmp(name + nameLen - (len - 1), comp + 1, len - 1) == 0;
+    }
+    if (comp[len - 1] == '*' && strcspn(comp, "*?[\\") == len - 1)
+        return strncmp(name, comp, len - 1) == 0;
+    return fnmatch(comp, name, FNM_PERIOD) == 0;
+}
+
+// Returns true if the entry at path is a directory, asking the file system only when its type is unknown
+bool glob_is_dir(const char *path, unsigned char type)
+{
+    struct stat st;
+    if (type != DT_UNKNOWN && type != DT_LNK)
+        return type == DT_DIR;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Walks the components of pattern below path, whose first pathLen bytes are matched already (ending with a /)
+// Each complete match becomes a field, in sorted order
+void glob_walk(Fields *f, char *path, size_t pathLen, const char *pattern)
+{
+    size_t compLen = strcspn(pattern, "/");
+    const char *rest = pattern + compLen;
+    bool last = *rest == '\0';
+    while (*rest == '/')
+        rest++;
+    bool dirOnly = !last && *rest == '\0'; // A trailing / only matches directories, and keeps it
+
+    // A literal component is not looked up in its directory, only checked at the end
+    if (!glob_has_meta(pattern, compLen))
+    {
+        size_t len = pathLen;
+        for (size_t i = 0; i < compLen && len + 2 < PATH_MAX; i++)
+        {
+            i += pattern[i] == '\\' && i + 1 < compLen;
+            path[len++] = pattern[i];
+        }
+        path[len] = '\0';
+        struct stat st;
+        if (last || dirOnly)
+        {
+            if (lstat(path, &st) == 0 && (!dirOnly || glob_is_dir(path, DT_UNKNOWN)))
+            {
+                if (dirOnly)
+                    path[len++] = '/';
+                fields_append(f, arena_strndup(f->current.arena, path, len));
+            }
+            return;
+        }
+        path[len++] = '/';
+        glob_walk(f, path, len, rest);
+        return;
+    }
+
+    char *comp = arena_strndup(f->current.arena, pattern, compLen);
+    path[pathLen] = '\0';
+    CachedDir *dir = dir_cache_get(pathLen > 0 ? path : ".");
+    if (dir == NULL)
+        return;
+    CachedEntry *entries = dir->entries; // A nested walk may read the directory again and replace them
+    int count = dir->count;
+    for (int e = 0; e < count; e++)
+    {
+        if (!glob_match(comp, compLen, entries[e].name))
+            continue;
+        size_t nameLen = strlen(entries[e].name);
+        if (pathLen + nameLen + 2 >= PATH_MAX)
+            continue;
+        memcpy(path + pathLen, entries[e].name, nameLen + 1);
+        if (last)
+        {
+            fields_append(f, arena_strndup(f->current.arena, path, pathLen + nameLen));
+        }
+        else if (glob_is_dir(path, entries[e].type))
+        {
+            path[pathLen + nameLen] = '/';
+            if (dirOnly)
+                fields_append(f, arena_strndup(f->current.arena, path, pathLen + nameLen + 1));
+            else
+                glob_walk(f, path, pathLen + nameLen + 1, rest);
+        }
+    }
+}
+
+// Finishes the field being built, if there is one
+// A field with a pattern in it becomes the paths it matches, or stays as it is when nothing matches
+void fields_push(Fields *f)
+{
+    if (!f->open)
+        return;
+    int before = f->count;
+    if (f->glob)
+    {
+        char path[PATH_MAX];
+        const char *pattern = f->pattern.data;
+        size_t start = 0;
+        if (pattern[0] == '/')
+        {
+            path[start++] = '/';
+            pattern += strspn(pattern, "/");
+        }
+        glob_walk(f, path, start, pattern);
+    }
+    if (f->count == before)
+        fields_append(f, f->current.data != NULL ? f->current.data : "");
+    f->current = (StrBuf){f->current.arena, NULL, 0, 0};
+    f->pattern = (StrBuf){f->current.arena, NULL, 0, 0};
+    f->open = false;
+    f->glob = false;
+}
+
+// Adds len bytes of text to the field being built, and to its pattern when it may be globbed
+// Quoted text stays literal in the pattern; unquoted text with *, ? or [ makes the field a pattern
+void fields_text(Fields *f, const char *text, size_t len, bool quoted)
+{
+    strbuf_append(&f->current, text, len);
+    f->open = true;
+    if (!f->globbing)
+        return;
+    if (!quoted)
+    {
+        strbuf_append(&f->pattern, text, len);
+        for (size_t i = 0; i < len && !f->glob; i++)
+            f->glob = text[i] == '*' || text[i] == '?' || text[i] == '[';
+        return;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        if (strchr("*?[\\", text[i]) != NULL)
+            strbuf_append(&f->pattern, "\\", 1);
+        strbuf_append(&f->pattern, text + i, 1);
+    }
+}
+
+// Adds len bytes of text to the field being built
+// With split (an unquoted expansion), blanks end the field instead, and runs of them make no empty fields
+void fields_add(Fields *f, const char *text, size_t len, bool split, bool quoted)
+{
+    if (!split)
+    {
+        fields_text(f, text, len, quoted);
+        return;
+    }
+    for (size_t i = 0; i < len;)
+    {
+        size_t blank = strcspn(text + i, " \t\n");
+        if (blank > len - i)
+            blank = len - i;
+        if (blank > 0)
+        {
+            fields_text(f, text + i, blank, false);
+            i += blank;
+        }
+        if (i < len)
+        {
+            fields_push(f);
+            i++;
+        }
+    }
+}
+
+// Runs the command list of a $(...) with its stdout going into a pipe the shell reads through the event loop
+// Returns the output without its trailing newlines, in the arena; lastStatus is left at the list's status
+// A pipeline runs directly and a list as a group of its own, so the substitution never changes the shell
+char *command_substitute(const char *text, size_t len, Arena *arena)
+{
+    char *line = arena_strndup(arena, text, len);
+    if (line[strspn(line, " \t\r\n")] == '\0')
+        return "";
+    char *name = arena_strndup(arena, text, len); // Parsing unquotes the line in place
+    Node *root = parse_line(line, arena);
+    if (root == NULL)
+    {
+        lastStatus = 2;
+        return "";
+    }
+    if (root->kind != NODE_PIPELINE)
+        root = node_group(root, name, arena);
+    root->commands[0].captured = true;
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        perror("Couldn't create a pipe");
+        exit(EXIT_FAILURE);
+    }
+    Capture capture;
+    capture_start(&capture, keep_above_stdio(fds[0]), arena);
+
+    // The stages get the pipe as the shell's stdout while they launch, like the parallel executor's buffers
+    fflush(stdout);
+    int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[1]);
+    Job *job = launch_pipeline(root->commands, &root->numCommands, arena);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    // Read while it runs, a full pipe would stall it; a job stopped with ^Z is left alone
+    if (job != NULL)
+    {
+        job_wait(job);
+        bool stopped = job->state == JOB_STOPPED;
+        lastStatus = job_wait_foreground(job);
+        if (stopped)
+        {
+            event_unwatch(capture.watch);
+            capture.watch = 0;
+        }
+    }
+    while (capture.watch != 0)
+        wait_for_children();
+
+    while (capture.text.len > 0 && capture.text.data[capture.text.len - 1] == '\n')
+        capture.text.data[--capture.text.len] = '\0';
+    return capture.text.data;
+}
+
+// Home directory named by the len bytes of a ~ prefix: the user's own for ~ alone, or NULL for an unknown user
+const char *tilde_home(const char *name, size_t len, Arena *arena)
+{
+    if (len == 0)
+    {
+        const char *home = var_get(&shellEnv, "HOME", 4);
+        if (home == NULL)
+            home = var_get(&shellVars, "HOME", 4);
+        if (home != NULL)
+            return home;
+        struct passwd *pw = getpwuid(getuid());
+        return pw != NULL ? pw->pw_dir : NULL;
+    }
+    struct passwd *pw = getpwnam(arena_strndup(arena, name, len));
+    return pw != NULL ? pw->pw_dir : NULL;
+}
+
+// Value of the parameter expanded by the $ at word[i], with *end set right after the expansion
+// $? and $$ are formatted into number; returns NULL for an unset variable
+const char *parameter_value(const char *word, size_t i, size_t *end, char number[24])
+{
+    const char *name = word + i + 1;
+    size_t len;
+    if (name[0] == '{')
+    {
+        name++;
+        len = strchr(name, '}') - name; // The tokenizer made sure there is one
+        *end = i + len + 3;
+    }
+    else if (name[0] == '?' || name[0] == '$')
+    {
+        len = 1;
+        *end = i + 2;
+    }
+    else
+    {
+        for (len = 1; isalnum((unsigned char)name[len]) || name[len] == '_'; len++)
+            ;
+        *end = i + len + 1;
+    }
+
+    if (len == 1 && (name[0] == '?' || name[0] == '$'))
+    {
+        snprintf(number, 24, "%d", name[0] == '?' ? lastStatus : (int)shellPid);
+        return number;
+    }
+    if (!is_name(name, len))
+    {
+        fprintf(stderr, "minishell: ${%.*s}: bad substitution\n", (int)len, name);
+        return NULL;
+    }
+    const char *value = var_get(&shellVars, name, len);
+    return value != NULL ? value : var_get(&shellEnv, name, len);
+}
+
+// Adds the fields of one unexpanded word: removes its quotes and expands ~, $NAME, ${NAME}, $?, $$ and $(...)
+// With split, unquoted expansions are split into fields at blanks; globbing happens as the fields are pushed
+void expand_word(const char *word, Fields *f, bool split)
+{
+    Arena *arena = f->current.arena;
+    char number[24];
+    size_t i = 0;
+
+    // ~ or ~user up to the first /, unless part of it is quoted
+    if (word[0] == '~')
+    {
+        size_t len = strcspn(word + 1, "/'\"\\$");
+        const char *home = word[1 + len] == '\0' || word[1 + len] == '/' ? tilde_home(word + 1, len, arena) : NULL;
+        if (home != NULL)
+        {
+            fields_add(f, home, strlen(home), false, true);
+            i = 1 + len;
+        }
+    }
+
+    while (word[i] != '\0')
+    {
+        if (word[i] == '$' && word[i + 1] == '(')
+        {
+            size_t end = skip_substitution(word, i); // The tokenizer made sure there is one
+            char *output = command_substitute(word + i + 2, end - i - 3, arena);
+            fields_add(f, output, strlen(output), split, false);
+            i = end;
+        }
+        else if (word[i] == '$' && is_parameter(word + i))
+        {
+            size_t end;
+            const char *value = parameter_value(word, i, &end, number);
+            if (value != NULL)
+                fields_add(f, value, strlen(value), split, false);
+            i = end;
+        }
+        else if (word[i] == '\'')
+        {
+            // Single quotes keep everything literally
+            const char *close = strchr(word + i + 1, '\'');
+            fields_add(f, word + i + 1, close - word - i - 1, false, true);
+            i = close - word + 1;
+        }
+        else if (word[i] == '"')
+        {
+            // Double quotes honour backslashes before the characters they protect, and expansions are not split
+            f->open = true;
+            for (i++; word[i] != '"';)
+            {
+                if (word[i] == '\\' && word[i + 1] != '\0' && strchr("\"\\$`", word[i + 1]) != NULL)
+                {
+                    fields_add(f, word + i + 1, 1, false, true);
+                    i += 2;
+                }
+                else if (word[i] == '$' && word[i + 1] == '(')
+                {
+                    size_t end = skip_substitution(word, i);
+                    char *output = command_substitute(word + i + 2, end - i - 3, arena);
+                    fields_add(f, output, strlen(output), false, true);
+                    i = end;
+                }
+                else if (word[i] == '$' && is_parameter(word + i))
+                {
+                    size_t end;
+                    const char *value = parameter_value(word, i, &end, number);
+                    if (value != NULL)
+                        fields_add(f, value, strlen(value), false, true);
+                    i = end;
+                }
+                else
+                {
+                    size_t run = 1 + strcspn(word + i + 1, "\"\\$");
+                    fields_add(f, word + i, run, false, true);
+                    i += run;
+                }
+            }
+            i++;
+        }
+        else if (word[i] == '\\')
+        {
+            if (word[i + 1] != '\0')
+                fields_add(f, word + i + 1, 1, false, true);
+            i += word[i + 1] != '\0' ? 2 : 1;
+        }
+        else
+        {
+            // A literal run up to the next quote, backslash or $
+            size_t run = 1 + strcspn(word + i + 1, "'\"\\$");
+            fields_add(f, word + i, run, false, false);
+            i += run;
+        }
+    }
+}
+
+// Expands a word that must stay one field: a prefix assignment or a redirection target
+char *expand_single(const char *word, Arena *arena)
+{
+    Fields f = {NULL, 0, 0, {arena, NULL, 0, 0}, {arena, NULL, 0, 0}, true, false, false};
+    expand_word(word, &f, false);
+    fields_push(&f);
+    return f.fields[0];
+}
+
+// Rebuilds the command's argv, prefix assignments and redirection targets from their unexpanded words
+// Runs at each launch, so a cached plan gets fresh values every time
+void expand_command(Command *command, Arena *arena)
+{
+    Fields f = {NULL, 0, 0, {arena, NULL, 0, 0}, {arena, NULL, 0, 0}, false, true, false};
+    for (char **word = command->words; *word != NULL; word++)
+    {
+        expand_word(*word, &f, true);
+        fields_push(&f);
+    }
+    if (f.fields == NULL)
+    {
+        // Everything expanded to nothing, which runs like assignments alone
+        f.fields = arena_alloc(arena, sizeof(char *));
+        f.fields[0] = NULL;
+    }
+    command->args = f.fields;
+    command->command = command->args[0];
+    command->path = NULL; // The name may differ from the last launch
+    command->pathGeneration = 0;
+
+    if (command->numAssigns > 0)
+    {
+        command->assigns = arena_alloc(arena, command->numAssigns * sizeof(char *));
+        for (int a = 0; a < command->numAssigns; a++)
+            command->assigns[a] = expand_single(command->assignWords[a], arena);
+    }
+    for (int r = 0; r < command->numRedirs; r++)
+    {
+        if (command->redirs[r].word != NULL)
+            command->redirs[r].target = expand_single(command->redirs[r].word, arena);
+    }
+}
+
+/* INPUT SOURCES (INTERACTIVE AND BATCH MODE) */
+
+#define BATCH_CHUNK_SIZE (256 * 1024) // Bytes requested per read() in batch mode
+
+// Where command lines come from: the terminal (one fgets per line, with a prompt),
+// or a script/pipe read in large chunks (or mmap'ed) and split into lines in place
+typedef struct
+{
+    bool interactive; // Prompted, line-at-a-time terminal input
+    int fd;           // Descriptor read in batch mode
+    char *buffer;     // Chunk buffer, or the private mapping of the script
+    size_t capacity;  // Usable size of buffer, one extra byte is always kept for a '\0'
+    size_t start;     // Offset of the first byte not yet returned as a line
+    size_t end;       // Offset past the last valid byte in buffer
+    bool mapped;      // buffer is an mmap of the whole script
+    bool eof;         // No more data can be read from fd
+    char *tail;       // Copy of an unterminated last line that ends exactly on a page boundary
+    char *line;       // getline() buffer of interactive mode, reused across lines
+    size_t lineSize;  // Allocated size of line
+} InputSource;
+
+// Sets up a batch source reading fd, mapping it when it is a regular file
+void input_open_batch(InputSource *source, int fd)
+{
+    memset(source, 0, sizeof(*source));
+    source->fd = fd;
+
+    // Regular files are mapped privately, so lines can be split in place without copying
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            source->buffer = map;
+            source->capacity = st.st_size;
+            source->end = st.st_size;
+            source->mapped = true;
+            source->eof = true;
+            return;
+        }
+    }
+
+    // Pipes, terminals and anything else that can't be mapped are read in chunks
+    source->capacity = BATCH_CHUNK_SIZE;
+    source->buffer = malloc(source->capacity + 1);
+    if (!source->buffer)
+    {
+        perror("Failed to allocate memory for the input buffer");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Releases the buffer or mapping of a batch source
+void input_close(InputSource *source)
+{
+    if (source->interactive)
+    {
+        free(source->line);
+        return;
+    }
+
+    if (source->mapped)
+        munmap(source->buffer, source->capacity);
+    else
+        free(source->buffer);
+    free(source->tail);
+}
+
+// Returns the next line of a batch source, NUL-terminated in place without its '\n', or NULL at EOF
+char *input_next_batch_line(InputSource *source)
+{
+    while (1)
+    {
+        // A complete line is already buffered: terminate it where the newline was
+        char *line = source->buffer + source->start;
+        char *newline = memchr(line, '\n', source->end - source->start);
+        if (newline != NULL)
+        {
+            *newline = '\0';
+            source->start = newline - source->buffer + 1;
+            return line;
+        }
+
+        if (source->eof)
+        {
+            if (source->start == source->end)
+                return NULL;
+
+            // Unterminated last line
+            size_t len = source->end - source->start;
+            source->start = source->end;
+            if (!source->mapped || source->end % sysconf(_SC_PAGESIZE) != 0)
+            {
+                // Room for the terminator: the chunk buffer's spare byte, or the zero fill of the mapping's last page
+                line[len] = '\0';
+                return line;
+            }
+            source->tail = strndup(line, len);
+            return source->tail;
+        }
+
+        // Move the partial line to the front (or grow the buffer if it fills it) and read more
+        if (source->start > 0)
+        {
+            source->end -= source->start;
+            memmove(source->buffer, source->buffer + source->start, source->end);
+            source->start = 0;
+        }
+        else if (source->end == source->capacity)
+        {
+            source->capacity *= 2;
+            source->buffer = realloc(source->buffer, source->capacity + 1);
+            if (!source->buffer)
+            {
+                perror("Failed to allocate memory for the input buffer");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        ssize_t bytes = read(source->fd, source->buffer + source->end, source->capacity - source->end);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes < 0)
+            perror("Failed to read input");
+        if (bytes <= 0)
+            source->eof = true;
+        else
+            source->end += bytes;
+    }
+}
+
+#define PROMPT "\033[0;32mcmd> \033[0m" // Shown before each interactive line
+#define COMPLETION_LIST_MAX 200         // Candidates a second TAB lists before summing up the rest
+#define WORD_BREAKS " \t|&;<>()"        // Characters that end the word being completed
+
+// Keys of the line editor beyond single bytes
+enum
+{
+    KEY_UP = 256, // Arrows
+    KEY_DOWN,
+    KEY_RIGHT,
+    KEY_LEFT,
+    KEY_HOME,
+    KEY_END,
+    KEY_DELETE,
+    KEY_OTHER // Any other escape sequence, ignored
+};
+
+#define KEY_BACKSPACE 0x7f // What the terminal sends for Backspace; CTRL() from termios gives the others
+
+// Reads one key from the terminal, decoding the escape sequences of the arrows, Home, End and Delete
+// Returns -1 at EOF
+int edit_read_key(void)
+{
+    unsigned char c;
+    ssize_t bytes;
+    while ((bytes = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR)
+        ;
+    if (bytes <= 0)
+        return -1;
+    if (c != '\033')
+        return c;
+
+    // A sequence arrives all at once, while a lone Esc is followed by nothing for a while
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    unsigned char seq[2];
+    if (poll(&pfd, 1, 50) <= 0 || read(STDIN_FILENO, &seq[0], 1) != 1)
+        return '\033';
+    if ((seq[0] != '[' && seq[0] != 'O') || read(STDIN_FILENO, &seq[1], 1) != 1)
+        return KEY_OTHER;
+    switch (seq[1])
+    {
+    case 'A':
+        return KEY_UP;
+    case 'B':
+        return KEY_DOWN;
+    case 'C':
+        return KEY_RIGHT;
+    case 'D':
+        return KEY_LEFT;
+    case 'H':
+        return KEY_HOME;
+    case 'F':
+        return KEY_END;
+    }
+
+    // ESC [ number ~, and whatever else ends with a letter
+    int number = 0;
+    while (isdigit(seq[1]))
+    {
+        number = 10 * number + seq[1] - '0';
+        if (read(STDIN_FILENO, &seq[1], 1) != 1)
+            return KEY_OTHER;
+    }
+    while (!isalpha(seq[1]) && seq[1] != '~' && read(STDIN_FILENO, &seq[1], 1) == 1)
+        ;
+    if (seq[1] != '~')
+        return KEY_OTHER;
+    return number == 1 || number == 7 ? KEY_HOME : number == 4 || number == 8 ? KEY_END : number == 3 ? KEY_DELETE : KEY_OTHER;
+}
+
+// The line being edited, kept in the input source's buffer
+typedef struct
+{
+    InputSource *source; // Owns the buffer, source->line
+    size_t len;          // Bytes in the line
+    size_t cursor;       // Byte offset of the cursor
+} Editor;
+
+// Number of characters in the len bytes of UTF-8 text, one column each
+size_t utf8_length(const char *text, size_t len)
+{
+    size_t chars = 0;
+    for (size_t i = 0; i < len; i++)
+        chars += ((unsigned char)text[i] & 0xc0) != 0x80;
+    return chars;
+}
+
+// Redraws the line after prefix (the prompt, or the search status) with the cursor at its place, in one write
+void edit_redraw(const char *prefix, const Editor *e)
+{
+    static Arena arena;
+    StrBuf out = {&arena, NULL, 0, 0};
+    strbuf_printf(&out, "\r%s", prefix);
+    strbuf_append(&out, e->source->line, e->len);
+    strbuf_append(&out, "\033[K", 3);
+    if (e->cursor < e->len)
+        strbuf_printf(&out, "\033[%zuD", utf8_length(e->source->line + e->cursor, e->len - e->cursor));
+    if (write(STDOUT_FILENO, out.data, out.len) < 0)
+        perror("write");
+    arena_reset(&arena);
+}
+
+// Makes room for len bytes and a NUL in the line
+void edit_reserve(Editor *e, size_t len)
+{
+    InputSource *source = e->source;
+    if (len + 1 <= source->lineSize)
+        return;
+    source->lineSize = 2 * (len + 1) > 256 ? 2 * (len + 1) : 256;
+    source->line = realloc(source->line, source->lineSize);
+    if (!source->line)
+    {
+        perror("Failed to allocate memory for the input line");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Inserts the len bytes of text at the cursor, leaving the cursor after them
+void edit_insert(Editor *e, const char *text, size_t len)
+{
+    edit_reserve(e, e->len + len);
+    char *line = e->source->line;
+    memmove(line + e->cursor + len, line + e->cursor, e->len - e->cursor);
+    memcpy(line + e->cursor, text, len);
+    e->len += len;
+    e->cursor += len;
+}
+
+// Deletes the bytes from from to to, leaving the cursor at from
+void edit_delete(Editor *e, size_t from, size_t to)
+{
+    char *line = e->source->line;
+    memmove(line + from, line + to, e->len - to);
+    e->len -= to - from;
+    e->cursor = from;
+}
+
+// Replaces the whole line with the len bytes of text, with the cursor at the end
+void edit_replace(Editor *e, const char *text, size_t len)
+{
+    edit_reserve(e, len);
+    memmove(e->source->line, text, len);
+    e->len = e->cursor = len;
+}
+
+// Offset of the character before (step -1) or after (step 1) the one at pos, skipping UTF-8 continuation bytes
+size_t edit_step(const Editor *e, size_t pos, int step)
+{
+    const unsigned char *line = (const unsigned char *)e->source->line;
+    if (step < 0 && pos > 0)
+    {
+        for (pos--; pos > 0 && (line[pos] & 0xc0) == 0x80; pos--)
+            ;
+    }
+    else if (step > 0 && pos < e->len)
+    {
+        for (pos++; pos < e->len && (line[pos] & 0xc0) == 0x80; pos++)
+            ;
+    }
+    return pos;
+}
+
+// Ctrl-R: searches the history for the text typed next, newest first, and Ctrl-R again goes to an older match
+// Returns the key that ended the search; the line holds the match, or what it held before if it was cancelled
+int edit_search(Editor *e)
+{
+    char *original = strndup(e->source->line, e->len);
+    char query[256];
+    size_t queryLen = 0;
+    long match = -1;
+    bool failed = false;
+    int key;
+    while (1)
+    {
+        char status[sizeof(query) + 32];
+        snprintf(status, sizeof(status), "(%sreverse-i-search)`%.*s': ", failed ? "failed " : "", (int)queryLen, query);
+        edit_redraw(status, e);
+
+        key = edit_read_key();
+        long found = -2; // Not searched
+        if (key == CTRL('r') && queryLen > 0)
+            found = history_search(query, queryLen, false, match + 1);
+        else if ((key == KEY_BACKSPACE || key == CTRL('h')) && queryLen > 0)
+            found = history_search(query, --queryLen, false, 0);
+        else if (key >= ' ' && key < KEY_BACKSPACE && queryLen < sizeof(query))
+        {
+            query[queryLen++] = key;
+            found = history_search(query, queryLen, false, match >= 0 ? match : 0);
+        }
+        else if (key == CTRL('g') || key == CTRL('c'))
+        {
+            edit_replace(e, original, strlen(original));
+            break;
+        }
+        else if (key != CTRL('r'))
+        {
+            break;
+        }
+
+        failed = found == -1;
+        if (found >= 0)
+        {
+            size_t entryLen;
+            const char *entry = history_entry(found, &entryLen);
+            edit_replace(e, entry, entryLen);
+            match = found;
+        }
+    }
+    free(original);
+    return key;
+}
+
+// Orders completion candidates
+int candidate_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Adds the command names starting with the len bytes of prefix: the builtins, and every PATH command from the
+// command hash, which is filled for it once
+void complete_command(const char *prefix, size_t len, Fields *out)
+{
+    for (size_t b = 0; b < sizeof(builtins) / sizeof(builtins[0]); b++)
+    {
+        if (strncmp(builtins[b].name, prefix, len) == 0)
+            fields_append(out, (char *)builtins[b].name);
+    }
+    command_hash_fill(&commandHash);
+    for (size_t b = 0; b < commandHash.numBuckets; b++)
+    {
+        for (HashEntry *entry = commandHash.buckets[b]; entry != NULL; entry = entry->next)
+        {
+            if (strncmp(entry->name, prefix, len) == 0)
+                fields_append(out, entry->name);
+        }
+    }
+}
+
+// Adds the names in the directory part of word that start with its last component, directories with a / after them
+// The listing comes from the directory cache, so the TABs of one line read a directory once; its entries are
+// sorted, which makes the matches one run found by binary search
+void complete_file(const char *word, Fields *out)
+{
+    Arena *arena = out->current.arena;
+    const char *slash = strrchr(word, '/');
+    const char *base = slash != NULL ? slash + 1 : word;
+    size_t baseLen = strlen(base);
+    const char *dir = ".";
+    if (slash == word)
+    {
+        dir = "/";
+    }
+    else if (slash != NULL && word[0] == '~')
+    {
+        size_t nameLen = strcspn(word + 1, "/");
+        const char *home = tilde_home(word + 1, nameLen, arena);
+        if (home == NULL)
+            return;
+        StrBuf path = {arena, NULL, 0, 0};
+        strbuf_printf(&path, "%s%.*s", home, (int)(slash - word - 1 - nameLen), word + 1 + nameLen);
+        dir = path.data[0] != '\0' ? path.data : "/";
+    }
+    else if (slash != NULL)
+    {
+        dir = arena_strndup(arena, word, slash - word);
+    }
+
+    CachedDir *cached = dir_cache_get(dir);
+    if (cached == NULL)
+        return;
+    int low = 0, high = cached->count;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (strncmp(cached->entries[mid].name, base, baseLen) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    for (int i = low; i < cached->count && strncmp(cached->entries[i].name, base, baseLen) == 0; i++)
+    {
+        CachedEntry *entry = &cached->entries[i];
+        if (entry->name[0] == '.' && base[0] != '.')
+            continue;
+        bool isDir = entry->type == DT_DIR;
+        if (entry->type == DT_UNKNOWN || entry->type == DT_LNK)
+        {
+            StrBuf path = {arena, NULL, 0, 0};
+            strbuf_printf(&path, "%s/%s", dir, entry->name);
+            isDir = glob_is_dir(path.data, entry->type);
+        }
+        if (isDir)
+        {
+            StrBuf name = {arena, NULL, 0, 0};
+            strbuf_printf(&name, "%s/", entry->name);
+            fields_append(out, name.data);
+        }
+        else
+        {
+            fields_append(out, entry->name);
+        }
+    }
+}
+
+// Inserts the len bytes of a completed name, with a backslash before the characters the shell would interpret
+void edit_insert_escaped(Editor *e, const char *text, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (strchr(" \t|&;<>()$*?['\"\\`", text[i]) != NULL)
+            edit_insert(e, "\\", 1);
+        edit_insert(e, text + i, 1);
+    }
+}
+
+// Writes the candidates below the line in columns, at most COMPLETION_LIST_MAX of them
+void complete_list(char **names, int count)
+{
+    struct winsize ws;
+    int width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    int shown = count < COMPLETION_LIST_MAX ? count : COMPLETION_LIST_MAX;
+    size_t longest = 1;
+    for (int i = 0; i < shown; i++)
+    {
+        if (strlen(names[i]) > longest)
+            longest = strlen(names[i]);
+    }
+    int columns = width / (longest + 2) > 0 ? width / (longest + 2) : 1;
+    int rows = (shown + columns - 1) / columns;
+
+    static Arena arena;
+    StrBuf out = {&arena, NULL, 0, 0};
+    strbuf_append(&out, "\r\n", 2);
+    for (int r = 0; r < rows; r++)
+    {
+        for (int c = 0; c < columns && c * rows + r < shown; c++)
+            strbuf_printf(&out, "%-*s", (int)longest + 2, names[c * rows + r]);
+        strbuf_append(&out, "\r\n", 2);
+    }
+    if (shown < count)
+        strbuf_printf(&out, "... and %d more\r\n", count - shown);
+    if (write(STDOUT_FILENO, out.data, out.len) < 0)
+        perror("write");
+    arena_reset(&arena);
+}
+
+// TAB: completes the word before the cursor, as a command name when it starts a command and as a path otherwise
+// The candidates' longest common prefix is inserted, and a unique candidate gets a space after it (not after a /)
+// With nothing left to insert, a second TAB in a row lists the candidates
+void edit_complete(Editor *e, bool second)
+{
+    static Arena arena;
+    const char *line = e->source->line;
+
+    // The word is unescaped for the lookup: no backslashes or quotes
+    size_t start = e->cursor;
+    while (start > 0 && (strchr(WORD_BREAKS, line[start - 1]) == NULL || (start > 1 && line[start - 2] == '\\')))
+        start--;
+    StrBuf word = {&arena, NULL, 0, 0};
+    strbuf_append(&word, "", 0);
+    for (size_t i = start; i < e->cursor; i++)
+    {
+        if (line[i] == '\\' && i + 1 < e->cursor)
+            i++;
+        else if (line[i] == '\'' || line[i] == '"')
+            continue;
+        strbuf_append(&word, line + i, 1);
+    }
+
+    size_t before = start;
+    while (before > 0 && (line[before - 1] == ' ' || line[before - 1] == '\t'))
+        before--;
+    bool command = strchr(word.data, '/') == NULL && word.data[0] != '~' &&
+                   (before == 0 || strchr("|&;(", line[before - 1]) != NULL);
+
+    Fields candidates = {NULL, 0, 0, {&arena, NULL, 0, 0}, {&arena, NULL, 0, 0}, false, false, false};
+    size_t typed = word.len;
+    if (command)
+    {
+        complete_command(word.data, word.len, &candidates);
+    }
+    else
+    {
+        complete_file(word.data, &candidates);
+        const char *slash = strrchr(word.data, '/');
+        typed = slash != NULL ? word.len - (slash + 1 - word.data) : word.len;
+    }
+
+    if (candidates.count > 1)
+    {
+        // Builtins and PATH commands may share names
+        qsort(candidates.fields, candidates.count, sizeof(char *), candidate_compare);
+        int unique = 1;
+        for (int i = 1; i < candidates.count; i++)
+        {
+            if (strcmp(candidates.fields[i], candidates.fields[unique - 1]) != 0)
+                candidates.fields[unique++] = candidates.fields[i];
+        }
+        candidates.count = unique;
+    }
+
+    if (candidates.count == 0)
+    {
+        if (write(STDOUT_FILENO, "\a", 1) < 0)
+            perror("write");
+        arena_reset(&arena);
+        return;
+    }
+
+    size_t common = strlen(candidates.fields[0]);
+    for (int i = 1; i < candidates.count; i++)
+    {
+        size_t n = 0;
+        while (n < common && candidates.fields[i][n] == candidates.fields[0][n])
+            n++;
+        common = n;
+    }
+    if (common > typed)
+        edit_insert_escaped(e, candidates.fields[0] + typed, common - typed);
+    if (candidates.count == 1 && candidates.fields[0][common - 1] != '/')
+        edit_insert(e, " ", 1);
+    else if (candidates.count > 1 && common <= typed && second)
+        complete_list(candidates.fields, candidates.count);
+    arena_reset(&arena);
+}
+
+// Reads a line from the terminal in raw mode into source->line
+// Editing: the arrows, Home/End (Ctrl-A/Ctrl-E), Backspace/Delete, Ctrl-U/Ctrl-K/Ctrl-W to kill, Ctrl-L to clear;
+// Up/Down go through the history records starting with what was typed, Ctrl-R searches them, TAB completes
+// Returns false at EOF
+bool edit_line(InputSource *source, const struct termios *cooked)
+{
+    struct termios raw = *cooked;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    Editor e = {source, 0, 0};
+    edit_reserve(&e, 0);
+    long position = -1;  // History record shown, -1 for the line being typed
+    char *typed = NULL;  // The line being typed while a record is shown
+    size_t typedLen = 0;
+    bool refreshed = false;
+    int tabs = 0;        // TABs in a row
+    bool done = false, eof = false;
+    edit_redraw(PROMPT, &e);
+    while (!done)
+    {
+        int key = edit_read_key();
+        tabs = key == '\t' ? tabs + 1 : 0;
+        if ((key == KEY_UP || key == KEY_DOWN || key == CTRL('r')) && !refreshed)
+        {
+            history_refresh(); // Once per line, for what other shells added meanwhile
+            refreshed = true;
+        }
+        if (key == CTRL('r'))
+        {
+            key = edit_search(&e);
+            position = -1;
+            done = key == '\r' || key == '\n';
+            edit_redraw(PROMPT, &e);
+            continue;
+        }
+
+        char *line = source->line;
+        switch (key)
+        {
+        case -1:
+            eof = done = true;
+            break;
+        case '\r':
+        case '\n':
+            done = true;
+            break;
+        case '\t':
+            edit_complete(&e, tabs > 1);
+            break;
+        case CTRL('d'):
+            if (e.len == 0)
+                eof = done = true;
+            else if (e.cursor < e.len)
+                edit_delete(&e, e.cursor, edit_step(&e, e.cursor, 1));
+            break;
+        case CTRL('c'):
+            if (write(STDOUT_FILENO, "^C\r\n", 4) < 0)
+                break;
+            e.len = e.cursor = 0;
+            position = -1;
+            lastStatus = 128 + SIGINT;
+            break;
+        case CTRL('u'):
+            edit_delete(&e, 0, e.cursor);
+            break;
+        case CTRL('k'):
+            e.len = e.cursor;
+            break;
+        case CTRL('w'):
+        {
+            size_t from = e.cursor;
+            while (from > 0 && line[from - 1] == ' ')
+                from--;
+            while (from > 0 && line[from - 1] != ' ')
+                from--;
+            edit_delete(&e, from, e.cursor);
+            break;
+        }
+        case CTRL('l'):
+            if (write(STDOUT_FILENO, "\033[H\033[2J", 7) < 0)
+                break;
+            break;
+        case KEY_BACKSPACE:
+        case CTRL('h'):
+            edit_delete(&e, edit_step(&e, e.cursor, -1), e.cursor);
+            break;
+        case KEY_DELETE:
+            edit_delete(&e, e.cursor, edit_step(&e, e.cursor, 1));
+            break;
+        case KEY_LEFT:
+        case CTRL('b'):
+            e.cursor = edit_step(&e, e.cursor, -1);
+            break;
+        case KEY_RIGHT:
+        case CTRL('f'):
+            e.cursor = edit_step(&e, e.cursor, 1);
+            break;
+        case KEY_HOME:
+        case CTRL('a'):
+            e.cursor = 0;
+            break;
+        case KEY_END:
+        case CTRL('e'):
+            e.cursor = e.len;
+            break;
+        case KEY_UP:
+        case KEY_DOWN:
+        {
+            if (position < 0)
+            {
+                free(typed);
+                typed = strndup(line, e.len);
+                typedLen = e.len;
+            }
+            long next = -1;
+            if (key == KEY_UP)
+            {
+                next = history_search(typed, typedLen, true, position + 1);
+                if (next < 0)
+                    break; // Stay on the oldest match
+            }
+            else
+            {
+                size_t entryLen;
+                const char *entry;
+                for (long k = position - 1; k >= 0 && next < 0; k--)
+                {
+                    entry = history_entry(k, &entryLen);
+                    if (entryLen >= typedLen && memcmp(entry, typed, typedLen) == 0)
+                        next = k;
+                }
+                if (position < 0)
+                    break;
+            }
+            position = next;
+            if (position >= 0)
+            {
+                size_t entryLen;
+                const char *entry = history_entry(position, &entryLen);
+                edit_replace(&e, entry, entryLen);
+            }
+            else
+            {
+                edit_replace(&e, typed, typedLen); // Back to what was being typed
+            }
+            break;
+        }
+        default:
+            if (key < ' ' || key == KEY_BACKSPACE || key >= 256)
+                break; // Other control characters and sequences do nothing
+            char byte = key;
+            edit_insert(&e, &byte, 1);
+            position = -1;
+            break;
+        }
+        edit_redraw(PROMPT, &e);
+    }
+
+    if (write(STDOUT_FILENO, "\r\n", 2) < 0)
+        eof = true;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, cooked);
+    free(typed);
+    source->line[e.len] = '\0';
+    return !eof;
+}
+
+// Returns the next command line without its newline, or NULL once the input is exhausted
+// Interactive lines are read after showing the prompt, with the line editor when stdin is a terminal it can drive,
+// into a buffer that grows with the longest line; they go into the history
+char *input_next_line(InputSource *source)
+{
+    if (!source->interactive)
+        return input_next_batch_line(source);
+
+    fflush(stdout);
+    struct termios cooked;
+    if (tcgetattr(STDIN_FILENO, &cooked) == 0)
+    {
+        if (!edit_line(source, &cooked))
+            return NULL;
+    }
+    else
+    {
+        printf(PROMPT); // Prompt the user for input
+
+        // Read a line of input and exit the loop if EOF is encountered
+        if (getline(&source->line, &source->lineSize, stdin) < 0)
+        {
+            return NULL;
+        }
+
+        // Remove the trailing newline character from the input
+        source->line[strcspn(source->line, "\n")] = '\0';
+    }
+
+    history_add(source->line);
+    return source->line;
+}
+
+// Returns the next line of a multi-line construct (a here-document body), prompting with > on a terminal
+char *input_next_continuation(InputSource *source)
+{
+    if (!source->interactive)
+        return input_next_batch_line(source);
+
+    printf("> ");
+    fflush(stdout);
+    if (getline(&source->line, &source->lineSize, stdin) < 0)
+        return NULL;
+    source->line[strcspn(source->line, "\n")] = '\0';
+    return source->line;
+}
+
+// Reads the body of every << of the tree from the input, in line order, into the arena
+// Runs again for each execution of a cached plan, the bodies are not part of the cached line
+void read_heredocs(Node *node, InputSource *source, Arena *arena)
+{
+    if (node->kind != NODE_PIPELINE)
+    {
+        read_heredocs(node->left, source, arena);
+        read_heredocs(node->right, source, arena);
+        return;
+    }
+
+    for (int i = 0; i < node->numCommands; i++)
+    {
+        Command *command = &node->commands[i];
+        if (command->group != NULL)
+            read_heredocs(command->group, source, arena);
+        for (int r = 0; r < command->numRedirs; r++)
+        {
+            Redirect *redir = &command->redirs[r];
+            if (redir->kind != REDIR_HEREDOC)
+                continue;
+
+            StrBuf body = {arena, NULL, 0, 0};
+            strbuf_append(&body, "", 0);
+            while (1)
+            {
+                char *line = input_next_continuation(source);
+                if (line == NULL)
+                {
+                    fprintf(stderr, "warning: here-document delimited by end-of-file (wanted `%s')\n", redir->target);
+                    break;
+                }
+                if (redir->stripTabs)
+                    line += strspn(line, "\t");
+                if (strcmp(line, redir->target) == 0)
+                    break;
+                strbuf_append(&body, line, strlen(line));
+                strbuf_append(&body, "\n", 1);
+            }
+            redir->body = body.data;
+        }
+    }
+}
+
+// Reads past the bodies of the << of a line that did not parse, so their lines don't run as commands
+// The delimiters come from lexing line again, quietly since its errors were already reported
+void discard_heredocs(const char *line, InputSource *source, Arena *arena)
+{
+    char *copy = arena_strndup(arena, line, strlen(line)); // token_text() unquotes in place
+    Token *tokens;
+    fflush(stdout);
+    int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (devNull >= 0)
+    {
+        dup2(devNull, STDOUT_FILENO);
+        close(devNull);
+    }
+    int numTokens = tokenize(copy, arena, &tokens);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    for (int t = 0; t + 1 < numTokens; t++)
+    {
+        if (tokens[t].kind != TOK_HEREDOC || tokens[t + 1].kind != TOK_WORD)
+            continue;
+        const char *delimiter = token_text(copy, &tokens[t + 1]);
+        bool stripTabs = tokens[t].length == 3;
+        char *body;
+        while ((body = input_next_continuation(source)) != NULL && strcmp(body + (stripTabs ? strspn(body, "\t") : 0), delimiter) != 0)
+            ;
+        if (body == NULL)
+            return;
+    }
+}
+
+// Returns true for lines a script may contain that are not commands: blank lines and # comments
+bool is_batch_noise(const char *line)
+{
+    while (*line == ' ' || *line == '\t' || *line == '\r')
+        line++;
+    return *line == '\0' || *line == '#';
+}
 
-// Structure to hold file descriptors for a pipe
+/* PARALLEL EXECUTOR (&&& AND parallel -j N) */
+
+#define PARALLEL_AHEAD 4 // Tasks launched past the oldest unwritten one, in multiples of the job limit
+
+// One command line run by the parallel executor
 typedef struct
 {
-    int read_fd;  // Read end of the pipe
-    int write_fd; // Write end of the pipe
-} PipeFD;
+    char *line;     // Command line, parsed when its turn comes
+    Job *job;       // Its job while it runs, NULL before launch and once collected
+    int outFd;      // memfd collecting its stdout
+    int errFd;      // memfd collecting its stderr
+    int status;     // Exit status, once done
+    bool done;      // Finished, its output can be written once every earlier task's is
+} ParallelTask;
 
-// Function to trim leading and trailing whitespace in place
-void trim(char *str)
+// Splits line at every unquoted &&& outside ( ) and $( ), in place; those are left whole for parse_line, which
+// rejects a &&& inside them rather than having the line cut through the middle of a group
+// Returns the number of parts (1 without the operator), or -1 after printing an error for an empty part
+int split_parallel(char *line, Arena *arena, char ***partsOut)
 {
-    char *end;
-
-    // Trim leading space
-    while (isspace((unsigned char)*str))
-        str++;
+    int capacity = 4;
+    int count = 0;
+    char **parts = arena_alloc(arena, capacity * sizeof(char *));
+    char *start = line;
+    int depth = 0; // Parentheses open at c; unbalanced ones are left for parse_line to report
 
-    // If all spaces, str will point to '\0'
-    if (*str == 0)
+    for (char *c = line;; c++)
     {
-        return;
+        // Quoted text is skipped, an unterminated quote is left for parse_line to report
+        if (*c == '\'' && strchr(c + 1, '\'') != NULL)
+            c = strchr(c + 1, '\'');
+        else if (*c == '"')
+        {
+            while (c[1] != '\0' && c[1] != '"')
+                c += (c[1] == '\\' && c[2] != '\0') ? 2 : 1;
+            if (c[1] == '\0')
+                continue;
+            c++;
+        }
+        else if (*c == '\\' && c[1] != '\0')
+            c++;
+        else if (*c == '(')
+            depth++;
+        else if (*c == ')' && depth > 0)
+            depth--;
+        else if (*c == '\0' || (depth == 0 && c[0] == '&' && c[1] == '&' && c[2] == '&'))
+        {
+            bool last = *c == '\0';
+            *c = '\0';
+            if (!last || count > 0)
+            {
+                // Every part must contain a command
+                char *p = start;
+                while (*p == ' ' || *p == '\t')
+                    p++;
+                if (*p == '\0')
+                {
+                    printf("Error: Missing command.\n");
+                    return -1;
+                }
+            }
+            if (count == capacity)
+            {
+                parts = arena_grow(arena, parts, capacity * sizeof(char *), 2 * capacity * sizeof(char *));
+                capacity *= 2;
+            }
+            parts[count++] = start;
+            if (last)
+                break;
+            c += 2;
+            start = c + 1;
+        }
     }
 
-    // Find the end of the string
-    end = str + strlen(str) - 1;
-
-    // Trim trailing space
-    while (end > str && isspace((unsigned char)*end))
-        end--;
-
-    // Write new null terminator
-    *(end + 1) = '\0';
+    *partsOut = parts;
+    return count;
 }
 
-// Function to reset the command structure and free allocated resources
-void reset_commands(Command *commands, int *numCommands)
+// Parses line and launches it like a background job without a job number, with the shell's stdio
+// pointed at stdio[0..2] meanwhile so the children inherit those; builtins get a child, so cd or exit stay inside
+// With a cache the plan of an identical earlier line is reused; with bodies, its << read their lines from there,
+// which must hold nothing else but blank lines
+// Returns the job, or NULL when the line does not parse
+Job *launch_detached(char *line, const int stdio[3], PlanCache *cache, InputSource *bodies, Arena *arena)
 {
-    for (int i = 0; i < *numCommands; i++)
+    fflush(stdout);
+    fflush(stderr);
+    int saved[3];
+    for (int fd = 0; fd < 3; fd++)
+    {
+        saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        dup2(stdio[fd], fd);
+    }
+
+    Job *job = NULL;
+    char *text = arena_strndup(arena, line, strlen(line)); // Parsing unquotes the line in place
+    PlanEntry *plan = cache != NULL ? plan_cache_get(cache, line) : NULL;
+    Node *root = cache != NULL ? (plan ? plan->root : NULL) : parse_line(line, arena);
+    if (root != NULL && bodies != NULL)
     {
-        // Reset command and file redirection pointers
-        commands[i].command = NULL;
-        // Clear the args array if it's not NULL
-        for (int j = 0; commands[i].args[j] != NULL; j++)
+        read_heredocs(root, bodies, arena);
+        const char *rest = bodies->buffer + bodies->start;
+        if (strspn(rest, " \t\r\n") != bodies->end - bodies->start)
         {
-            commands[i].args[j] = NULL;
+            fprintf(stderr, "Error: Lines past the here-documents.\n");
+            root = NULL;
         }
-        commands[i].inputFile = NULL;
-        commands[i].outputFile = NULL;
     }
+    if (root != NULL)
+    {
+        // A list runs as a whole in a child of the shell, a pipeline directly
+        bool wasBackground = root->kind == NODE_PIPELINE && root->commands[0].background;
+        Node *pipeline = node_background(root, text, arena);
+        job = launch_pipeline(pipeline->commands, &pipeline->numCommands, arena);
+        job_copy_args(job);
+        if (pipeline == root)
+            root->commands[0].background = wasBackground; // A cached plan stays as it was parsed
+    }
+    if (plan != NULL)
+        plan_cache_release(cache, plan);
+
+    fflush(stdout);
+    fflush(stderr);
+    for (int fd = 0; fd < 3; fd++)
+    {
+        dup2(saved[fd], fd);
+        close(saved[fd]);
+    }
+    return job;
+}
+
+// Launches one task with its stdout and stderr going to fresh memfds and stdin from /dev/null
+void parallel_launch(ParallelTask *task, Arena *arena)
+{
+    task->outFd = memfd_create("parallel-out", MFD_CLOEXEC);
+    task->errFd = memfd_create("parallel-err", MFD_CLOEXEC);
+    int devNull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (task->outFd < 0 || task->errFd < 0 || devNull < 0)
+    {
+        perror("memfd_create failed");
+        exit(EXIT_FAILURE);
+    }
+
+    int stdio[3] = {devNull, task->outFd, task->errFd};
+    task->job = launch_detached(task->line, stdio, NULL, NULL, arena);
+    task->done = task->job == NULL;
+    task->status = 2; // Syntax error, unless it launched
+    close(devNull);
+}
 
-    *numCommands = 0; // Reset the number of commands to 0
+// Writes a finished task's buffered output to the shell's stdout and stderr, each in one piece
+void parallel_flush(ParallelTask *task)
+{
+    int fds[2][2] = {{task->outFd, STDOUT_FILENO}, {task->errFd, STDERR_FILENO}};
+    for (int k = 0; k < 2; k++)
+    {
+        if (lseek(fds[k][0], 0, SEEK_SET) == 0)
+            copy_fd(fds[k][0], fds[k][1]);
+        close(fds[k][0]);
+    }
 }
 
-// Function to parse a single command segment (without '|') into a Command structure
-void parse_single_command(char *segment, Command *command)
+// Runs the command lines with at most maxJobs of them at once, writing their outputs in line order
+// Returns the number of lines that failed (at most 255), like GNU parallel
+int parallel_run(char **lines, int numLines, int maxJobs)
 {
-    // Initialize pointers and counters at the start
-    command->command = NULL;
-    command->inputFile = NULL;
-    command->outputFile = NULL;
-    int argCount = 0; // Keep track of the number of arguments
+    if (maxJobs <= 0)
+        maxJobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
 
-    // Tokenize the segment string using space as a delimiter
-    char *token = strtok(segment, " ");
-    command->command = token;          // The first token is the shell command itself
-    command->args[argCount++] = token; // The first token is also the first argument
+    // Inside a forked builtin SIGCHLD was unblocked for the child, the reaper needs it blocked again
+    block_sigchld();
 
-    // Iterate oiver the rest of the tokens to parse arguments and redirections
-    while (token != NULL)
+    Arena arena = {NULL, NULL, NULL, 0}; // Parse memory, only needed while a task is launched
+    ParallelTask *tasks = calloc(numLines, sizeof(ParallelTask));
+    if (!tasks)
     {
-        token = strtok(NULL, " "); // Move to the next token
-        if (token == NULL)
-            break; // Skip NULL tokens
+        perror("Failed to allocate memory for the parallel tasks");
+        exit(EXIT_FAILURE);
+    }
+    for (int t = 0; t < numLines; t++)
+        tasks[t].line = lines[t];
 
-        if (strcmp(token, "<") == 0)
-        { // If token is input redirection symbol
-            token = strtok(NULL, " ");
-            command->inputFile = token; // Next token is the input file name
-        }
-        else if (strcmp(token, ">") == 0)
-        { // If token is output redirection symbol
-            token = strtok(NULL, " ");
-            command->outputFile = token; // Next token is the output file name
+    fflush(stdout);
+    int next = 0;     // First task not launched yet
+    int emitted = 0;  // First task whose output is not written yet
+    int running = 0;  // Tasks launched and not yet collected
+    int failures = 0;
+    while (emitted < numLines)
+    {
+        // Finished tasks keep their memfds until every earlier one is written, so a slow task holds back
+        // how far ahead the others may run
+        while (running < maxJobs && next < numLines && next - emitted < PARALLEL_AHEAD * maxJobs)
+        {
+            parallel_launch(&tasks[next++], &arena);
+            arena_reset(&arena);
+            running += !tasks[next - 1].done;
         }
-        else
+
+        // Collect the tasks that finished, then write out every completed prefix
+        reap_children();
+        bool progress = false;
+        for (int t = emitted; t < next; t++)
         {
-            // If it's not a redirection, consider it as part of the arguments
-            if (argCount < MAX_ARGS - 1)
-            { // Leave space for NULL terminator
-                command->args[argCount++] = token;
+            if (tasks[t].job != NULL && tasks[t].job->state == JOB_DONE)
+            {
+                tasks[t].status = tasks[t].job->status;
+                tasks[t].done = true;
+                job_free(tasks[t].job);
+                tasks[t].job = NULL;
+                running--;
+                progress = true;
             }
         }
+        while (emitted < next && tasks[emitted].done)
+        {
+            failures += tasks[emitted].status != 0;
+            parallel_flush(&tasks[emitted++]);
+            progress = true;
+        }
+
+        if (!progress && running > 0)
+            wait_for_children();
     }
 
-    command->args[argCount] = NULL; // NULL-terminate the arguments array
+    free(tasks);
+    arena_free(&arena);
+    return failures > 255 ? 255 : failures;
 }
 
-// Returns true if input is valid, false if there is an error
-bool verify_input(char *input)
+// parallel [-j N] [command line...]: runs the command lines (or stdin's lines) side by side
+// N defaults to the number of online CPUs
+int builtin_parallel(char **args)
 {
-    size_t input_length = strlen(input);
+    int maxJobs = 0;
+    int first = 1;
+    if (args[1] != NULL && strncmp(args[1], "-j", 2) == 0)
+    {
+        const char *value = args[1][2] != '\0' ? args[1] + 2 : args[2];
+        char *end;
+        maxJobs = value != NULL ? strtol(value, &end, 10) : 0;
+        if (value == NULL || *end != '\0' || maxJobs <= 0)
+        {
+            fprintf(stderr, "parallel: -j needs a positive number\n");
+            return 2;
+        }
+        first = args[1][2] != '\0' ? 2 : 3;
+    }
 
-    // Remove newline character at the end, if present
-    if (input[input_length - 1] == '\n')
+    // Each task parses its line in place, so work on copies
+    Arena arena = {NULL, NULL, NULL, 0};
+    int numLines = 0;
+    int capacity = 16;
+    char **lines = arena_alloc(&arena, capacity * sizeof(char *));
+    StrBuf input = {&arena, NULL, 0, 0};
+    if (args[first] == NULL)
     {
-        input[--input_length] = '\0'; // Adjust length accordingly
+        // No operands: one command line per line of stdin
+        char chunk[65536];
+        ssize_t bytes;
+        while ((bytes = read(STDIN_FILENO, chunk, sizeof(chunk))) != 0)
+        {
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            if (bytes < 0)
+            {
+                perror("parallel: read");
+                break;
+            }
+            strbuf_append(&input, chunk, bytes);
+        }
     }
 
-    // Check if the input is empty or only whitespace
-    if (input_length == 0 || strspn(input, " ") == input_length)
+    char *cursor = input.data;
+    for (int i = first;; i++)
     {
-        printf("Error: Input is empty or contains only spaces.\n");
-        return false;
+        char *line;
+        if (args[first] != NULL)
+        {
+            if (args[i] == NULL)
+                break;
+            line = arena_strndup(&arena, args[i], strlen(args[i]));
+        }
+        else
+        {
+            if (cursor == NULL || *cursor == '\0')
+                break;
+            line = cursor;
+            cursor += strcspn(cursor, "\n");
+            if (*cursor == '\n')
+                *cursor++ = '\0';
+            if (is_batch_noise(line))
+                continue;
+        }
+        if (numLines == capacity)
+        {
+            lines = arena_grow(&arena, lines, capacity * sizeof(char *), 2 * capacity * sizeof(char *));
+            capacity *= 2;
+        }
+        lines[numLines++] = line;
     }
 
-    // Check for input length constraints
-    if (input_length >= MAX_LINE)
+    int status = parallel_run(lines, numLines, maxJobs);
+    arena_free(&arena);
+    return status;
+}
+
+/* SERVER MODE (--server=PATH) */
+
+#define SERVER_MAX_LINE 65536      // Longest command line a request may carry
+#define SERVER_PLAN_CACHE (4 << 20) // Plan cache budget of a server that was not given --plan-cache
+
+// Protocol, over a SOCK_SEQPACKET Unix socket so every message is one request or one reply:
+// a request is the command line (no NUL needed), then the bodies of its here-documents on the lines after it,
+// with up to three descriptors in SCM_RIGHTS,
+// its stdin, stdout and stderr in that order (the missing ones are /dev/null);
+// each reply is one JSON line {"seq":N,...} where N counts the connection's requests from 0,
+// followed by the stats log fields: status, wall/user/sys time and one object per stage
+// Replies come as requests finish, not necessarily in order
+
+// A reply the client's socket had no room for yet
+typedef struct ServerReply
+{
+    struct ServerReply *next; // Next reply, in the order they are to be sent
+    size_t len;               // Length of text
+    char text[];              // The JSON line
+} ServerReply;
+
+// One connection of a client
+typedef struct
+{
+    int fd;                // Connected socket
+    int watch;             // Event loop watch on fd, 0 once the client hung up
+    int seq;               // Number of the next request it sends
+    int pending;           // Its requests queued or running, the client is freed with the last one
+    ServerReply *outbox;   // Replies waiting for room on the socket, oldest first
+    ServerReply **outEnd;  // Where the next waiting reply goes
+    int outWatch;          // Watch for room on a dup of fd while the outbox has replies, 0 otherwise
+} ServerClient;
+
+// A command line waiting for its turn or running
+typedef struct ServerRequest
+{
+    ServerClient *client;       // Where the reply goes
+    int seq;                    // Request number within the connection
+    char *line;                 // Command line, NUL-terminated
+    char *bodies;               // Lines after it, the here-document bodies of its <<, NUL-terminated
+    int stdio[3];               // Descriptors the client passed for stdin, stdout and stderr
+    Job *job;                   // Its job once launched
+    struct ServerRequest *next; // Next request of the queue or of the running list
+} ServerRequest;
+
+// State of the server
+struct
+{
+    ServerRequest *queue;     // Requests not launched yet, oldest first
+    ServerRequest **queueEnd; // Where the next request of the queue goes
+    ServerRequest *running;   // Requests launched and not yet answered
+    int numRunning;           // Length of running
+    int maxJobs;              // Concurrency cap (--server-jobs)
+    Arena arena;              // Parse memory, only needed while a request is launched
+} server = {NULL, &server.queue, NULL, 0, 0, {NULL, NULL, NULL, 0}};
+
+char *serverPath = NULL; // --server=PATH: run the command lines clients send on that socket
+
+// Throws away the replies still waiting for room, once the client is gone or its socket fails
+void server_client_drop_outbox(ServerClient *client)
+{
+    while (client->outbox != NULL)
     {
-        printf("Error: Input too long.\n");
-        return false;
+        ServerReply *reply = client->outbox;
+        client->outbox = reply->next;
+        free(reply);
     }
+    client->outEnd = &client->outbox;
+    if (client->outWatch != 0)
+        event_unwatch(client->outWatch);
+    client->outWatch = 0;
+}
 
-    // Check if the input starts or ends with a pipe
-    if (input[0] == '|' || input[input_length - 1] == '|')
+// Drops one of the client's requests, and the client once it has none left and is gone
+void server_client_release(ServerClient *client)
+{
+    if (--client->pending == 0 && client->watch == 0)
     {
-        printf("Error: Input cannot start or end with a pipe.\n");
-        return false;
+        server_client_drop_outbox(client);
+        close(client->fd);
+        free(client);
     }
+}
 
-    // Check for two consecutive pipes or improperly placed spaces around pipes
-    if (strstr(input, "||") != NULL)
+// Sends the waiting replies while the socket takes them, and stops waiting for room once none are left
+// A socket that fails otherwise loses them, the hangup shows up on the reading side
+void server_client_writable(void *data)
+{
+    ServerClient *client = data;
+    while (client->outbox != NULL)
     {
-        printf("Error: Improper use of pipes.\n");
-        return false;
+        ServerReply *reply = client->outbox;
+        if (send(client->fd, reply->text, reply->len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            perror("server: send");
+            server_client_drop_outbox(client);
+            return;
+        }
+        client->outbox = reply->next;
+        free(reply);
     }
+    client->outEnd = &client->outbox;
+    event_unwatch(client->outWatch);
+    client->outWatch = 0;
+}
 
-    // Verify if the input contains only pipes and/or spaces
-    if (strspn(input, " |") == input_length)
+// Sends one reply, or queues it behind those still waiting for room on the socket
+void server_send(ServerClient *client, const char *text, size_t len)
+{
+    if (client->outbox == NULL)
     {
-        printf("Error: Input contains only pipes and spaces.\n");
-        return false;
+        ssize_t sent;
+        while ((sent = send(client->fd, text, len, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0 && errno == EINTR)
+            ;
+        if (sent >= 0)
+            return;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            perror("server: send");
+            return;
+        }
     }
 
-    // Count pipes to estimate number of commands
-    int pipe_count = 0;
-    for (int i = 0; i < input_length; i++)
+    ServerReply *reply = malloc(sizeof(ServerReply) + len);
+    if (!reply)
     {
-        if (input[i] == '|')
-            pipe_count++;
+        perror("Failed to allocate memory for a server reply");
+        exit(EXIT_FAILURE);
     }
-    if (pipe_count >= MAX_COMMANDS)
+    reply->next = NULL;
+    reply->len = len;
+    memcpy(reply->text, text, len);
+    *client->outEnd = reply;
+    client->outEnd = &reply->next;
+    if (client->outWatch == 0)
     {
-        printf("Error: Too many commands.\n");
-        return false;
+        int fd = fcntl(client->fd, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            perror("server: dup");
+            server_client_drop_outbox(client);
+            return;
+        }
+        client->outWatch = event_watch_for(fd, true, server_client_writable, client, true);
     }
-
-    return true; // Input is valid
 }
 
-// Function to parse user input into an array of Command structures
-void parse_input(char *input, Command *commands, int *numCommands)
+// Answers a request and frees it, a client that hung up gets nothing
+void server_reply(ServerRequest *request, Job *job)
 {
-    *numCommands = 0;
-
-    // Trim leading and trailing whitespace
-    trim(input);
-
-    // Only proceed if the input is valid
-    if (!verify_input(input))
+    if (request->client->watch != 0)
     {
-        return;
+        Arena arena = {NULL, NULL, NULL, 0};
+        StrBuf json = {&arena, NULL, 0, 0};
+        strbuf_printf(&json, "{\"seq\":%d,", request->seq);
+        if (job != NULL)
+            pipeline_json(&json, job->stages, job->numStages, job->status, job->start, job->end);
+        else
+            strbuf_printf(&json, "\"status\":2,\"stages\":[]"); // Syntax error, reported on the client's stdout
+        strbuf_append(&json, "}\n", 2);
+        server_send(request->client, json.data, json.len);
+        arena_free(&arena);
     }
 
-    char *segments[MAX_COMMANDS]; // Array to hold pointers to each command segment
-    char *segment;                // Pointer to the current segment
+    for (int fd = 0; fd < 3; fd++)
+        close(request->stdio[fd]);
+    server_client_release(request->client);
+    free(request);
+}
 
-    // First split by '|'
-    segment = strtok(input, "|");
-    while (segment != NULL && *numCommands < MAX_COMMANDS)
+// Reads every request the client has sent, queueing them; a hangup or error drops the connection
+void server_client_ready(void *data)
+{
+    ServerClient *client = data;
+    for (;;)
     {
-        segments[(*numCommands)++] = segment; // Store the segment pointer
-        segment = strtok(NULL, "|");          // Move to the next segment
+        char line[SERVER_MAX_LINE + 1];
+        char control[CMSG_SPACE(3 * sizeof(int))];
+        struct iovec iov = {line, SERVER_MAX_LINE};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+        ssize_t bytes = recvmsg(client->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (bytes <= 0)
+        {
+            // Hung up: what is still queued is dropped, what runs finishes unanswered
+            event_unwatch(client->watch);
+            client->watch = 0;
+            server_client_drop_outbox(client);
+            client->pending++;
+            for (ServerRequest **link = &server.queue; *link != NULL;)
+            {
+                ServerRequest *request = *link;
+                if (request->client != client)
+                {
+                    link = &request->next;
+                    continue;
+                }
+                *link = request->next;
+                server_reply(request, NULL);
+            }
+            server.queueEnd = &server.queue;
+            while (*server.queueEnd != NULL)
+                server.queueEnd = &(*server.queueEnd)->next;
+            server_client_release(client);
+            return;
+        }
+
+        ServerRequest *request = calloc(1, sizeof(ServerRequest) + bytes + 1);
+        if (!request)
+        {
+            perror("Failed to allocate memory for a server request");
+            exit(EXIT_FAILURE);
+        }
+        request->client = client;
+        request->seq = client->seq++;
+        request->line = (char *)(request + 1);
+        memcpy(request->line, line, bytes);
+        request->line[bytes] = '\0';
+        request->bodies = request->line + strcspn(request->line, "\n");
+        if (*request->bodies != '\0')
+            *request->bodies++ = '\0';
+
+        int numFds = 0;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *fds = (int *)CMSG_DATA(cmsg);
+            for (int k = 0; k < count; k++)
+            {
+                if (numFds < 3)
+                    request->stdio[numFds++] = fds[k];
+                else
+                    close(fds[k]);
+            }
+        }
+        for (; numFds < 3; numFds++)
+            request->stdio[numFds] = open("/dev/null", numFds == 0 ? O_RDONLY | O_CLOEXEC : O_WRONLY | O_CLOEXEC);
+
+        client->pending++;
+        if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+        {
+            dprintf(request->stdio[2], "minishell: request longer than %d bytes\n", SERVER_MAX_LINE);
+            server_reply(request, NULL);
+            continue;
+        }
+        *server.queueEnd = request;
+        server.queueEnd = &request->next;
     }
+}
 
-    // Now parse each segment into a Command structure
-    for (int i = 0; i < *numCommands; i++)
+// Accepts the clients waiting on the listening socket
+void server_accept(void *data)
+{
+    int listenFd = *(int *)data;
+    int fd;
+    while ((fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0)
     {
-        parse_single_command(segments[i], &commands[i]);
+        ServerClient *client = calloc(1, sizeof(ServerClient));
+        if (!client)
+        {
+            perror("Failed to allocate memory for a server client");
+            exit(EXIT_FAILURE);
+        }
+        client->fd = fd;
+        client->outEnd = &client->outbox;
+        client->watch = event_watch(fd, server_client_ready, client, false);
     }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        perror("server: accept");
 }
 
-// Function to execute all commands in the pipeline
-void execute_commands(Command *commands, int *numCommands)
+// Launches queued requests while fewer than the cap run, and answers those that could not start
+void server_schedule(void)
 {
-    int i;
-
-    // Allocate memory for the pipe descriptors
-    PipeFD *pipes = malloc((*numCommands - 1) * sizeof(PipeFD));
-    if (!pipes)
+    while (server.queue != NULL && server.numRunning < server.maxJobs)
     {
-        perror("Failed to allocate memory for pipe descriptors");
-        exit(EXIT_FAILURE);
+        ServerRequest *request = server.queue;
+        server.queue = request->next;
+        if (server.queue == NULL)
+            server.queueEnd = &server.queue;
+
+        TRACE_BEGIN("serve", request->seq);
+        // The lines after the first are read as a script would be, from a source with nothing more to read
+        InputSource bodies;
+        memset(&bodies, 0, sizeof(bodies));
+        bodies.buffer = request->bodies;
+        bodies.capacity = bodies.end = strlen(request->bodies);
+        bodies.eof = true;
+        request->job = launch_detached(request->line, request->stdio, planCache.capacity > 0 ? &planCache : NULL, &bodies, &server.arena);
+        arena_reset(&server.arena);
+        TRACE_END("serve", request->job != NULL);
+        if (request->job == NULL)
+        {
+            server_reply(request, NULL);
+            continue;
+        }
+        request->next = server.running;
+        server.running = request;
+        server.numRunning++;
     }
+}
 
-    // Create the pipes
-    int tmp_fds[2]; // Temporary file descriptors for pipe creation
-    for (i = 0; i < *numCommands - 1; i++)
+// Answers the requests whose jobs finished
+void server_collect(void)
+{
+    for (ServerRequest **link = &server.running; *link != NULL;)
     {
-        if (pipe(tmp_fds) < 0)
+        ServerRequest *request = *link;
+        if (request->job->state != JOB_DONE)
         {
-            perror("Couldn't create a pipe");
-            free(pipes);
-            exit(EXIT_FAILURE);
+            link = &request->next;
+            continue;
         }
-        pipes[i].read_fd = tmp_fds[0];
-        pipes[i].write_fd = tmp_fds[1];
+        *link = request->next;
+        server.numRunning--;
+        server_reply(request, request->job);
+        job_free(request->job);
     }
+}
 
-    // Execute commands in a loop (concurrently)
-    // Notice that even if, for example, cmd1 | cmd2 | cmd3 is the input, the loop will execute cmd1, cmd2, and cmd3 concurrently
-    // But it is not a problem, because the pipes are set up correctly... the OS will handle data dependencies and if cmd2 executes before cmd1,
-    // it will just wait for the data to be available in the pipe by cmd1
-    for (i = 0; i < *numCommands; i++)
+// Serves command lines on the Unix socket at path until killed, at most maxJobs at once (0: one per online CPU)
+// Every request runs in this one shell, so its PATH lookups and parsed plans stay warm for the next
+int server_run(const char *path, int maxJobs)
+{
+    struct sockaddr_un un = {AF_UNIX, {0}};
+    if (strlen(path) >= sizeof(un.sun_path))
     {
-        pid_t pid = fork();
-        if (pid == 0)
-        { // Child process
+        fprintf(stderr, "%s: address too long\n", path);
+        return EXIT_FAILURE;
+    }
+    strcpy(un.sun_path, path);
+    static int listenFd;
+    listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    unlink(path); // A socket left by a server that is gone
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr *)&un, sizeof(un)) < 0 || listen(listenFd, SOMAXCONN) < 0)
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
 
-            /* HANDLE WITH PIPE REDIRECTION */
+    server.maxJobs = maxJobs > 0 ? maxJobs : sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    event_watch(listenFd, server_accept, &listenFd, true);
+    supervisor_start();
 
-            // Close all pipe fds not used by this command
-            for (int j = 0; j < *numCommands - 1; j++)
-            {
-                if (j != i - 1 && j != i)
-                {
-                    close(pipes[j].read_fd);
-                    close(pipes[j].write_fd);
-                }
-            }
+    // Everything happens in the handlers: accepts, requests and the exits of the jobs' processes
+    for (;;)
+    {
+        server_collect();
+        server_schedule();
+        event_loop_run();
+    }
+}
 
-            // If not the first command, get input from the previous pipe
-            if (i != 0)
+char *scriptPath = NULL; // Script to run in batch mode, NULL to read stdin
+bool printCacheStats = false; // --cache-stats: report cache counters on exit
+
+// Function to parse the command line options, returns false on an unknown option
+bool parse_options(int argc, char *argv[])
+{
+    bool planCacheGiven = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--spawn=posix") == 0)
+            spawnBackend = SPAWN_POSIX;
+        else if (strcmp(argv[i], "--spawn=vfork") == 0)
+            spawnBackend = SPAWN_VFORK;
+        else if (strcmp(argv[i], "--spawn=fork") == 0)
+            spawnBackend = SPAWN_FORK;
+        else if (strcmp(argv[i], "--spawn=zygote") == 0)
+            spawnBackend = SPAWN_ZYGOTE;
+        else if (strncmp(argv[i], "--plan-cache=", 13) == 0)
+        {
+            // Memory budget of the parsed-pipeline cache, with an optional K/M/G suffix
+            if (!parse_size(argv[i] + 13, &planCache.capacity))
             {
-                close(pipes[i - 1].write_fd);             // Close the write end of the previous pipe
-                dup2(pipes[i - 1].read_fd, STDIN_FILENO); // Duplicate the read end of the previous pipe to stdin (file descriptor = 0)
+                fprintf(stderr, "Invalid plan cache size: %s\n", argv[i] + 13);
+                return false;
             }
-
-            // If not the last command, set output to the next pipe
-            if (i != *numCommands - 1)
+            planCacheGiven = true;
+        }
+        else if (strncmp(argv[i], "--pipe-size=", 12) == 0)
+        {
+            if (!configure_pipe_sizes(argv[i] + 12))
             {
-                close(pipes[i].read_fd);                // Close the read end of the next pipe
-                dup2(pipes[i].write_fd, STDOUT_FILENO); // Duplicate the write end of the next pipe to stdout (file descriptor = 1)
+                fprintf(stderr, "Invalid pipe size list: %s\n", argv[i] + 12);
+                return false;
             }
-
-            /* HANDLE WITH INPUT/OUTPUT REDIRECTION */
-
-            if (commands[i].inputFile != NULL)
+        }
+        else if (strncmp(argv[i], "--stats-log=", 12) == 0)
+        {
+            statsLogFd = open(argv[i] + 12, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (statsLogFd < 0)
             {
-                FILE *fpIn = fopen(commands[i].inputFile, "r"); // Open file for reading
-                if (fpIn == NULL)
-                {
-                    perror("Failed to open input file");
-                    exit(EXIT_FAILURE); // Exit the child process if file opening fails
-                }
-                dup2(fileno(fpIn), STDIN_FILENO); // Duplicate file descriptor to stdin (file descriptor = 0)
-                fclose(fpIn);                     // Close the file after duplicating the file descriptor (not needed anymore
+                perror(argv[i] + 12);
+                return false;
             }
-
-            if (commands[i].outputFile != NULL)
+        }
+        else if (strcmp(argv[i], "--cache-stats") == 0)
+            printCacheStats = true;
+        else if (strncmp(argv[i], "--trace=", 8) == 0)
+        {
+            // Tracing from the start, with the Chrome trace written when the shell exits (exit builtin included)
+            if (!trace_enable(false))
+                return false;
+            traceRing.exitPath = argv[i] + 8;
+            traceRing.owner = getpid();
+            atexit(trace_exit_dump);
+        }
+        else if (strncmp(argv[i], "--agent=", 8) == 0)
+            agentAddress = argv[i] + 8;
+        else if (strncmp(argv[i], "--server=", 9) == 0)
+            serverPath = argv[i] + 9;
+        else if (strncmp(argv[i], "--server-jobs=", 14) == 0)
+        {
+            char *end;
+            server.maxJobs = strtol(argv[i] + 14, &end, 10);
+            if (argv[i][14] == '\0' || *end != '\0' || server.maxJobs <= 0)
             {
-                FILE *fpOut = fopen(commands[i].outputFile, "w"); // Open file for writing (this creates the file if it doesn't exist)
-                if (fpOut == NULL)
-                {
-                    perror("Failed to open output file");
-                    exit(EXIT_FAILURE); // Exit the child process if file creation fails
-                }
-                dup2(fileno(fpOut), STDOUT_FILENO); // Duplicate file descriptor to stdout (file descriptor = 1)
-                fclose(fpOut);                      // Close the file after duplicating the file descriptor (not needed anymore)
+                fprintf(stderr, "Invalid server job count: %s\n", argv[i] + 14);
+                return false;
             }
+        }
+        else if (strcmp(argv[i], "--event-loop=io_uring") == 0)
+            events.preferEpoll = false;
+        else if (strcmp(argv[i], "--event-loop=epoll") == 0)
+            events.preferEpoll = true;
+        else if (argv[i][0] != '-' && scriptPath == NULL)
+            scriptPath = argv[i]; // First operand is the script to run
+        else
+        {
+            fprintf(stderr, "Usage: %s [--spawn=posix|vfork|fork|zygote] [--plan-cache=BYTES[K|M|G]] [--cache-stats] [--pipe-size=SIZE[,SIZE...]] [--stats-log=FILE] [--event-loop=io_uring|epoll] [--trace=FILE] [--agent=HOST:PORT|PATH] [--server=PATH] [--server-jobs=N] [script]\n", argv[0]);
+            return false;
+        }
+    }
 
-            /* EXECUTING THE COMMAND */
+    // A server sees the same lines over and over, its plans are cached unless told otherwise
+    if (serverPath != NULL && !planCacheGiven)
+        planCache.capacity = SERVER_PLAN_CACHE;
 
-            char *envp[] = {NULL};
-            if (execve(commands[i].command, commands[i].args, envp) == -1)
-            {
-                perror("execve failed");
+    return true;
+}
 
-                // If not the first command, stdin may be duplicated from a pipe.
-                if (i != 0)
-                {
-                    close(STDIN_FILENO);
-                }
+// Benchmarks and fuzzers include this file and provide their own main()
+#ifndef MINISHELL_NO_MAIN
+int main(int argc, char *argv[])
+{
+    // Select the runtime options (spawn backend, ...)
+    if (!parse_options(argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
 
-                // If not the last command, stdout may be duplicated to a pipe.
-                if (i != *numCommands - 1)
-                {
-                    close(STDOUT_FILENO);
-                }
+    // Arena holding the commands, argv vectors and pipes of the current line
+    Arena lineArena = {NULL, NULL, NULL};
 
-                // Exit the child process if execve fails
-                exit(EXIT_FAILURE);
-            }
+    // Batch mode for scripts and non-terminal stdin: chunked/mmap'ed input and no prompt
+    InputSource source;
+    if (scriptPath != NULL)
+    {
+        int fd = open(scriptPath, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            perror(scriptPath);
+            return EXIT_FAILURE;
         }
+        input_open_batch(&source, fd);
+    }
+    else if (!isatty(STDIN_FILENO))
+    {
+        input_open_batch(&source, STDIN_FILENO);
+    }
+    else
+    {
+        memset(&source, 0, sizeof(source));
+        source.interactive = true;
     }
 
-    // Parent closes all pipe file descriptors
-    for (int i = 0; i < *numCommands - 1; i++)
+    // Children inherit the shell's environment, kept in a block they get without copying
+    env_init();
+
+    // An agent runs other shells' remote stages instead of commands of its own
+    if (agentAddress != NULL)
     {
-        close(pipes[i].read_fd);
-        close(pipes[i].write_fd);
+        return agent_serve(agentAddress);
     }
 
-    // Free the dynamically allocated memory for pipes
-    free(pipes);
+    // A server runs the lines its clients send instead of reading its own, away from any terminal
+    if (serverPath != NULL)
+    {
+        job_control_init(false);
+        if (spawnBackend == SPAWN_ZYGOTE)
+        {
+            zygote_start();
+        }
+        return server_run(serverPath, server.maxJobs);
+    }
 
-    // Wait for all child processes
-    while (wait(NULL) > 0)
-        ;
-}
+    // A terminal session shares the history file with the other shells
+    if (source.interactive)
+    {
+        history_init();
+    }
 
-int main()
-{
-    char input[MAX_LINE]; // Buffer for the user input
+    // SIGCHLD goes through a signalfd from now on, and a terminal gets job control
+    job_control_init(source.interactive);
 
-    // Initiate array of commands
-    Command commands[MAX_COMMANDS];
-    for (int i = 0; i < MAX_COMMANDS; i++)
+    // The zygote starts now, while the shell is small, and takes the launches over from it
+    if (spawnBackend == SPAWN_ZYGOTE)
     {
-        commands[i].args = malloc(MAX_ARGS * sizeof(char *)); // Allocate memory for arguments
+        zygote_start();
     }
 
     // Main loop to continuously accept user commands
-    while (1)
+    char *line;
+    while ((line = input_next_line(&source)) != NULL)
     {
-        printf("\033[0;32mcmd> \033[0m"); // Prompt the user for input
+        // Scripts may contain blank lines, comments and a #! line
+        if (!source.interactive && is_batch_noise(line))
+        {
+            continue;
+        }
+        TRACE_BEGIN("line", 0);
 
-        // Read a line of input and exit the loop if EOF is encountered
-        if (!fgets(input, MAX_LINE, stdin))
+        // cmd1 &&& cmd2 &&& ...: the parts run side by side through the parallel executor
+        char **parts;
+        int numParts = strstr(line, "&&&") != NULL ? split_parallel(line, &lineArena, &parts) : 1;
+        if (numParts != 1)
         {
-            break;
+            if (numParts > 1)
+                lastStatus = parallel_run(parts, numParts, 0);
+            TRACE_END("line", lastStatus);
+            arena_reset(&lineArena);
+            dir_cache_end_line(source.interactive);
+            job_notify(source.interactive);
+            continue;
         }
 
-        // Remove the trailing newline character from the input
-        input[strcspn(input, "\n")] = '\0';
+        // Here-document bodies follow the line in the input, and reading them may reuse the line's buffer
+        bool heredocs = strstr(line, "<<") != NULL;
+        char *text = line; // The line as read, kept for discard_heredocs() since parsing unquotes it in place
+        if (heredocs)
+        {
+            line = arena_strndup(&lineArena, line, strlen(line));
+            text = arena_strndup(&lineArena, line, strlen(line));
+        }
 
-        // Parse the input into commands
-        int numCommands = 0;                        // Number of parsed commands
-        parse_input(input, commands, &numCommands); // Parse the input
+        // Parse the input into commands, or reuse the plan cached for an identical line
+        Node *root; // Parsed command list
+        PlanEntry *plan = NULL;
+        if (planCache.capacity > 0)
+        {
+            plan = plan_cache_get(&planCache, line);
+            root = plan ? plan->root : NULL;
+        }
+        else
+        {
+            root = parse_line(line, &lineArena); // Parse the input
+        }
 
         // printf("\n\n***** DEBUGGING *****\n\n");
         // // Debugging: print the parsed commands
@@ -381,22 +9282,66 @@ int main()
         //         printf("%s ", commands[i].args[j]);
         //     }
         //     printf("\n");
-        //     printf("Input file: %s\n", commands[i].inputFile);
-        //     printf("Output file: %s\n\n", commands[i].outputFile);
+        //     for (int r = 0; r < commands[i].numRedirs; r++)
+        //     {
+        //         printf("Redirect fd %d: %s\n", commands[i].redirs[r].fd, commands[i].redirs[r].target);
+        //     }
+        //     printf("\n");
         // }
 
-        // Execute the parsed commands
-        execute_commands(commands, &numCommands);
+        // Execute the parsed commands, if the line was valid
+        if (root != NULL && heredocs)
+        {
+            read_heredocs(root, &source, &lineArena);
+        }
+        else if (heredocs)
+        {
+            discard_heredocs(text, &source, &lineArena);
+        }
+        if (root != NULL)
+        {
+            run_node(root, &lineArena);
+        }
+        if (plan != NULL)
+        {
+            plan_cache_release(&planCache, plan);
+        }
+
+        TRACE_END("line", lastStatus);
 
-        // Reset the command structures and the counter for the next iteration
-        reset_commands(commands, &numCommands);
+        // Release the command structures of this line all at once for the next iteration
+        arena_reset(&lineArena);
+        dir_cache_end_line(source.interactive);
+
+        // Report background jobs that finished or stopped meanwhile, before the next prompt
+        job_notify(source.interactive);
+    }
+
+    if (printCacheStats)
+    {
+        print_cache_stats(stderr);
     }
 
     // Prevent memory leaks by freeing allocated memory
-    for (int i = 0; i < MAX_COMMANDS; i++)
+    arena_free(&lineArena);
+    arena_free(&dirCache.arena);
+    history_close();
+    plan_cache_free(&planCache);
+    free(pipeSizes);
+    input_close(&source);
+    if (scriptPath != NULL)
     {
-        free(commands[i].args);
+        close(source.fd);
     }
+    command_hash_clear(&commandHash);
+    free(commandHash.buckets);
+    free(commandHash.pathValue);
+    job_table_free();
+    stage_reset();
+    event_loop_close();
+    var_block_free(&shellVars);
+    zygote_stop();
 
-    return 0; // End of program
+    return lastStatus; // End of program, with the status of the last pipeline like other shells
 }
+#endif